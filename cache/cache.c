@@ -30,28 +30,6 @@
 //#define DEBUG_ON 
 #define ADDRESS_LENGTH 64
 
-/* Globals set by command line args */
-int verbosity_cache = 0; /* print trace if set */
-int s = 0; /* set index bits */
-int b = 0; /* block offset bits */
-int E = 0; /* associativity */
-
-/* Derived from command line args */
-int S; /* number of sets */
-int B; /* block size (bytes) */
-
-/* Counters used to record cache statistics in printSummary().
-   test-cache uses these numbers to verify correctness of the cache. */
-
-//Increment when a miss occurs
-int miss_count = 0;
-
-//Increment when a hit occurs
-int hit_count = 0;
-
-//Increment when an eviction occurs
-int eviction_count = 0;
-
 /* 
  * A possible hierarchy for the cache. The helper functions defined below
  * are based on this cache structure.
@@ -68,16 +46,6 @@ typedef struct cache_set {
     cache_line_t *lines;
 } cache_set_t;
 
-typedef struct cache {
-    cache_set_t *sets;
-} cache_t;
-
-cache_t cache;
-mem_addr_t s_mask;
-
-
-/* TODO: add more globals, structs, macros if necessary */
-
 /* 
  * Initialize the cache according to specified arguments
  * Called by cache-runner so do not modify the function signature
@@ -85,40 +53,44 @@ mem_addr_t s_mask;
  * The code provided here shows you how to initialize a cache structure
  * defined above. It's not complete and feel free to modify/add code.
  */
-void initCache(int s_in, int b_in, int E_in)
+cache_t *initCache(int s_in, int b_in, int E_in)
 {
     /* see cache-runner for the meaning of each argument */
-    s = s_in;
-    b = b_in;
-    E = E_in;
-    S = (unsigned int) pow(2, s);
-    B = (unsigned int) pow(2, b);
+    cache_t *cache = (cache_t *) calloc(1, sizeof(cache_t));
+    int S, E, B;
+    cache->s = s_in;
+    cache->b = b_in;
+    cache->E = E = E_in;
+    cache->S = S = (unsigned int) pow(2, s_in);
+    cache->B = B = (unsigned int) pow(2, b_in);
 
     int i, j;
-    cache.sets = (cache_set_t*) calloc(S, sizeof(cache_set_t));
+    cache->sets = (cache_set_t*) calloc(S, sizeof(cache_set_t));
     for (i=0; i < S; i++){
-        cache.sets[i].lines = (cache_line_t*) calloc(E, sizeof(cache_line_t));
+        cache->sets[i].lines = (cache_line_t*) calloc(E, sizeof(cache_line_t));
         for (j=0; j<E; j++){
-            cache.sets[i].lines[j].valid = 0;
-            cache.sets[i].lines[j].tag = 0;
-            cache.sets[i].lines[j].lru = 0;
-            cache.sets[i].lines[j].data = calloc(B, sizeof(byte_t));
+            cache->sets[i].lines[j].valid = 0;
+            cache->sets[i].lines[j].tag = 0;
+            cache->sets[i].lines[j].lru = 0;
+            cache->sets[i].lines[j].data = calloc(B, sizeof(byte_t));
         }
     }
     /* TODO: add more code for initialization */
-    s_mask = (mem_addr_t) (S - 1);
+    cache->s_mask = (mem_addr_t) (S - 1);
+    return cache;
 }
 
 /* 
  * Free allocated memory. Feel free to modify it
  */
-void freeCache()
+void freeCache(cache_t *cache)
 {
     int i;
-    for (i = 0; i < S; i++){
-        free(cache.sets[i].lines);     
+    for (i = 0; i < cache->S; i++){
+        free(cache->sets[i].lines);     
     }
-    free(cache.sets);
+    free(cache->sets);
+    free(cache);
 }
 
 /* TODO:
@@ -126,10 +98,11 @@ void freeCache()
  * On hit, return the cache line holding the address
  * On miss, returns NULL
  */
-cache_line_t *get_line(word_t addr)
+cache_line_t *get_line(cache_t *cache, word_t addr)
 {
-    mem_addr_t tag_add = addr >> (s + b);
-    cache_set_t cache_set = cache.sets[(mem_addr_t) ((addr >> b) & s_mask)];
+    int E = cache->E;
+    mem_addr_t tag_add = addr >> (cache->s + cache->b);
+    cache_set_t cache_set = cache->sets[(mem_addr_t) ((addr >> cache->b) & cache->s_mask)];
     int i;
     for (i = 0; i < E; i++) {
         if (cache_set.lines[i].tag == tag_add){
@@ -155,10 +128,11 @@ cache_line_t *get_line(word_t addr)
  * Select the line to fill with the new cache line
  * Return the cache line selected to filled in by addr
  */
-cache_line_t *select_line(word_t addr)
+cache_line_t *select_line(cache_t *cache, word_t addr)
 {
-    mem_addr_t tag_add = addr >> (s + b);
-    cache_set_t cache_set = cache.sets[(mem_addr_t) ((addr >> b) & s_mask)];
+    int E = cache->E;
+    mem_addr_t tag_add = addr >> (cache->s + cache->b);
+    cache_set_t cache_set = cache->sets[(mem_addr_t) ((addr >> cache->b) & cache->s_mask)];
     int count = 0;
     int biggest_I = 0;
     unsigned int farLru = 0;
@@ -185,7 +159,7 @@ cache_line_t *select_line(word_t addr)
         }  
         k++;     
     }
-        eviction_count++;
+        cache->eviction_count++;
         cache_set.lines[biggest_I].lru = 0;
         cache_set.lines[biggest_I].tag = tag_add;
     } else {  
@@ -200,13 +174,13 @@ cache_line_t *select_line(word_t addr)
  * Check if the address is hit in the cache, updating hit and miss data. 
  * Return True if pos hits in the cache.
  */
-bool check_hit(word_t pos) 
+bool check_hit(cache_t *cache, word_t pos) 
 {
-    if(get_line(pos)){
-        hit_count++;
+    if(get_line(cache, pos)){
+        cache->hit_count++;
         return 1;
     }
-    miss_count++;
+    cache->miss_count++;
     return 0;   
 }
 
@@ -216,9 +190,9 @@ bool check_hit(word_t pos)
  * If block is not NULL, copy the data from block into the cache line. 
  * Return True if a line was evicted.
  */ 
-bool handle_miss(word_t pos, void *block, word_t *evicted_pos, void *evicted_block) 
+bool handle_miss(cache_t *cache, word_t pos, void *block, word_t *evicted_pos, void *evicted_block) 
 {
-    return select_line(pos) ? 1 : 0;
+    return select_line(cache, pos) ? 1 : 0;
 }
 
 /* 
@@ -230,8 +204,8 @@ bool handle_miss(word_t pos, void *block, word_t *evicted_pos, void *evicted_blo
  * Called by cache-runner; no need to modify it if you implement
  * check_hit() and handle_miss()
  */
-void accessData(mem_addr_t addr)
+void accessData(cache_t *cache, mem_addr_t addr)
 {
-    if(!check_hit(addr))
-        handle_miss(addr, NULL, NULL, NULL);
+    if(!check_hit(cache, addr))
+        handle_miss(cache, addr, NULL, NULL, NULL);
 }
\ No newline at end of file
@@ -7,11 +7,27 @@ typedef unsigned long long int mem_addr_t;
 typedef long long word_t;
 typedef unsigned char byte_t;
 
-void initCache(int s_in, int b_in, int E_in);
-void freeCache();
-void accessData(mem_addr_t addr);
+/* All the state of one simulated cache */
+typedef struct cache {
+    int verbosity;          /* print trace if set */
+    int s;                  /* set index bits */
+    int b;                  /* block offset bits */
+    int E;                  /* associativity */
+    int S;                  /* number of sets */
+    int B;                  /* block size (bytes) */
+    mem_addr_t s_mask;
+    /* Statistics for printSummary() */
+    int miss_count;
+    int hit_count;
+    int eviction_count;
+    struct cache_set *sets;
+} cache_t;
 
-bool handle_miss(word_t pos, void *block, word_t *evicted_pos, void *evicted_block);
-bool check_hit(word_t pos);
+cache_t *initCache(int s_in, int b_in, int E_in);
+void freeCache(cache_t *cache);
+void accessData(cache_t *cache, mem_addr_t addr);
+
+bool handle_miss(cache_t *cache, word_t pos, void *block, word_t *evicted_pos, void *evicted_block);
+bool check_hit(cache_t *cache, word_t pos);
 
 #endif /* CACHELAB_H */
\ No newline at end of file
@@ -20,29 +20,17 @@ typedef long long int word_t;
 
 char* trace_file = NULL;
 
-extern int  verbosity_cache;
-extern int s;
-extern int b;
-extern int E;
-
-extern int S; /* number of sets */
-extern int B; /* block size (bytes) */
-
-/* Counters used to record cache statistics */
-extern int miss_count;
-extern int hit_count;
-extern int eviction_count;
-
 
 /*
  * replayTrace - replays the given trace file against the cache 
  */
-void replayTrace(char* trace_fn)
+void replayTrace(cache_t *cache, char* trace_fn)
 {
     char buf[1000];
     mem_addr_t addr=0;
     unsigned int len=0;
-    FILE* trace_fp = fopen(trace_fn, "r");
+    /* "-" reads the trace from a pipe */
+    FILE* trace_fp = strcmp(trace_fn, "-") ? fopen(trace_fn, "r") : stdin;
 
     if(!trace_fp){
         fprintf(stderr, "%s: %s\n", trace_fn, strerror(errno));
@@ -53,21 +41,22 @@ void replayTrace(char* trace_fn)
         if(buf[1]=='S' || buf[1]=='L' || buf[1]=='M') {
             sscanf(buf+3, "%llx,%u", &addr, &len);
       
-            if( verbosity_cache)
+            if( cache->verbosity)
                 printf("%c %llx,%u ", buf[1], addr, len);
 
-            accessData(addr);
+            accessData(cache, addr);
 
             /* If the instruction is R/W then access again */
             if(buf[1]=='M')
-                accessData(addr);
+                accessData(cache, addr);
             
-            if ( verbosity_cache)
+            if ( cache->verbosity)
                 printf("\n");
         }
     }
 
-    fclose(trace_fp);
+    if(trace_fp != stdin)
+        fclose(trace_fp);
 }
 
 /*
@@ -82,7 +71,7 @@ void printUsage(char* argv[])
     printf("  -s <num>   Number of set index bits.\n");
     printf("  -E <num>   Number of lines per set.\n");
     printf("  -b <num>   Number of block offset bits.\n");
-    printf("  -t <file>  Trace file.\n");
+    printf("  -t <file>  Trace file ('-' for standard input).\n");
     printf("\nExamples:\n");
     printf("  linux>  %s -s 4 -E 1 -b 4 -t traces/yi.trace\n", argv[0]);
     printf("  linux>  %s -v -s 8 -E 2 -b 4 -t traces/yi.trace\n", argv[0]);
@@ -94,6 +83,11 @@ void printUsage(char* argv[])
  */
 int main(int argc, char* argv[])
 {
+    int s = 0; /* set index bits */
+    int b = 0; /* block offset bits */
+    int E = 0; /* associativity */
+    int verbosity = 0;
+    cache_t *cache;
     char c;
     while( (c=getopt(argc,argv,"s:E:b:t:vh")) != -1){
         switch(c){
@@ -110,7 +104,7 @@ int main(int argc, char* argv[])
             trace_file = optarg;
             break;
         case 'v':
-             verbosity_cache = 1;
+             verbosity = 1;
             break;
         case 'h':
             printUsage(argv);
@@ -131,19 +125,20 @@ int main(int argc, char* argv[])
     /* Compute S, E and B from command line args */
  
     /* Initialize cache */
-    initCache(s, b, E);
+    cache = initCache(s, b, E);
+    cache->verbosity = verbosity;
 
 #ifdef DEBUG_ON
-    printf("DEBUG: S:%u E:%u B:%u trace:%s\n", S, E, B, trace_file);
-    printf("DEBUG: set_index_mask: %llu\n", set_index_mask);
+    printf("DEBUG: S:%u E:%u B:%u trace:%s\n", cache->S, E, cache->B, trace_file);
+    printf("DEBUG: set_index_mask: %llu\n", cache->s_mask);
 #endif
  
-    replayTrace(trace_file);
-
-    /* Free allocated memory */
-    freeCache();
+    replayTrace(cache, trace_file);
 
     /* Output the hit and miss statistics for the autograder */
-    printSummary(hit_count, miss_count, eviction_count);
+    printSummary(cache->hit_count, cache->miss_count, cache->eviction_count);
+
+    /* Free allocated memory */
+    freeCache(cache);
     return 0;
 }
@@ -2,6 +2,10 @@
 #include <ctype.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "isa.h"
 
 /* Bytes Per Line = Block size of memory */
@@ -128,42 +132,326 @@ instr_ptr bad_instr()
 }
 
 
-mem_t init_mem(int len)
+/* Page number of no page */
+#define NO_PAGE (~(uword_t) 0)
+
+/* Number of table levels needed to reach every page up to maxaddr */
+static int radix_levels(uword_t maxaddr)
+{
+    uword_t pn = maxaddr >> MEM_PAGE_BITS;
+    int levels = 1;
+    while (levels * RADIX_BITS < 64 && (pn >> (levels * RADIX_BITS)) != 0)
+	levels++;
+    return levels;
+}
+
+mem_t init_mem(word_t len)
 {
 
     mem_t result = (mem_t) malloc(sizeof(mem_rec));
-    len = ((len+BPL-1)/BPL)*BPL;
+    if (len == MEM_FULL)
+	result->maxaddr = NO_PAGE;
+    else {
+	len = ((len+BPL-1)/BPL)*BPL;
+	result->maxaddr = len - 1;
+    }
     result->len = len;
-    result->contents = (byte_t *) calloc(len, 1);
+    result->root = NULL;
+    result->levels = radix_levels(result->maxaddr);
+    result->serial = (serial_ptr) calloc(1, sizeof(serial_rec));
+    result->serial->refs = 1;
+    result->last_tag = result->write_tag = result->code_tag = NO_PAGE;
+    result->last_page = result->write_page = result->code_page = NULL;
+    result->decode_lo = result->decode_hi = 0;
+    result->code_writes = 0;
+    result->blocks = NULL;
+    result->jit = NULL;
+    result->jit_release = NULL;
     return result;
 }
 
+/* Note that bytes [off, off+cnt) of page p were written, cnt <= 8 */
+#define MARK_DIRTY(p, off, cnt) \
+    ((p)->dirty |= ((uword_t) 1 << ((off) >> MEM_LINE_BITS)) | \
+     ((uword_t) 1 << (((off)+(cnt)-1) >> MEM_LINE_BITS)))
+
+/* Dirty bits for bytes [off, off+cnt) of a page, cnt > 0 */
+#define LINE_MASK(off, cnt) \
+    ((~(uword_t) 0 >> (63 - (((off)+(cnt)-1) >> MEM_LINE_BITS))) & \
+     (~(uword_t) 0 << ((off) >> MEM_LINE_BITS)))
+
+#define RADIX_IDX(pn, l) ((int) (((pn) >> ((l) * RADIX_BITS)) & (RADIX_SIZE-1)))
+
+/* Find page number pn for reading, NULL if never written */
+static page_ptr walk_page(mem_t m, uword_t pn)
+{
+    radix_ptr n = m->root;
+    int l;
+    for (l = m->levels - 1; n && l > 0; l--)
+	n = (radix_ptr) n->slot[RADIX_IDX(pn, l)];
+    return n ? (page_ptr) n->slot[RADIX_IDX(pn, 0)] : NULL;
+}
+
+/* Drop one reference to a table node at the given level (0 for a page),
+   freeing it and everything below it once unreferenced */
+static void release_table(void *node, int level)
+{
+    int i;
+    if (!node)
+	return;
+    if (level == 0) {
+	page_ptr p = (page_ptr) node;
+	if (--p->refs == 0) {
+	    free((void *) p->decode);
+	    free((void *) p);
+	}
+	return;
+    }
+    if (--((radix_ptr) node)->refs == 0) {
+	for (i = 0; i < RADIX_SIZE; i++)
+	    release_table(((radix_ptr) node)->slot[i], level-1);
+	free(node);
+    }
+}
+
+/* Find page number pn for writing.  The page, and the table nodes leading
+   to it, are allocated if absent and duplicated if shared with a copy. */
+static page_ptr own_page(mem_t m, uword_t pn)
+{
+    radix_ptr *slot = &m->root;
+    page_ptr p, *pslot;
+    int l, i;
+    if (pn == m->write_tag)
+	return m->write_page;
+    for (l = m->levels; l > 0; l--) {
+	radix_ptr n = *slot;
+	if (!n) {
+	    n = (radix_ptr) calloc(1, sizeof(radix_rec));
+	    n->refs = 1;
+	} else if (n->refs > 1) {
+	    radix_ptr c = (radix_ptr) malloc(sizeof(radix_rec));
+	    *c = *n;
+	    c->refs = 1;
+	    n->refs--;
+	    for (i = 0; i < RADIX_SIZE; i++) {
+		if (!c->slot[i])
+		    continue;
+		if (l == 1)
+		    ((page_ptr) c->slot[i])->refs++;
+		else
+		    ((radix_ptr) c->slot[i])->refs++;
+	    }
+	    n = c;
+	}
+	*slot = n;
+	if (l == 1)
+	    break;
+	slot = (radix_ptr *) &n->slot[RADIX_IDX(pn, l-1)];
+    }
+    pslot = (page_ptr *) &(*slot)->slot[RADIX_IDX(pn, 0)];
+    p = *pslot;
+    if (!p) {
+	p = (page_ptr) calloc(1, sizeof(page_rec));
+	p->refs = 1;
+	p->id = ++m->serial->last;
+	*pslot = p;
+    } else if (p->refs > 1) {
+	/* The copy starts without predecoded instructions, so anything
+	   translated from the shared page must go too */
+	page_ptr c = (page_ptr) malloc(sizeof(page_rec));
+	memcpy(c->data, p->data, MEM_PAGE_SIZE);
+	c->decode = NULL;
+	c->refs = 1;
+	c->dirty = 0;
+	c->id = ++m->serial->last;
+	c->base_id = p->id;
+	if (p->decode)
+	    m->code_writes++;
+	p->refs--;
+	*pslot = p = c;
+    }
+    if (m->code_tag == pn && m->code_page != p)
+	m->code_tag = NO_PAGE;
+    m->last_tag = m->write_tag = pn;
+    m->last_page = m->write_page = p;
+    return p;
+}
+
+/* Find page holding pos for reading, trying the last pages used first */
+static inline page_ptr find_page(mem_t m, word_t pos)
+{
+    uword_t pn = (uword_t) pos >> MEM_PAGE_BITS;
+    page_ptr p;
+    if (pn == m->last_tag)
+	return m->last_page;
+    if (pn == m->write_tag)
+	return m->write_page;
+    p = walk_page(m, pn);
+    if (p) {
+	m->last_tag = pn;
+	m->last_page = p;
+    }
+    return p;
+}
+
+page_ptr get_page(mem_t m, word_t pos)
+{
+    page_ptr p;
+    if ((uword_t) pos > m->maxaddr)
+	return NULL;
+    p = own_page(m, (uword_t) pos >> MEM_PAGE_BITS);
+    p->dirty = ~(uword_t) 0;
+    return p;
+}
+
+/* Little-endian word at offset off of page p.  Untouched pages read as 0 */
+static word_t page_word(page_ptr p, int off)
+{
+    return p ? load_word(p->data + off) : 0;
+}
+
+/* Forget all pages */
+static void drop_pages(mem_t m)
+{
+    release_table(m->root, m->levels);
+    m->root = NULL;
+    m->last_tag = m->write_tag = m->code_tag = NO_PAGE;
+    m->last_page = m->write_page = m->code_page = NULL;
+}
+
 void clear_mem(mem_t m)
 {
-    memset(m->contents, 0, m->len);
+    flush_decode(m);
+    drop_pages(m);
 }
 
 void free_mem(mem_t m)
 {
-    free((void *) m->contents);
+    flush_decode(m);
+    drop_pages(m);
+    if (--m->serial->refs == 0)
+	free((void *) m->serial);
     free((void *) m);
 }
 
 mem_t copy_mem(mem_t oldm)
 {
     mem_t newm = init_mem(oldm->len);
-    memcpy(newm->contents, oldm->contents, oldm->len);
+    free((void *) newm->serial);
+    newm->serial = oldm->serial;
+    newm->serial->refs++;
+    if (oldm->root) {
+	oldm->root->refs++;
+	newm->root = oldm->root;
+    }
+    /* The old memory's pages are now shared */
+    oldm->write_tag = NO_PAGE;
+    oldm->write_page = NULL;
+    /* Shared pages keep their predecode tables */
+    newm->decode_lo = oldm->decode_lo;
+    newm->decode_hi = oldm->decode_hi;
     return newm;
 }
 
+/* Compare lines of pages o and n, either of which may be NULL,
+   for the page starting at address base */
+static bool_t diff_page(page_ptr o, page_ptr n, uword_t base, uword_t lines,
+			uword_t maxaddr, FILE *outfile)
+{
+    bool_t diff = FALSE;
+    int l, i;
+    for (l = 0; (!diff || outfile) && l < MEM_PAGE_SIZE/MEM_LINE_SIZE; l++) {
+	int off = l << MEM_LINE_BITS;
+	if (!((lines >> l) & 1))
+	    continue;
+	if (base + off > maxaddr)
+	    break;
+	if (o && n && !memcmp(o->data + off, n->data + off, MEM_LINE_SIZE))
+	    continue;
+	for (i = off; (!diff || outfile) && i < off + MEM_LINE_SIZE &&
+		 base + i <= maxaddr; i += 8) {
+	    word_t ov = page_word(o, i);
+	    word_t nv = page_word(n, i);
+	    if (nv != ov) {
+		diff = TRUE;
+		if (outfile)
+		    fprintf(outfile, "0x%.4llx:\t0x%.16llx\t0x%.16llx\n",
+			    (word_t) (base + i), ov, nv);
+	    }
+	}
+    }
+    return diff;
+}
+
+/* Compare the pages below table nodes o and n, which cover the pages
+   numbered from pn << (level*RADIX_BITS).  Absent pages compare as 0.
+   Page ids can only be compared when related is set. */
+static bool_t diff_table(void *o, void *n, int level, uword_t pn,
+			 bool_t related, uword_t maxaddr, FILE *outfile)
+{
+    bool_t diff = FALSE;
+    int i;
+    if (o == n)
+	return FALSE;
+    if (level == 0) {
+	page_ptr op = (page_ptr) o;
+	page_ptr np = (page_ptr) n;
+	uword_t oid = op ? op->id : 0, obase = op ? op->base_id : 0;
+	uword_t nid = np ? np->id : 0, nbase = np ? np->base_id : 0;
+	uword_t lines = ~(uword_t) 0;
+	/* If one page was copied from the other, or both started out as
+	   zeros, only lines either wrote can differ.  (Two copies of a third
+	   page do not count: it may have been written since.) */
+	if ((related && (nbase == oid || obase == nid)) ||
+	    (obase == 0 && nbase == 0))
+	    lines = (op ? op->dirty : 0) | (np ? np->dirty : 0);
+	return diff_page(op, np, pn << MEM_PAGE_BITS, lines, maxaddr, outfile);
+    }
+    for (i = 0; (!diff || outfile) && i < RADIX_SIZE; i++) {
+	void *oc = o ? ((radix_ptr) o)->slot[i] : NULL;
+	void *nc = n ? ((radix_ptr) n)->slot[i] : NULL;
+	if (diff_table(oc, nc, level-1, (pn << RADIX_BITS) | i,
+		       related, maxaddr, outfile))
+	    diff = TRUE;
+    }
+    return diff;
+}
+
+/* Clear the dirty lines of private pages below node */
+static void reset_table(void *node, int level, serial_ptr serial)
+{
+    int i;
+    if (!node || (level > 0 && ((radix_ptr) node)->refs > 1))
+	return;
+    if (level > 0) {
+	for (i = 0; i < RADIX_SIZE; i++)
+	    reset_table(((radix_ptr) node)->slot[i], level-1, serial);
+    } else if (((page_ptr) node)->refs == 1) {
+	page_ptr p = (page_ptr) node;
+	/* Unrelated to any other page from now on */
+	p->dirty = 0;
+	p->id = ++serial->last;
+	p->base_id = ++serial->last;
+    }
+}
+
+void reset_dirty(mem_t m)
+{
+    reset_table(m->root, m->levels, m->serial);
+}
+
 bool_t diff_mem(mem_t oldm, mem_t newm, FILE *outfile)
 {
+    uword_t maxaddr = oldm->maxaddr;
     word_t pos;
-    int len = oldm->len;
     bool_t diff = FALSE;
-    if (newm->len < len)
-	len = newm->len;
-    for (pos = 0; (!diff || outfile) && pos < len; pos += 8) {
+    if (newm->maxaddr < maxaddr)
+	maxaddr = newm->maxaddr;
+    if (oldm->levels == newm->levels)
+	return diff_table(oldm->root, newm->root, oldm->levels, 0,
+			  oldm->serial == newm->serial, maxaddr, outfile);
+    /* Differently shaped tables.  The smaller memory bounds the scan */
+    for (pos = 0; (!diff || outfile) && (uword_t) pos < maxaddr; pos += 8) {
         word_t ov = 0;  word_t nv = 0;
 	get_word_val(oldm, pos, &ov);
 	get_word_val(newm, pos, &nv);
@@ -186,114 +474,652 @@ int hex2dig(char c)
 	return c - 'a' + 10;
 }
 
+/* Copy cnt bytes from src to memory starting at pos, a page at a time */
+static void load_bytes(mem_t m, word_t pos, byte_t *src, word_t cnt)
+{
+    while (cnt > 0) {
+	int off = pos & MEM_PAGE_MASK;
+	int n = MEM_PAGE_SIZE - off;
+	page_ptr page = own_page(m, (uword_t) pos >> MEM_PAGE_BITS);
+	if (n > cnt)
+	    n = cnt;
+	memcpy(page->data + off, src, n);
+	page->dirty |= LINE_MASK(off, n);
+	pos += n;
+	src += n;
+	cnt -= n;
+    }
+}
+
+static word_t ybo_word(byte_t *b)
+{
+    return load_word(b);
+}
+
+static int ybo_int(byte_t *b)
+{
+    return (int) (b[0] | (b[1] << 8) | (b[2] << 16) | ((unsigned) b[3] << 24));
+}
+
+/* Map or read in the whole of file f.  If first is not EOF, it is the
+   byte already taken from f.  *mappedp tells which was done. */
+static byte_t *map_file(FILE *f, int first, size_t *lenp, bool_t *mappedp)
+{
+    struct stat st;
+    byte_t *image;
+    size_t len, cap;
+    size_t n;
+    /* Only a file still at its start can be mapped as a whole */
+    if (ftell(f) == (first == EOF ? 0 : 1) &&
+	fstat(fileno(f), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+	image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+	if (image != MAP_FAILED) {
+	    *lenp = st.st_size;
+	    *mappedp = TRUE;
+	    return image;
+	}
+    }
+    cap = 1 << 16;
+    image = (byte_t *) malloc(cap);
+    len = 0;
+    if (first != EOF)
+	image[len++] = first;
+    while ((n = fread(image + len, 1, cap - len, f)) > 0) {
+	len += n;
+	if (len == cap)
+	    image = (byte_t *) realloc(image, cap *= 2);
+    }
+    *lenp = len;
+    *mappedp = FALSE;
+    return image;
+}
+
+static void unmap_file(byte_t *image, size_t len, bool_t mapped)
+{
+    if (mapped)
+	munmap(image, len);
+    else
+	free(image);
+}
+
+/* Value of each hex digit character, -1 for anything else */
+static const signed char hex_val[256] = {
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+     0,  1,  2,  3,  4,  5,  6,  7,  8,  9, -1, -1, -1, -1, -1, -1,
+    -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1
+};
+
+#define IS_SPACE(c) ((c) == ' ' || ((c) >= '\t' && (c) <= '\r'))
+
 #define LINELEN 4096
-int load_mem(mem_t m, FILE *infile, int report_error)
+
+/* End of the line starting at text, split where fgets() with a LINELEN
+   buffer would split it */
+static char *line_end(char *text, char *end)
+{
+    int max = end - text < LINELEN-1 ? end - text : LINELEN-1;
+    char *nl = memchr(text, '\n', max);
+    return nl ? nl + 1 : text + max;
+}
+
+/* Character at position pos of the fgets() buffer just after reading
+   the line at cur: either from that line, its terminator, or left over
+   from an earlier, longer line.  Error messages have always shown it. */
+static char line_buf_char(char *text, char *cur, char *end, int pos)
+{
+    char c = '\0';
+    while (text <= cur && text < end) {
+	char *lend = line_end(text, end);
+	if (lend - text > pos)
+	    c = text[pos];
+	else if (lend - text == pos)
+	    c = '\0';
+	text = lend;
+    }
+    return c;
+}
+
+static int load_yo(mem_t m, FILE *infile, int report_error)
 {
-    /* Read contents of .yo file */
-    char buf[LINELEN];
-    char c, ch, cl;
+    /* Read contents of .yo file, all at once */
+    size_t len;
+    bool_t mapped;
+    byte_t *image = map_file(infile, EOF, &len, &mapped);
+    char *text = (char *) image;
+    char *end = text + len;
+    byte_t bytes[LINELEN/2 + 8];
     int byte_cnt = 0;
     int lineno = 0;
-    word_t bytepos = 0; 
-    while (fgets(buf, LINELEN, infile)) {
+    /* Bytes are stored directly, bypassing decode invalidation */
+    flush_decode(m);
+    while (text < end) {
+	char *line = text;
+	char *lend = line_end(text, end);
+	int llen = lend - line;
 	int cpos = 0;
+	int nbytes, ndig, i;
+	char c;
+	uword_t bytepos = 0;
+	text = lend;
 	lineno++;
 	/* Skip white space */
-	while (isspace((int)buf[cpos]))
+	while (cpos < llen && IS_SPACE(line[cpos]))
 	    cpos++;
 
-	if (buf[cpos] != '0' ||
-	    (buf[cpos+1] != 'x' && buf[cpos+1] != 'X'))
-	    continue; /* Skip this line */      
+	if (llen - cpos < 2 || line[cpos] != '0' ||
+	    (line[cpos+1] != 'x' && line[cpos+1] != 'X'))
+	    continue; /* Skip this line */
 	cpos+=2;
 
 	/* Get address */
-	bytepos = 0;
-	while (isxdigit((int)(c=buf[cpos]))) {
-	    cpos++;
-	    bytepos = bytepos*16 + hex2dig(c);
-	}
+	while (cpos < llen && hex_val[(byte_t) line[cpos]] >= 0)
+	    bytepos = bytepos*16 + hex_val[(byte_t) line[cpos++]];
 
-	while (isspace((int)buf[cpos]))
+	while (cpos < llen && IS_SPACE(line[cpos]))
 	    cpos++;
 
-	if (buf[cpos++] != ':') {
+	c = cpos < llen ? line[cpos] : '\0';
+	cpos++;
+	if (c != ':') {
 	    if (report_error) {
 		fprintf(stderr, "Error reading file. Expected colon\n");
-		fprintf(stderr, "Line %d:%s\n", lineno, buf);
-		fprintf(stderr,
-			"Reading '%c' at position %d\n", buf[cpos], cpos);
+		fprintf(stderr, "Line %d:%.*s\n", lineno, llen, line);
+		fprintf(stderr, "Reading '%c' at position %d\n",
+			line_buf_char((char *) image, line, end, cpos), cpos);
 	    }
+	    unmap_file(image, len, mapped);
 	    return 0;
 	}
 
-	while (isspace((int)buf[cpos]))
+	while (cpos < llen && IS_SPACE(line[cpos]))
 	    cpos++;
 
-	/* Get code */
-	while (isxdigit((int)(ch=buf[cpos++])) && 
-	       isxdigit((int)(cl=buf[cpos++]))) {
-	    byte_t byte = 0;
-	    if (bytepos >= m->len) {
-		if (report_error) {
+	/* Get code: pairs of hex digits, 16 digits to a word at a time */
+	ndig = 0;
+	while (cpos + ndig < llen && hex_val[(byte_t) line[cpos+ndig]] >= 0)
+	    ndig++;
+	nbytes = ndig / 2;
+	for (i = 0; i < nbytes; i += 8) {
+	    const char *d = line + cpos + 2*i;
+	    uword_t w = 0;
+	    int k, n = nbytes - i < 8 ? nbytes - i : 8;
+	    for (k = n-1; k >= 0; k--)
+		w = (w << 8) | (hex_val[(byte_t) d[2*k]] << 4) |
+		    hex_val[(byte_t) d[2*k+1]];
+	    store_word(bytes + i, w);
+	}
+	if (nbytes > 0 && bytepos + nbytes - 1 > m->maxaddr) {
+	    /* Store what fits, then complain about the first byte that
+	       does not */
+	    uword_t bad = bytepos > m->maxaddr ? bytepos : m->maxaddr + 1;
+	    if (bad > bytepos)
+		load_bytes(m, bytepos, bytes, bad - bytepos);
+	    if (report_error) {
+		fprintf(stderr,
+			"Error reading file. Invalid address. 0x%llx\n",
+			bad);
+		fprintf(stderr, "Line %d:%.*s\n", lineno, llen, line);
+	    }
+	    unmap_file(image, len, mapped);
+	    return 0;
+	}
+	if (nbytes > 0)
+	    load_bytes(m, bytepos, bytes, nbytes);
+	byte_cnt += nbytes;
+    }
+    unmap_file(image, len, mapped);
+    return byte_cnt;
+}
+
+/* Load the sections of a .ybo image.  Return number of bytes loaded */
+static int load_ybo(mem_t m, byte_t *image, size_t len, word_t *entryp,
+		    int report_error)
+{
+    int nsect, i;
+    int byte_cnt = 0;
+    if (len < YBO_HEADER || memcmp(image, YBO_MAGIC, 8)) {
+	if (report_error)
+	    fprintf(stderr, "Error reading file. Bad object header\n");
+	return 0;
+    }
+    nsect = ybo_int(image + 16);
+    if (nsect < 0 || YBO_HEADER + (size_t) nsect * YBO_SECTION > len) {
+	if (report_error)
+	    fprintf(stderr, "Error reading file. Bad section table\n");
+	return 0;
+    }
+    for (i = 0; i < nsect; i++) {
+	byte_t *sect = image + YBO_HEADER + i * YBO_SECTION;
+	word_t addr = ybo_word(sect);
+	word_t size = ybo_word(sect + 8);
+	uword_t offset = ybo_word(sect + 16);
+	int kind = ybo_int(sect + 24);
+	byte_t *data;
+	if (size <= 0)
+	    continue;
+	if ((uword_t) addr > m->maxaddr ||
+	    (uword_t) (size - 1) > m->maxaddr - (uword_t) addr) {
+	    if (report_error)
+		fprintf(stderr,
+			"Error reading file. Invalid address. 0x%llx\n",
+			(uword_t) addr > m->maxaddr ? addr :
+			(word_t) (m->maxaddr + 1));
+	    return 0;
+	}
+	if (kind == YBO_DATA) {
+	    if (offset > len || (uword_t) size > len - offset) {
+		if (report_error)
 		    fprintf(stderr,
-			    "Error reading file. Invalid address. 0x%llx\n",
-			    bytepos);
-		    fprintf(stderr, "Line %d:%s\n", lineno, buf);
-		}
+			    "Error reading file. Section %d out of bounds\n", i);
+		return 0;
+	    }
+	    load_bytes(m, addr, image + offset, size);
+	} else if (kind == YBO_FILE) {
+	    /* Raw data from another file, named by a string in the image */
+	    char *name = (char *) image + offset;
+	    size_t dlen;
+	    bool_t mapped;
+	    FILE *df;
+	    if (offset >= len || !memchr(name, 0, len - offset)) {
+		if (report_error)
+		    fprintf(stderr,
+			    "Error reading file. Section %d out of bounds\n", i);
+		return 0;
+	    }
+	    df = fopen(name, "rb");
+	    if (!df) {
+		if (report_error)
+		    fprintf(stderr, "Can't open data file '%s'\n", name);
 		return 0;
 	    }
-	    byte = hex2dig(ch)*16+hex2dig(cl);
-	    m->contents[bytepos++] = byte;
-	    byte_cnt++;
+	    data = map_file(df, EOF, &dlen, &mapped);
+	    fclose(df);
+	    if (dlen < (uword_t) size) {
+		if (report_error)
+		    fprintf(stderr, "Data file '%s' is too short\n", name);
+		unmap_file(data, dlen, mapped);
+		return 0;
+	    }
+	    load_bytes(m, addr, data, size);
+	    unmap_file(data, dlen, mapped);
+	} else {
+	    if (report_error)
+		fprintf(stderr, "Error reading file. Bad section kind %d\n",
+			kind);
+	    return 0;
 	}
+	byte_cnt += size;
+    }
+    if (entryp)
+	*entryp = ybo_word(image + 8);
+    return byte_cnt;
+}
+
+int load_object(mem_t m, FILE *infile, word_t *entryp, int report_error)
+{
+    int c = getc(infile);
+    byte_t *image;
+    size_t len;
+    bool_t mapped;
+    int byte_cnt;
+    if (entryp)
+	*entryp = 0;
+    if (c != YBO_MAGIC[0]) {
+	if (c != EOF)
+	    ungetc(c, infile);
+	return load_yo(m, infile, report_error);
     }
+    /* Bytes are stored directly, bypassing decode invalidation */
+    flush_decode(m);
+    image = map_file(infile, c, &len, &mapped);
+    byte_cnt = load_ybo(m, image, len, entryp, report_error);
+    unmap_file(image, len, mapped);
     return byte_cnt;
 }
 
+int load_mem(mem_t m, FILE *infile, int report_error)
+{
+    return load_object(m, infile, NULL, report_error);
+}
+
 bool_t get_byte_val(mem_t m, word_t pos, byte_t *dest)
 {
-    if (pos < 0 || pos >= m->len)
+    page_ptr p;
+    if ((uword_t) pos > m->maxaddr)
 	return FALSE;
-    *dest = m->contents[pos];
+    p = find_page(m, pos);
+    *dest = p ? p->data[pos & MEM_PAGE_MASK] : 0;
     return TRUE;
 }
 
 bool_t get_word_val(mem_t m, word_t pos, word_t *dest)
 {
     int i;
-    word_t val;
-    if (pos < 0 || pos + 8 > m->len)
+    int off = pos & MEM_PAGE_MASK;
+    uword_t val;
+    if ((uword_t) pos > m->maxaddr - 7)
 	return FALSE;
+    if (off <= MEM_PAGE_SIZE - 8) {
+	*dest = page_word(find_page(m, pos), off);
+	return TRUE;
+    }
+    /* Word straddles two pages */
     val = 0;
-    for (i = 0; i < 8; i++) {
-	word_t b =  m->contents[pos+i] & 0xFF;
-	val = val | (b <<(8*i));
+    for (i = 7; i >= 0; i--) {
+	byte_t b = 0;
+	get_byte_val(m, pos+i, &b);
+	val = (val << 8) | b;
     }
-    *dest = val;
+    *dest = (word_t) val;
     return TRUE;
 }
 
+/* Predecoded entry for pc, or NULL if its page has no predecode table */
+static decode_ptr decode_entry(mem_t m, word_t pc)
+{
+    uword_t pn = (uword_t) pc >> MEM_PAGE_BITS;
+    page_ptr p = pn == m->code_tag ? m->code_page : walk_page(m, pn);
+    return p && p->decode ? &p->decode[pc & MEM_PAGE_MASK] : NULL;
+}
+
+/* Invalidate predecoded instructions overlapping bytes [pos, pos+cnt) */
+static void invalidate_decode(mem_t m, word_t pos, word_t cnt)
+{
+    word_t lo, hi;
+    bool_t hit = FALSE;
+    if (pos >= m->decode_hi || pos + cnt <= m->decode_lo)
+	return;
+    lo = pos - (MAX_INSTR_LEN-1);
+    if (lo < m->decode_lo)
+	lo = m->decode_lo;
+    hi = pos + cnt;
+    if (hi > m->decode_hi)
+	hi = m->decode_hi;
+    for (; lo < hi; lo++) {
+	decode_ptr d = decode_entry(m, lo);
+	/* Skip instructions that end before the store, so that this
+	   agrees with the byte ranges invalidate_blocks() checks */
+	if (d && d->valid && d->valp > pos) {
+	    /* The entry may be on a page shared with a copy */
+	    page_ptr p = own_page(m, (uword_t) lo >> MEM_PAGE_BITS);
+	    if (p->decode)
+		p->decode[lo & MEM_PAGE_MASK].valid = FALSE;
+	    hit = TRUE;
+	}
+    }
+    if (hit)
+	m->code_writes++;
+}
+
 bool_t set_byte_val(mem_t m, word_t pos, byte_t val)
 {
-    if (pos < 0 || pos >= m->len)
+    page_ptr p;
+    if ((uword_t) pos > m->maxaddr)
 	return FALSE;
-    m->contents[pos] = val;
+    invalidate_decode(m, pos, 1);
+    p = own_page(m, (uword_t) pos >> MEM_PAGE_BITS);
+    p->data[pos & MEM_PAGE_MASK] = val;
+    MARK_DIRTY(p, pos & MEM_PAGE_MASK, 1);
     return TRUE;
 }
 
 bool_t set_word_val(mem_t m, word_t pos, word_t val)
 {
     int i;
-    if (pos < 0 || pos + 8 > m->len)
+    int off = pos & MEM_PAGE_MASK;
+    if ((uword_t) pos > m->maxaddr - 7)
+	return FALSE;
+    invalidate_decode(m, pos, 8);
+    if (off <= MEM_PAGE_SIZE - 8) {
+	page_ptr p = own_page(m, (uword_t) pos >> MEM_PAGE_BITS);
+	store_word(p->data + off, val);
+	MARK_DIRTY(p, off, 8);
+	return TRUE;
+    }
+    /* Word straddles two pages */
+    for (i = 0; i < 8; i++)
+	set_byte_val(m, pos+i, (byte_t) (val >> (8*i)));
+    return TRUE;
+}
+
+/* Are bytes [pos, pos+cnt) all in memory? */
+static bool_t block_ok(mem_t m, word_t pos, word_t cnt)
+{
+    return cnt >= 0 && (uword_t) pos <= m->maxaddr &&
+	(cnt == 0 || (uword_t) (cnt - 1) <= m->maxaddr - (uword_t) pos);
+}
+
+bool_t read_block(mem_t m, word_t pos, void *dest, word_t cnt)
+{
+    byte_t *d = (byte_t *) dest;
+    if (!block_ok(m, pos, cnt))
+	return FALSE;
+    while (cnt > 0) {
+	int off = pos & MEM_PAGE_MASK;
+	int n = MEM_PAGE_SIZE - off;
+	page_ptr p = find_page(m, pos);
+	if (n > cnt)
+	    n = cnt;
+	if (p)
+	    memcpy(d, p->data + off, n);
+	else
+	    memset(d, 0, n);
+	pos += n;
+	d += n;
+	cnt -= n;
+    }
+    return TRUE;
+}
+
+bool_t write_block(mem_t m, word_t pos, const void *src, word_t cnt)
+{
+    if (!block_ok(m, pos, cnt))
+	return FALSE;
+    invalidate_decode(m, pos, cnt);
+    load_bytes(m, pos, (byte_t *) src, cnt);
+    return TRUE;
+}
+
+bool_t fill_block(mem_t m, word_t pos, byte_t val, word_t cnt)
+{
+    if (!block_ok(m, pos, cnt))
 	return FALSE;
-    for (i = 0; i < 8; i++) {
-	m->contents[pos+i] = (byte_t) val & 0xFF;
-	val >>= 8;
+    invalidate_decode(m, pos, cnt);
+    while (cnt > 0) {
+	int off = pos & MEM_PAGE_MASK;
+	int n = MEM_PAGE_SIZE - off;
+	page_ptr p;
+	if (n > cnt)
+	    n = cnt;
+	/* Absent pages already read as zeros */
+	if (val || find_page(m, pos)) {
+	    p = own_page(m, (uword_t) pos >> MEM_PAGE_BITS);
+	    memset(p->data + off, val, n);
+	    p->dirty |= LINE_MASK(off, n);
+	}
+	pos += n;
+	cnt -= n;
     }
     return TRUE;
 }
 
+/* Translated basic blocks */
+#define BLOCK_MAX_INSTR 64
+#define BLOCK_HASH 1024
+#define BLOCK_HASH_IDX(pc) ((int) ((pc) & (BLOCK_HASH-1)))
+/* Reclaim invalidated blocks once there are this many */
+#define BLOCK_MAX_DEAD 256
+
+/* One translated instruction */
+typedef struct {
+    void *handler;  /* Dispatch target in run_state_block() */
+    byte_t ra;
+    byte_t rb;
+    byte_t ifun;
+    byte_t idx;     /* Position within block */
+    word_t valc;
+    word_t valp;
+    word_t pc;
+} uop_rec, *uop_ptr;
+
+typedef struct block_rec {
+    word_t start;   /* Code bytes [start, end) were translated */
+    word_t end;
+    bool_t valid;
+    int ninstr;     /* Instructions in block, not counting exit op */
+    struct block_rec *hash_next;
+    struct block_rec *all_next;
+    struct block_rec *succ[2]; /* Last successors: [0] not taken, [1] taken */
+    uop_rec ops[];
+} block_rec, *block_ptr;
+
+struct block_cache {
+    block_ptr bucket[BLOCK_HASH];
+    block_ptr all;   /* Every block, including invalidated ones */
+    int dead;
+    word_t code_writes;  /* Value of code_writes the blocks agree with */
+};
+
+/* Free all blocks, keeping the (now empty) cache */
+static void reset_blocks(struct block_cache *bc)
+{
+    block_ptr b, next;
+    for (b = bc->all; b; b = next) {
+	next = b->all_next;
+	free((void *) b);
+    }
+    memset(bc->bucket, 0, sizeof(bc->bucket));
+    bc->all = NULL;
+    bc->dead = 0;
+}
+
+static void free_blocks(mem_t m)
+{
+    if (m->blocks) {
+	reset_blocks(m->blocks);
+	free((void *) m->blocks);
+	m->blocks = NULL;
+    }
+}
+
+/* Free predecode tables of the pages below node that are not shared with
+   a copy.  Return TRUE if some shared page keeps its table. */
+static bool_t drop_decode(void *node, int level, bool_t shared)
+{
+    page_ptr p = (page_ptr) node;
+    bool_t kept = FALSE;
+    int i;
+    if (!node)
+	return FALSE;
+    if (level > 0) {
+	shared = shared || ((radix_ptr) node)->refs > 1;
+	for (i = 0; i < RADIX_SIZE; i++)
+	    if (drop_decode(((radix_ptr) node)->slot[i], level-1, shared))
+		kept = TRUE;
+	return kept;
+    }
+    if (!p->decode)
+	return FALSE;
+    if (shared || p->refs > 1)
+	return TRUE;
+    free((void *) p->decode);
+    p->decode = NULL;
+    return FALSE;
+}
+
+void flush_decode(mem_t m)
+{
+    /* Entries kept on shared pages must stay within [decode_lo, decode_hi),
+       so that stores to them still invalidate */
+    if (!drop_decode(m->root, m->levels, FALSE))
+	m->decode_lo = m->decode_hi = 0;
+    m->code_tag = NO_PAGE;
+    m->code_page = NULL;
+    free_blocks(m);
+    if (m->jit_release)
+	m->jit_release(m);
+}
+
+/* Fill in decoded form of the instruction at pc */
+static void fill_decode(mem_t m, word_t pc, decode_ptr d)
+{
+    byte_t byte1 = HPACK(REG_NONE, REG_NONE);
+    itype_t hi0;
+    word_t ftpc = pc;
+
+    d->instr = HPACK(I_NOP, F_NONE);
+    d->ok0 = get_byte_val(m, ftpc, &d->instr);
+    d->ok1 = d->okc = TRUE;
+    d->valc = 0;
+    ftpc++;
+    hi0 = HI4(d->instr);
+    d->icode = hi0;
+    d->ifun = LO4(d->instr);
+
+    if (hi0 == I_RRMOVQ || hi0 == I_ALU || hi0 == I_PUSHQ ||
+	hi0 == I_POPQ || hi0 == I_IRMOVQ || hi0 == I_RMMOVQ ||
+	hi0 == I_MRMOVQ || hi0 == I_IADDQ) {
+	d->ok1 = get_byte_val(m, ftpc, &byte1);
+	ftpc++;
+    }
+    d->ra = HI4(byte1);
+    d->rb = LO4(byte1);
+
+    if (hi0 == I_IRMOVQ || hi0 == I_RMMOVQ || hi0 == I_MRMOVQ ||
+	hi0 == I_JMP || hi0 == I_CALL || hi0 == I_IADDQ) {
+	d->okc = get_word_val(m, ftpc, &d->valc);
+	ftpc += 8;
+    }
+    d->valp = ftpc;
+    d->handler = NULL;
+}
+
+decode_ptr decode_instr(mem_t m, word_t pc)
+{
+    uword_t pn = (uword_t) pc >> MEM_PAGE_BITS;
+    page_ptr p;
+    decode_ptr d;
+    if ((uword_t) pc > m->maxaddr) {
+	d = &m->decode_bad;
+	fill_decode(m, pc, d);
+	return d;
+    }
+    if (pn == m->code_tag) {
+	d = &m->code_page->decode[pc & MEM_PAGE_MASK];
+	if (d->valid)
+	    return d;
+    }
+    /* Entries are only filled in on pages private to this memory */
+    p = own_page(m, pn);
+    if (!p->decode)
+	p->decode = (decode_ptr) calloc(MEM_PAGE_SIZE, sizeof(decode_rec));
+    m->code_tag = pn;
+    m->code_page = p;
+    d = &p->decode[pc & MEM_PAGE_MASK];
+    if (!d->valid) {
+	fill_decode(m, pc, d);
+	d->valid = TRUE;
+	if (m->decode_hi == 0 || pc < m->decode_lo)
+	    m->decode_lo = pc;
+	if (pc + MAX_INSTR_LEN > m->decode_hi)
+	    m->decode_hi = pc + MAX_INSTR_LEN;
+    }
+    return d;
+}
+
 void dump_memory(FILE *outfile, mem_t m, word_t pos, int len)
 {
     int i, j;
@@ -304,82 +1130,89 @@ void dump_memory(FILE *outfile, mem_t m, word_t pos, int len)
 
     len = ((len+BPL-1)/BPL)*BPL;
 
-    if (pos+len > m->len)
-	len = m->len-pos;
+    if ((uword_t) pos > m->maxaddr)
+	return;
+    if ((uword_t) len - 1 > m->maxaddr - pos)
+	len = m->maxaddr - pos + 1;
 
+    /* Lines are aligned, so each lies within one page */
     for (i = 0; i < len; i+=BPL) {
-	word_t val = 0;
+	page_ptr p = find_page(m, pos+i);
 	fprintf(outfile, "0x%.4llx:", pos+i);
-	for (j = 0; j < BPL; j+= 8) {
-	    get_word_val(m, pos+i+j, &val);
-	    fprintf(outfile, " %.16llx", val);
-	}
+	for (j = 0; j < BPL; j+= 8)
+	    fprintf(outfile, " %.16llx", page_word(p, (pos+i+j) & MEM_PAGE_MASK));
     }
 }
 
-mem_t init_reg()
+reg_t init_reg()
 {
-    return init_mem(128);
+    return (reg_t) calloc(1, sizeof(reg_rec));
 }
 
-void free_reg(mem_t r)
+void free_reg(reg_t r)
 {
-    free_mem(r);
+    free((void *) r);
 }
 
-mem_t copy_reg(mem_t oldr)
+void clear_reg(reg_t r)
 {
-    return copy_mem(oldr);
+    memset(r->val, 0, sizeof(r->val));
 }
 
-bool_t diff_reg(mem_t oldr, mem_t newr, FILE *outfile)
+reg_t copy_reg(reg_t oldr)
 {
-    word_t pos;
-    int len = oldr->len;
-    bool_t diff = FALSE;
-    if (newr->len < len)
-	len = newr->len;
-    for (pos = 0; (!diff || outfile) && pos < len; pos += 8) {
-        word_t ov = 0;
-        word_t nv = 0;
-	get_word_val(oldr, pos, &ov);
-	get_word_val(newr, pos, &nv);
-	if (nv != ov) {
-	    diff = TRUE;
-	    if (outfile)
-		fprintf(outfile, "%s:\t0x%.16llx\t0x%.16llx\n",
-			reg_table[pos/8].name, ov, nv);
-	}
-    }
-    return diff;
+    reg_t newr = (reg_t) malloc(sizeof(reg_rec));
+    *newr = *oldr;
+    return newr;
 }
 
-word_t get_reg_val(mem_t r, reg_id_t id)
+#ifdef __GNUC__
+typedef uword_t reg_vec __attribute__ ((vector_size (32)));
+#endif
+
+/* Do two register files match?  The sink slots are both zero, so the
+   files are compared whole, 32 bytes at a time. */
+static bool_t same_regs(reg_t a, reg_t b)
 {
-    word_t val = 0;
-    if (id >= REG_NONE)
-		return 0;
-    get_word_val(r,id*8, &val);
-    return val;
+#ifdef __GNUC__
+    reg_vec acc = {0, 0, 0, 0};
+    reg_vec x, y;
+    int i;
+    for (i = 0; i <= REG_NONE; i += 4) {
+	__builtin_memcpy(&x, &a->val[i], sizeof(x));
+	__builtin_memcpy(&y, &b->val[i], sizeof(y));
+	acc |= x ^ y;
+    }
+    return !(acc[0] | acc[1] | acc[2] | acc[3]);
+#else
+    return !memcmp(a->val, b->val, sizeof(a->val));
+#endif
 }
 
-void set_reg_val(mem_t r, reg_id_t id, word_t val)
+bool_t diff_reg(reg_t oldr, reg_t newr, FILE *outfile)
 {
-    if (id < REG_NONE) {
-		set_word_val(r,id*8,val);
-    }
+    reg_id_t id;
+    if (same_regs(oldr, newr))
+	return FALSE;
+    if (outfile)
+	for (id = 0; reg_valid(id); id++) {
+	    word_t ov = oldr->val[id];
+	    word_t nv = newr->val[id];
+	    if (nv != ov)
+		fprintf(outfile, "%s:\t0x%.16llx\t0x%.16llx\n",
+			reg_table[id].name, ov, nv);
+	}
+    return TRUE;
 }
-     
-void dump_reg(FILE *outfile, mem_t r) {
+
+void dump_reg(FILE *outfile, reg_t r) {
     reg_id_t id;
     for (id = 0; reg_valid(id); id++) {
 	fprintf(outfile, "   %s  ", reg_table[id].name);
     }
     fprintf(outfile, "\n");
     for (id = 0; reg_valid(id); id++) {
-	word_t val = 0;
-	get_word_val(r, id*8, &val);
-	fprintf(outfile, " %llx", val);
+	fprintf(outfile, " %llx", r->val[id]);
     }
     fprintf(outfile, "\n");
 }
@@ -484,13 +1317,18 @@ char *stat_name(stat_t e)
 
 /**************** Implementation of ISA model ************************/
 
-state_ptr new_state(int memlen)
+state_ptr new_state(word_t memlen)
 {
     state_ptr result = (state_ptr) malloc(sizeof(state_rec));
     result->pc = 0;
     result->r = init_reg();
     result->m = init_mem(memlen);
     result->cc = DEFAULT_CC;
+    result->cc_op = CC_LIVE;
+    result->log = NULL;
+    result->prof = NULL;
+    result->trace = NULL;
+    memset(&result->stop, 0, sizeof(stop_rec));
     return result;
 }
 
@@ -506,20 +1344,30 @@ state_ptr copy_state(state_ptr s) {
     result->pc = s->pc;
     result->r = copy_reg(s->r);
     result->m = copy_mem(s->m);
-    result->cc = s->cc;
+    result->cc = get_cc(s);
+    result->cc_op = CC_LIVE;
+    result->log = NULL;
+    result->prof = NULL;
+    result->trace = NULL;
+    result->stop = s->stop;
     return result;
 }
 
 bool_t diff_state(state_ptr olds, state_ptr news, FILE *outfile) {
     bool_t diff = FALSE;
 
+    /* Usually there is nothing to report short of memory */
+    if (olds->pc == news->pc && get_cc(olds) == get_cc(news) &&
+	same_regs(olds->r, news->r))
+	return diff_mem(olds->m, news->m, outfile);
+
     if (olds->pc != news->pc) {
 	diff = TRUE;
 	if (outfile) {
 	    fprintf(outfile, "pc:\t0x%.16llx\t0x%.16llx\n", olds->pc, news->pc);
 	}
     }
-    if (olds->cc != news->cc) {
+    if (get_cc(olds) != get_cc(news)) {
 	diff = TRUE;
 	if (outfile) {
 	    fprintf(outfile, "cc:\t%s\t%s\n", cc_name(olds->cc), cc_name(news->cc));
@@ -570,321 +1418,1732 @@ bool_t cond_holds(cc_t cc, cond_t bcond) {
 }
 
 
+/* Register and memory writes made by an instruction, logged and
+   traced if need be */
+static void step_reg(state_ptr s, reg_id_t id, word_t val)
+{
+    set_reg_val(s->r, id, val);
+    if (s->log && id < REG_NONE)
+	delta_reg(s->log, id, val);
+}
+
+static bool_t step_mem(state_ptr s, word_t pos, word_t val)
+{
+    if (!set_word_val(s->m, pos, val))
+	return FALSE;
+    if (s->log)
+	delta_mem(s->log, pos, val);
+    if (s->trace)
+	trace_access(s->trace, 'S', pos, 8);
+    return TRUE;
+}
+
+/* Data read made by an instruction, traced if need be */
+static bool_t step_load(state_ptr s, word_t pos, word_t *valp)
+{
+    if (!get_word_val(s->m, pos, valp))
+	return FALSE;
+    if (s->trace)
+	trace_access(s->trace, 'L', pos, 8);
+    return TRUE;
+}
+
+/* Note why the instruction at s->pc stopped execution */
+static stat_t fault(state_ptr s, stat_t e, stop_t why, word_t addr, int val)
+{
+    s->stop.why = why;
+    s->stop.pc = s->pc;
+    s->stop.addr = addr;
+    s->stop.val = val;
+    return e;
+}
+
 /* Execute single instruction.  Return status. */
-stat_t step_state(state_ptr s, FILE *error_file)
+static stat_t exec_instr(state_ptr s)
 {
     word_t argA, argB;
-    byte_t byte0 = 0;
-    byte_t byte1 = 0;
+    byte_t byte0;
     itype_t hi0;
     alu_t  lo0;
-    reg_id_t hi1 = REG_NONE;
-    reg_id_t lo1 = REG_NONE;
-    bool_t ok1 = TRUE;
-    word_t cval = 0;
-    word_t okc = TRUE;
+    reg_id_t hi1;
+    reg_id_t lo1;
+    bool_t ok1;
+    word_t cval;
+    word_t okc;
     word_t val, dval;
-    bool_t need_regids;
-    bool_t need_imm;
-    word_t ftpc = s->pc;  /* Fall-through PC */
-
-    if (!get_byte_val(s->m, ftpc, &byte0)) {
-	if (error_file)
-	    fprintf(error_file,
-		    "PC = 0x%llx, Invalid instruction address\n", s->pc);
-	return STAT_ADR;
-    }
-    ftpc++;
-
-    hi0 = HI4(byte0);
-    lo0 = LO4(byte0);
-
-    need_regids =
-	(hi0 == I_RRMOVQ || hi0 == I_ALU || hi0 == I_PUSHQ ||
-	 hi0 == I_POPQ || hi0 == I_IRMOVQ || hi0 == I_RMMOVQ ||
-	 hi0 == I_MRMOVQ || hi0 == I_IADDQ);
-
-    if (need_regids) {
-	ok1 = get_byte_val(s->m, ftpc, &byte1);
-	ftpc++;
-	hi1 = HI4(byte1);
-	lo1 = LO4(byte1);
-    }
-
-    need_imm =
-	(hi0 == I_IRMOVQ || hi0 == I_RMMOVQ || hi0 == I_MRMOVQ ||
-	 hi0 == I_JMP || hi0 == I_CALL || hi0 == I_IADDQ);
-
-    if (need_imm) {
-	okc = get_word_val(s->m, ftpc, &cval);
-	ftpc += 8;
-    }
+    word_t ftpc;  /* Fall-through PC */
+    decode_ptr d = decode_instr(s->m, s->pc);
+
+    if (!d->ok0)
+	return fault(s, STAT_ADR, STOP_IMEM, 0, 0);
+    byte0 = d->instr;
+    hi0 = d->icode;
+    lo0 = d->ifun;
+    hi1 = d->ra;
+    lo1 = d->rb;
+    ok1 = d->ok1;
+    cval = d->valc;
+    okc = d->okc;
+    ftpc = d->valp;
+    if (s->prof)
+	prof_instr(s->prof, s->pc, hi0, lo0, 1);
+    if (s->trace && ftpc > s->pc)
+	trace_access(s->trace, 'I', s->pc, (int) (ftpc - s->pc));
 
     switch (hi0) {
     case I_NOP:
 	s->pc = ftpc;
 	break;
     case I_HALT:
-	return STAT_HLT;
-	break;
+	return fault(s, STAT_HLT, STOP_HALT, 0, 0);
     case I_RRMOVQ:  /* Both unconditional and conditional moves */
-	if (!ok1) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid instruction address\n", s->pc);
-	    return STAT_ADR;
-	}
-	if (!reg_valid(hi1)) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid register ID 0x%.1x\n",
-			s->pc, hi1);
-	    return STAT_INS;
-	}
-	if (!reg_valid(lo1)) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid register ID 0x%.1x\n",
-			s->pc, lo1);
-	    return STAT_INS;
-	}
+	if (!ok1)
+	    return fault(s, STAT_ADR, STOP_IMEM, 0, 0);
+	if (!reg_valid(hi1))
+	    return fault(s, STAT_INS, STOP_REG, 0, hi1);
+	if (!reg_valid(lo1))
+	    return fault(s, STAT_INS, STOP_REG, 0, lo1);
 	val = get_reg_val(s->r, hi1);
-	if (cond_holds(s->cc, lo0))
-	  set_reg_val(s->r, lo1, val);
+	if ((cond_t) lo0 == C_YES || cond_holds(get_cc(s), lo0))
+	  step_reg(s, lo1, val);
 	s->pc = ftpc;
 	break;
     case I_IRMOVQ:
-	if (!ok1) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid instruction address\n", s->pc);
-	    return STAT_ADR;
-	}
-	if (!okc) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid instruction address",
-			s->pc);
-	    return STAT_INS;
-	}
-	if (!reg_valid(lo1)) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid register ID 0x%.1x\n",
-			s->pc, lo1);
-	    return STAT_INS;
-	}
-	set_reg_val(s->r, lo1, cval);
+	if (!ok1)
+	    return fault(s, STAT_ADR, STOP_IMEM, 0, 0);
+	if (!okc)
+	    return fault(s, STAT_INS, STOP_IMEM, 0, 0);
+	if (!reg_valid(lo1))
+	    return fault(s, STAT_INS, STOP_REG, 0, lo1);
+	step_reg(s, lo1, cval);
 	s->pc = ftpc;
 	break;
     case I_RMMOVQ:
-	if (!ok1) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid instruction address\n", s->pc);
-	    return STAT_ADR;
-	}
-	if (!okc) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid instruction address\n", s->pc);
-	    return STAT_INS;
-	}
-	if (!reg_valid(hi1)) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid register ID 0x%.1x\n",
-			s->pc, hi1);
-	    return STAT_INS;
-	}
+	if (!ok1)
+	    return fault(s, STAT_ADR, STOP_IMEM, 0, 0);
+	if (!okc)
+	    return fault(s, STAT_INS, STOP_IMEM, 0, 0);
+	if (!reg_valid(hi1))
+	    return fault(s, STAT_INS, STOP_REG, 0, hi1);
 	if (reg_valid(lo1)) 
 	    cval += get_reg_val(s->r, lo1);
 	val = get_reg_val(s->r, hi1);
-	if (!set_word_val(s->m, cval, val)) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid data address 0x%llx\n",
-			s->pc, cval);
-	    return STAT_ADR;
-	}
+	if (!step_mem(s, cval, val))
+	    return fault(s, STAT_ADR, STOP_DMEM, cval, 0);
 	s->pc = ftpc;
 	break;
     case I_MRMOVQ:
-	if (!ok1) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid instruction address\n", s->pc);
-	    return STAT_ADR;
-	}
-	if (!okc) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid instruction addres\n", s->pc);
-	    return STAT_INS;
-	}
-	if (!reg_valid(hi1)) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid register ID 0x%.1x\n",
-			s->pc, hi1);
-	    return STAT_INS;
-	}
+	if (!ok1)
+	    return fault(s, STAT_ADR, STOP_IMEM, 0, 0);
+	if (!okc)
+	    return fault(s, STAT_INS, STOP_IMEM, 0, 0);
+	if (!reg_valid(hi1))
+	    return fault(s, STAT_INS, STOP_REG, 0, hi1);
 	if (reg_valid(lo1)) 
 	    cval += get_reg_val(s->r, lo1);
-	if (!get_word_val(s->m, cval, &val))
-	    return STAT_ADR;
-	set_reg_val(s->r, hi1, val);
+	if (!step_load(s, cval, &val))
+	    return fault(s, STAT_ADR, STOP_DMEM, cval, 0);
+	step_reg(s, hi1, val);
 	s->pc = ftpc;
 	break;
     case I_ALU:
-	if (!ok1) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid instruction address\n", s->pc);
-	    return STAT_ADR;
-	}
+	if (!ok1)
+	    return fault(s, STAT_ADR, STOP_IMEM, 0, 0);
 	argA = get_reg_val(s->r, hi1);
 	argB = get_reg_val(s->r, lo1);
 	val = compute_alu(lo0, argA, argB);
-	set_reg_val(s->r, lo1, val);
-	s->cc = compute_cc(lo0, argA, argB);
+	step_reg(s, lo1, val);
+	s->cc_op = lo0;
+	s->cc_a = argA;
+	s->cc_b = argB;
 	s->pc = ftpc;
 	break;
     case I_JMP:
-	if (!ok1) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid instruction address\n", s->pc);
-	    return STAT_ADR;
-	}
-	if (!okc) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid instruction address\n", s->pc);
-	    return STAT_ADR;
-	}
-	if (cond_holds(s->cc, lo0))
+	if (!ok1)
+	    return fault(s, STAT_ADR, STOP_IMEM, 0, 0);
+	if (!okc)
+	    return fault(s, STAT_ADR, STOP_IMEM, 0, 0);
+	if ((cond_t) lo0 == C_YES || cond_holds(get_cc(s), lo0))
 	    s->pc = cval;
 	else
 	    s->pc = ftpc;
 	break;
     case I_CALL:
-	if (!ok1) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid instruction address\n", s->pc);
-	    return STAT_ADR;
-	}
-	if (!okc) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid instruction address\n", s->pc);
-	    return STAT_ADR;
-	}
+	if (!ok1)
+	    return fault(s, STAT_ADR, STOP_IMEM, 0, 0);
+	if (!okc)
+	    return fault(s, STAT_ADR, STOP_IMEM, 0, 0);
 	val = get_reg_val(s->r, REG_RSP) - 8;
-	set_reg_val(s->r, REG_RSP, val);
-	if (!set_word_val(s->m, val, ftpc)) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid stack address 0x%llx\n", s->pc, val);
-	    return STAT_ADR;
-	}
+	step_reg(s, REG_RSP, val);
+	if (!step_mem(s, val, ftpc))
+	    return fault(s, STAT_ADR, STOP_STACK, val, 0);
 	s->pc = cval;
 	break;
     case I_RET:
 	/* Return Instruction.  Pop address from stack */
 	dval = get_reg_val(s->r, REG_RSP);
-	if (!get_word_val(s->m, dval, &val)) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid stack address 0x%llx\n",
-			s->pc, dval);
-	    return STAT_ADR;
-	}
-	set_reg_val(s->r, REG_RSP, dval + 8);
+	if (!step_load(s, dval, &val))
+	    return fault(s, STAT_ADR, STOP_STACK, dval, 0);
+	step_reg(s, REG_RSP, dval + 8);
 	s->pc = val;
 	break;
     case I_PUSHQ:
-	if (!ok1) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid instruction address\n", s->pc);
-	    return STAT_ADR;
-	}
-	if (!reg_valid(hi1)) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid register ID 0x%.1x\n", s->pc, hi1);
-	    return STAT_INS;
-	}
+	if (!ok1)
+	    return fault(s, STAT_ADR, STOP_IMEM, 0, 0);
+	if (!reg_valid(hi1))
+	    return fault(s, STAT_INS, STOP_REG, 0, hi1);
 	val = get_reg_val(s->r, hi1);
 	dval = get_reg_val(s->r, REG_RSP) - 8;
-	set_reg_val(s->r, REG_RSP, dval);
-	if  (!set_word_val(s->m, dval, val)) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid stack address 0x%llx\n", s->pc, dval);
-	    return STAT_ADR;
-	}
+	step_reg(s, REG_RSP, dval);
+	if (!step_mem(s, dval, val))
+	    return fault(s, STAT_ADR, STOP_STACK, dval, 0);
 	s->pc = ftpc;
 	break;
     case I_POPQ:
-	if (!ok1) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid instruction address\n", s->pc);
-	    return STAT_ADR;
-	}
-	if (!reg_valid(hi1)) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid register ID 0x%.1x\n", s->pc, hi1);
-	    return STAT_INS;
-	}
+	if (!ok1)
+	    return fault(s, STAT_ADR, STOP_IMEM, 0, 0);
+	if (!reg_valid(hi1))
+	    return fault(s, STAT_INS, STOP_REG, 0, hi1);
 	dval = get_reg_val(s->r, REG_RSP);
-	set_reg_val(s->r, REG_RSP, dval+8);
-	if (!get_word_val(s->m, dval, &val)) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid stack address 0x%llx\n",
-			s->pc, dval);
-	    return STAT_ADR;
-	}
-	set_reg_val(s->r, hi1, val);
+	step_reg(s, REG_RSP, dval+8);
+	if (!step_load(s, dval, &val))
+	    return fault(s, STAT_ADR, STOP_STACK, dval, 0);
+	step_reg(s, hi1, val);
 	s->pc = ftpc;
 	break;
     case I_IADDQ:
-	if (!ok1) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid instruction address\n", s->pc);
-	    return STAT_ADR;
-	}
-	if (!okc) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid instruction address",
-			s->pc);
-	    return STAT_INS;
-	}
-	if (!reg_valid(lo1)) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid register ID 0x%.1x\n",
-			s->pc, lo1);
-	    return STAT_INS;
-	}
+	if (!ok1)
+	    return fault(s, STAT_ADR, STOP_IMEM, 0, 0);
+	if (!okc)
+	    return fault(s, STAT_INS, STOP_IMEM, 0, 0);
+	if (!reg_valid(lo1))
+	    return fault(s, STAT_INS, STOP_REG, 0, lo1);
 	argB = get_reg_val(s->r, lo1);
 	val = argB + cval;
-	set_reg_val(s->r, lo1, val);
-	s->cc = compute_cc(A_ADD, cval, argB);
+	step_reg(s, lo1, val);
+	s->cc_op = A_ADD;
+	s->cc_a = cval;
+	s->cc_b = argB;
 	s->pc = ftpc;
 	break;
     default:
-	if (error_file)
-	    fprintf(error_file,
-		    "PC = 0x%llx, Invalid instruction %.2x\n", s->pc, byte0);
-	return STAT_INS;
+	return fault(s, STAT_INS, STOP_INSTR, 0, byte0);
     }
     return STAT_AOK;
 }
+
+stat_t step_state(state_ptr s, FILE *error_file)
+{
+    stat_t e = exec_instr(s);
+    if (e != STAT_AOK && error_file)
+	print_stop(error_file, &s->stop);
+    if (s->log)
+	delta_step(s->log, s->pc, e, get_cc(s));
+    return e;
+}
+
+static char *stop_names[] =
+    {"none", "halt", "budget", "deadline", "imem", "dmem", "stack",
+     "reg", "instr"};
+
+char *stop_name(stop_t why)
+{
+    if (why >= STOP_NONE && why <= STOP_INSTR)
+	return stop_names[why];
+    else
+	return "????";
+}
+
+void print_stop(FILE *outfile, stop_ptr sp)
+{
+    switch (sp->why) {
+    case STOP_IMEM:
+	fprintf(outfile, "PC = 0x%llx, Invalid instruction address\n",
+		sp->pc);
+	break;
+    case STOP_DMEM:
+	fprintf(outfile, "PC = 0x%llx, Invalid data address 0x%llx\n",
+		sp->pc, sp->addr);
+	break;
+    case STOP_STACK:
+	fprintf(outfile, "PC = 0x%llx, Invalid stack address 0x%llx\n",
+		sp->pc, sp->addr);
+	break;
+    case STOP_REG:
+	fprintf(outfile, "PC = 0x%llx, Invalid register ID 0x%.1x\n",
+		sp->pc, sp->val);
+	break;
+    case STOP_INSTR:
+	fprintf(outfile, "PC = 0x%llx, Invalid instruction %.2x\n",
+		sp->pc, sp->val);
+	break;
+    default:
+	break;
+    }
+}
+
+/**************** Delta log ********************/
+
+static void delta_flush(delta_ptr d)
+{
+    if (d->out)
+	fwrite(d->buf, 1, d->len, d->out);
+    d->len = 0;
+}
+
+/* Make room for an event of up to cnt bytes */
+static byte_t *delta_room(delta_ptr d, int cnt)
+{
+    if (d->len + cnt > DELTA_BUF)
+	delta_flush(d);
+    return d->buf + d->len;
+}
+
+static byte_t *put_word(byte_t *b, word_t val)
+{
+    store_word(b, val);
+    return b + 8;
+}
+
+void delta_reg(delta_ptr d, reg_id_t id, word_t val)
+{
+    byte_t *b = delta_room(d, 9);
+    b[0] = D_REG | id;
+    put_word(b+1, val);
+    d->len += 9;
+}
+
+void delta_mem(delta_ptr d, word_t pos, word_t val)
+{
+    byte_t *b = delta_room(d, 17);
+    b[0] = D_MEM;
+    put_word(put_word(b+1, pos), val);
+    d->len += 17;
+}
+
+void delta_step(delta_ptr d, word_t pc, stat_t e, cc_t cc)
+{
+    byte_t *b = delta_room(d, 11);
+    b[0] = D_STEP;
+    b = put_word(b+1, pc);
+    b[0] = e;
+    b[1] = cc;
+    d->len += 11;
+}
+
+void delta_text(delta_ptr d, char *text, int len)
+{
+    byte_t *b = delta_room(d, 5);
+    int i;
+    b[0] = D_TEXT;
+    for (i = 0; i < 4; i++)
+	b[1+i] = (byte_t) (len >> (8*i));
+    d->len += 5;
+    delta_flush(d);
+    if (d->out)
+	fwrite(text, 1, len, d->out);
+}
+
+/* Record the nonzero words of the pages below node */
+static void delta_table(delta_ptr d, void *node, int level, uword_t pn)
+{
+    int i;
+    if (!node)
+	return;
+    if (level > 0) {
+	for (i = 0; i < RADIX_SIZE; i++)
+	    delta_table(d, ((radix_ptr) node)->slot[i], level-1,
+			(pn << RADIX_BITS) | i);
+	return;
+    }
+    for (i = 0; i < MEM_PAGE_SIZE; i += 8) {
+	word_t val = page_word((page_ptr) node, i);
+	if (val)
+	    delta_mem(d, (word_t) ((pn << MEM_PAGE_BITS) + i), val);
+    }
+}
+
+delta_ptr open_delta(FILE *out, state_ptr s)
+{
+    delta_ptr d = (delta_ptr) malloc(sizeof(delta_rec));
+    d->out = out;
+    d->len = 0;
+    if (!out)
+	return d;
+    memcpy(d->buf, DELTA_MAGIC, 8);
+    put_word(put_word(d->buf + 8, s->m->len), s->pc);
+    d->len = 24;
+    delta_table(d, s->m->root, s->m->levels, 0);
+    *delta_room(d, 1) = D_START;
+    d->len++;
+    return d;
+}
+
+void close_delta(delta_ptr d)
+{
+    delta_flush(d);
+    if (d->out)
+	fflush(d->out);
+    free((void *) d);
+}
+
+void clear_writes(writes_ptr w)
+{
+    w->nreg = w->nmem = 0;
+}
+
+void add_reg_write(writes_ptr w, reg_id_t id, word_t val)
+{
+    int i;
+    if (!reg_valid(id))
+	return;
+    for (i = 0; i < w->nreg; i++)
+	if (w->reg[i] == id) {
+	    w->reg_val[i] = val;
+	    return;
+	}
+    if (w->nreg < MAX_WRITES) {
+	w->reg[w->nreg] = id;
+	w->reg_val[w->nreg++] = val;
+    }
+}
+
+void add_mem_write(writes_ptr w, word_t pos, word_t val)
+{
+    if (w->nmem < MAX_WRITES) {
+	w->mem_pos[w->nmem] = pos;
+	w->mem_val[w->nmem++] = val;
+    }
+}
+
+void take_writes(delta_ptr d, writes_ptr w)
+{
+    byte_t *b = d->buf;
+    byte_t *end = d->buf + d->len;
+    clear_writes(w);
+    while (b < end) {
+	if ((*b & 0xF0) == D_REG) {
+	    add_reg_write(w, *b & 0xF, load_word(b+1));
+	    b += 9;
+	} else if (*b == D_MEM) {
+	    add_mem_write(w, load_word(b+1), load_word(b+9));
+	    b += 17;
+	} else if (*b == D_STEP)
+	    b += 11;
+	else
+	    b += 5;
+    }
+    d->len = 0;
+}
+
+/* Value w gives register id, FALSE if it does not write it */
+static bool_t find_reg_write(writes_ptr w, reg_id_t id, word_t *valp)
+{
+    int i;
+    for (i = 0; i < w->nreg; i++)
+	if (w->reg[i] == id) {
+	    *valp = w->reg_val[i];
+	    return TRUE;
+	}
+    return FALSE;
+}
+
+bool_t diff_writes(writes_ptr oldw, writes_ptr neww, FILE *outfile)
+{
+    bool_t diff = FALSE;
+    reg_id_t id;
+    int i;
+    for (id = 0; reg_valid(id); id++) {
+	word_t ov = 0, nv = 0;
+	bool_t ow = find_reg_write(oldw, id, &ov);
+	bool_t nw = find_reg_write(neww, id, &nv);
+	if (ow != nw || (ow && ov != nv)) {
+	    diff = TRUE;
+	    if (!outfile)
+		continue;
+	    fprintf(outfile, "%s:", reg_name(id));
+	    if (ow)
+		fprintf(outfile, "\t0x%.16llx", ov);
+	    else
+		fprintf(outfile, "\t(not written)");
+	    if (nw)
+		fprintf(outfile, "\t0x%.16llx\n", nv);
+	    else
+		fprintf(outfile, "\t(not written)\n");
+	}
+    }
+    for (i = 0; i < oldw->nmem || i < neww->nmem; i++) {
+	if (i < oldw->nmem && i < neww->nmem &&
+	    oldw->mem_pos[i] == neww->mem_pos[i] &&
+	    oldw->mem_val[i] == neww->mem_val[i])
+	    continue;
+	diff = TRUE;
+	if (!outfile)
+	    continue;
+	fprintf(outfile, "memory:");
+	if (i < oldw->nmem)
+	    fprintf(outfile, "\t0x%.16llx at 0x%llx", oldw->mem_val[i],
+		    oldw->mem_pos[i]);
+	else
+	    fprintf(outfile, "\t(not written)");
+	if (i < neww->nmem)
+	    fprintf(outfile, "\t0x%.16llx at 0x%llx\n", neww->mem_val[i],
+		    neww->mem_pos[i]);
+	else
+	    fprintf(outfile, "\t(not written)\n");
+    }
+    return diff;
+}
+
+/**************** Threaded-code execution engine ********************/
+
+#ifdef __GNUC__
+
+/* Dispatch classes of predecoded instructions.  Anything that would
+   make step_state() report an error is classified T_SLOW, so that the
+   handlers themselves need no checks beyond data address validity. */
+typedef enum { T_SLOW, T_NOP, T_HALT, T_RRMOVQ, T_CMOVQ, T_IRMOVQ,
+	       T_RMMOVQ, T_MRMOVQ, T_ADD, T_SUB, T_AND, T_XOR, T_ALU,
+	       T_JMP, T_JXX, T_CALL, T_RET, T_PUSHQ, T_POPQ, T_IADDQ,
+	       T_NCLASS } thread_op_t;
+
+static thread_op_t thread_op(decode_ptr d)
+{
+    if (!d->ok0)
+	return T_SLOW;
+    switch (d->icode) {
+    case I_NOP:
+	return T_NOP;
+    case I_HALT:
+	return T_HALT;
+    case I_RRMOVQ:
+	if (!d->ok1 || !reg_valid(d->ra) || !reg_valid(d->rb))
+	    return T_SLOW;
+	return d->ifun == C_YES ? T_RRMOVQ : T_CMOVQ;
+    case I_IRMOVQ:
+	return d->ok1 && d->okc && reg_valid(d->rb) ? T_IRMOVQ : T_SLOW;
+    case I_RMMOVQ:
+	return d->ok1 && d->okc && reg_valid(d->ra) ? T_RMMOVQ : T_SLOW;
+    case I_MRMOVQ:
+	return d->ok1 && d->okc && reg_valid(d->ra) ? T_MRMOVQ : T_SLOW;
+    case I_ALU:
+	if (!d->ok1)
+	    return T_SLOW;
+	if (d->ra == REG_NONE || d->rb == REG_NONE)
+	    return T_ALU;
+	switch (d->ifun) {
+	case A_ADD: return T_ADD;
+	case A_SUB: return T_SUB;
+	case A_AND: return T_AND;
+	case A_XOR: return T_XOR;
+	default:    return T_ALU;
+	}
+    case I_JMP:
+	if (!d->okc)
+	    return T_SLOW;
+	return d->ifun == C_YES ? T_JMP : T_JXX;
+    case I_CALL:
+	return d->okc ? T_CALL : T_SLOW;
+    case I_RET:
+	return T_RET;
+    case I_PUSHQ:
+	return d->ok1 && reg_valid(d->ra) ? T_PUSHQ : T_SLOW;
+    case I_POPQ:
+	return d->ok1 && reg_valid(d->ra) ? T_POPQ : T_SLOW;
+    case I_IADDQ:
+	return d->ok1 && d->okc && reg_valid(d->rb) ? T_IADDQ : T_SLOW;
+    default:
+	return T_SLOW;
+    }
+}
+
+/* Find the decoded instruction at pc, going through the table directly */
+static inline decode_ptr lookup_decode(mem_t m, word_t pc)
+{
+    if (((uword_t) pc >> MEM_PAGE_BITS) == m->code_tag) {
+	decode_ptr d = &m->code_page->decode[pc & MEM_PAGE_MASK];
+	if (d->valid)
+	    return d;
+    }
+    return decode_instr(m, pc);
+}
+
+/* Condition codes for the ALU operations, as computed by compute_cc() */
+#define ADD_CC(a, b, v) \
+    PACK_CC((v) == 0, (v) < 0, ((a) < 0) == ((b) < 0) && ((v) < 0) != ((a) < 0))
+#define SUB_CC(a, b, v) \
+    PACK_CC((v) == 0, (v) < 0, ((a) > 0) == ((b) < 0) && ((v) < 0) != ((b) < 0))
+#define LOGIC_CC(v) \
+    PACK_CC((v) == 0, (v) < 0, 0)
+
+stat_t run_state_threaded(state_ptr s, word_t max_steps, word_t *stepsp,
+			  FILE *error_file)
+{
+    static void *const ops[T_NCLASS] = {
+	[T_SLOW] = &&op_slow,     [T_NOP] = &&op_nop,
+	[T_HALT] = &&op_halt,     [T_RRMOVQ] = &&op_rrmovq,
+	[T_CMOVQ] = &&op_cmovq,   [T_IRMOVQ] = &&op_irmovq,
+	[T_RMMOVQ] = &&op_rmmovq, [T_MRMOVQ] = &&op_mrmovq,
+	[T_ADD] = &&op_add,       [T_SUB] = &&op_sub,
+	[T_AND] = &&op_and,       [T_XOR] = &&op_xor,
+	[T_ALU] = &&op_alu,       [T_JMP] = &&op_jmp,
+	[T_JXX] = &&op_jxx,       [T_CALL] = &&op_call,
+	[T_RET] = &&op_ret,       [T_PUSHQ] = &&op_pushq,
+	[T_POPQ] = &&op_popq,     [T_IADDQ] = &&op_iaddq
+    };
+    mem_t m = s->m;
+    /* Register file copy.  reg[REG_NONE] stays 0 so it can serve as
+       the missing base register of rmmovq/mrmovq */
+    word_t reg[REG_NONE+1];
+    word_t pc, ipc, val, addr, argA, argB;
+    word_t steps = 0;
+    cc_t cc;
+    decode_ptr d;
+    stat_t e = STAT_AOK;
+    int id;
+
+#define DISPATCH()						\
+    do {							\
+	if (steps >= max_steps)					\
+	    goto done;						\
+	ipc = pc;						\
+	d = lookup_decode(m, pc);				\
+	if (!d->handler)					\
+	    d->handler = ops[thread_op(d)];			\
+	steps++;						\
+	goto *d->handler;					\
+    } while (0)
+
+ load:
+    for (id = 0; id < REG_NONE; id++)
+	reg[id] = get_reg_val(s->r, id);
+    reg[REG_NONE] = 0;
+    pc = s->pc;
+    cc = get_cc(s);
+    DISPATCH();
+
+ op_nop:
+    pc = d->valp;
+    DISPATCH();
+
+ op_halt:
+    e = STAT_HLT;
+    goto done;
+
+ op_rrmovq:
+    reg[d->rb] = reg[d->ra];
+    pc = d->valp;
+    DISPATCH();
+
+ op_cmovq:
+    if (cond_holds(cc, d->ifun))
+	reg[d->rb] = reg[d->ra];
+    pc = d->valp;
+    DISPATCH();
+
+ op_irmovq:
+    reg[d->rb] = d->valc;
+    pc = d->valp;
+    DISPATCH();
+
+ op_rmmovq:
+    addr = d->valc + reg[d->rb];
+    pc = d->valp;
+    if (!set_word_val(m, addr, reg[d->ra]))
+	goto op_slow;
+    DISPATCH();
+
+ op_mrmovq:
+    addr = d->valc + reg[d->rb];
+    if (!get_word_val(m, addr, &val))
+	goto op_slow;
+    reg[d->ra] = val;
+    pc = d->valp;
+    DISPATCH();
+
+ op_add:
+    argA = reg[d->ra];
+    argB = reg[d->rb];
+    val = (word_t) ((uword_t) argA + (uword_t) argB);
+    reg[d->rb] = val;
+    cc = ADD_CC(argA, argB, val);
+    pc = d->valp;
+    DISPATCH();
+
+ op_sub:
+    argA = reg[d->ra];
+    argB = reg[d->rb];
+    val = (word_t) ((uword_t) argB - (uword_t) argA);
+    reg[d->rb] = val;
+    cc = SUB_CC(argA, argB, val);
+    pc = d->valp;
+    DISPATCH();
+
+ op_and:
+    val = reg[d->ra] & reg[d->rb];
+    reg[d->rb] = val;
+    cc = LOGIC_CC(val);
+    pc = d->valp;
+    DISPATCH();
+
+ op_xor:
+    val = reg[d->ra] ^ reg[d->rb];
+    reg[d->rb] = val;
+    cc = LOGIC_CC(val);
+    pc = d->valp;
+    DISPATCH();
+
+ op_alu:
+    /* Unusual function code or REG_NONE operand */
+    argA = reg[d->ra];
+    argB = reg[d->rb];
+    if (d->rb != REG_NONE)
+	reg[d->rb] = compute_alu(d->ifun, argA, argB);
+    cc = compute_cc(d->ifun, argA, argB);
+    pc = d->valp;
+    DISPATCH();
+
+ op_jmp:
+    pc = d->valc;
+    DISPATCH();
+
+ op_jxx:
+    pc = cond_holds(cc, d->ifun) ? d->valc : d->valp;
+    DISPATCH();
+
+ op_call:
+    addr = reg[REG_RSP] - 8;
+    val = d->valc;
+    if (!set_word_val(m, addr, d->valp))
+	goto op_slow;
+    reg[REG_RSP] = addr;
+    pc = val;
+    DISPATCH();
+
+ op_ret:
+    addr = reg[REG_RSP];
+    if (!get_word_val(m, addr, &val))
+	goto op_slow;
+    reg[REG_RSP] = addr + 8;
+    pc = val;
+    DISPATCH();
+
+ op_pushq:
+    addr = reg[REG_RSP] - 8;
+    val = d->valp;
+    if (!set_word_val(m, addr, reg[d->ra]))
+	goto op_slow;
+    reg[REG_RSP] = addr;
+    pc = val;
+    DISPATCH();
+
+ op_popq:
+    addr = reg[REG_RSP];
+    if (!get_word_val(m, addr, &val))
+	goto op_slow;
+    reg[REG_RSP] = addr + 8;
+    reg[d->ra] = val;
+    pc = d->valp;
+    DISPATCH();
+
+ op_iaddq:
+    argB = reg[d->rb];
+    val = (word_t) ((uword_t) argB + (uword_t) d->valc);
+    reg[d->rb] = val;
+    cc = ADD_CC(d->valc, argB, val);
+    pc = d->valp;
+    DISPATCH();
+
+ op_slow:
+    /* Let step_state() execute the instruction and report any error.
+       No architectural state has been changed by this instruction yet. */
+    for (id = 0; id < REG_NONE; id++)
+	set_reg_val(s->r, id, reg[id]);
+    s->pc = ipc;
+    set_cc(s, cc);
+    e = step_state(s, error_file);
+    if (e == STAT_AOK)
+	goto load;
+    goto out;
+
+ done:
+    for (id = 0; id < REG_NONE; id++)
+	set_reg_val(s->r, id, reg[id]);
+    s->pc = pc;
+    set_cc(s, cc);
+ out:
+    if (stepsp)
+	*stepsp = steps;
+    return e;
+#undef DISPATCH
+}
+
+
+/**************** Basic-block execution engine ********************/
+
+/* Micro-op classes: the threaded-engine classes plus a block exit */
+#define B_EXIT T_NCLASS
+#define B_NCLASS (T_NCLASS+1)
+
+static bool_t ends_block(thread_op_t op)
+{
+    return op == T_HALT || op == T_JMP || op == T_JXX ||
+	op == T_CALL || op == T_RET || op == T_SLOW;
+}
+
+/* Look up the block starting at pc, translating it if necessary */
+static block_ptr find_block(mem_t m, word_t pc, void *const *ops)
+{
+    struct block_cache *bc = m->blocks;
+    int h = BLOCK_HASH_IDX(pc);
+    block_ptr b;
+    uop_rec u[BLOCK_MAX_INSTR+1];
+    int n = 0;
+    word_t end = pc;
+    thread_op_t op = T_NOP;
+
+    for (b = bc->bucket[h]; b; b = b->hash_next)
+	if (b->start == pc)
+	    return b;
+
+    for (;;) {
+	decode_ptr d = decode_instr(m, pc);
+	op = thread_op(d);
+	if (op == T_SLOW && n > 0) {
+	    op = T_NOP;
+	    break;
+	}
+	u[n].handler = ops[op];
+	u[n].ra = d->ra;
+	u[n].rb = d->rb;
+	u[n].ifun = d->ifun;
+	u[n].idx = n;
+	u[n].valc = d->valc;
+	u[n].valp = d->valp;
+	u[n].pc = pc;
+	n++;
+	if (d->valp > end)
+	    end = d->valp;
+	pc = d->valp;
+	if (ends_block(op))
+	    break;
+	if (n == BLOCK_MAX_INSTR)
+	    break;
+    }
+    if (ends_block(op)) {
+	b = (block_ptr) malloc(sizeof(block_rec) + n*sizeof(uop_rec));
+	memcpy(b->ops, u, n*sizeof(uop_rec));
+    } else {
+	/* Straight-line code continues in another block */
+	u[n].handler = ops[B_EXIT];
+	u[n].ra = u[n].rb = REG_NONE;
+	u[n].ifun = 0;
+	u[n].idx = n;
+	u[n].valc = 0;
+	u[n].valp = pc;
+	u[n].pc = pc;
+	b = (block_ptr) malloc(sizeof(block_rec) + (n+1)*sizeof(uop_rec));
+	memcpy(b->ops, u, (n+1)*sizeof(uop_rec));
+    }
+    b->start = u[0].pc;
+    b->end = end;
+    b->ninstr = n;
+    b->valid = TRUE;
+    b->succ[0] = b->succ[1] = NULL;
+    b->hash_next = bc->bucket[h];
+    bc->bucket[h] = b;
+    b->all_next = bc->all;
+    bc->all = b;
+    return b;
+}
+
+/* Drop blocks whose code overlaps bytes [pos, pos+cnt) */
+static void invalidate_blocks(mem_t m, word_t pos, int cnt)
+{
+    struct block_cache *bc = m->blocks;
+    block_ptr b, *bp;
+    for (b = bc->all; b; b = b->all_next) {
+	if (!b->valid || pos >= b->end || pos + cnt <= b->start)
+	    continue;
+	b->valid = FALSE;
+	bc->dead++;
+	for (bp = &bc->bucket[BLOCK_HASH_IDX(b->start)]; *bp;
+	     bp = &(*bp)->hash_next) {
+	    if (*bp == b) {
+		*bp = b->hash_next;
+		break;
+	    }
+	}
+    }
+    /* Dead blocks may still be reachable through successor links,
+       so they are only reclaimed all at once */
+    if (bc->dead > BLOCK_MAX_DEAD)
+	reset_blocks(bc);
+}
+
+stat_t run_state_block(state_ptr s, word_t max_steps, word_t *stepsp,
+		       FILE *error_file)
+{
+    static void *const ops[B_NCLASS] = {
+	[T_SLOW] = &&op_slow,     [T_NOP] = &&op_nop,
+	[T_HALT] = &&op_halt,     [T_RRMOVQ] = &&op_rrmovq,
+	[T_CMOVQ] = &&op_cmovq,   [T_IRMOVQ] = &&op_irmovq,
+	[T_RMMOVQ] = &&op_rmmovq, [T_MRMOVQ] = &&op_mrmovq,
+	[T_ADD] = &&op_add,       [T_SUB] = &&op_sub,
+	[T_AND] = &&op_and,       [T_XOR] = &&op_xor,
+	[T_ALU] = &&op_alu,       [T_JMP] = &&op_jmp,
+	[T_JXX] = &&op_jxx,       [T_CALL] = &&op_call,
+	[T_RET] = &&op_ret,       [T_PUSHQ] = &&op_pushq,
+	[T_POPQ] = &&op_popq,     [T_IADDQ] = &&op_iaddq,
+	[B_EXIT] = &&op_exit
+    };
+    mem_t m = s->m;
+    word_t reg[REG_NONE+1];
+    word_t pc, val, addr, argA, argB, rest;
+    word_t steps = 0;
+    word_t base = 0;   /* Steps taken before entering current block */
+    cc_t cc;
+    block_ptr b, *slot;
+    uop_ptr u;
+    stat_t e = STAT_AOK;
+    int id;
+
+    if (!m->blocks)
+	m->blocks = (struct block_cache *) calloc(1, sizeof(struct block_cache));
+    if (m->blocks->code_writes != m->code_writes) {
+	/* Code was overwritten since the last call, by another engine */
+	m->blocks->code_writes = m->code_writes;
+	reset_blocks(m->blocks);
+    }
+
+#define NEXT()							\
+    do {							\
+	u++;							\
+	goto *u->handler;					\
+    } while (0)
+/* After a store: leave the block if it overwrote translated code */
+#define CHECK_CODE()						\
+    do {							\
+	if (m->code_writes != m->blocks->code_writes)		\
+	    goto code_hit;					\
+    } while (0)
+/* Continue with the block at pc, through successor link slot */
+#define CHAIN(link)						\
+    do {							\
+	slot = &b->succ[link];					\
+	goto chain;						\
+    } while (0)
+#define SAVE_STATE()						\
+    do {							\
+	for (id = 0; id < REG_NONE; id++)			\
+	    set_reg_val(s->r, id, reg[id]);			\
+	s->pc = pc;						\
+	set_cc(s, cc);						\
+    } while (0)
+
+ load:
+    for (id = 0; id < REG_NONE; id++)
+	reg[id] = get_reg_val(s->r, id);
+    reg[REG_NONE] = 0;
+    pc = s->pc;
+    cc = get_cc(s);
+
+ lookup:
+    b = find_block(m, pc, ops);
+
+ enter:
+    if (steps + b->ninstr > max_steps)
+	goto tail;
+    base = steps;
+    steps += b->ninstr;
+    u = b->ops;
+    goto *u->handler;
+
+ chain:
+    if (*slot && (*slot)->valid && (*slot)->start == pc) {
+	b = *slot;
+	goto enter;
+    }
+    *slot = find_block(m, pc, ops);
+    b = *slot;
+    goto enter;
+
+ op_nop:
+    NEXT();
+
+ op_halt:
+    e = STAT_HLT;
+    pc = u->pc;
+    goto done;
+
+ op_rrmovq:
+    reg[u->rb] = reg[u->ra];
+    NEXT();
+
+ op_cmovq:
+    if (cond_holds(cc, u->ifun))
+	reg[u->rb] = reg[u->ra];
+    NEXT();
+
+ op_irmovq:
+    reg[u->rb] = u->valc;
+    NEXT();
+
+ op_rmmovq:
+    addr = u->valc + reg[u->rb];
+    if (!set_word_val(m, addr, reg[u->ra]))
+	goto op_slow;
+    pc = u->valp;
+    CHECK_CODE();
+    NEXT();
+
+ op_mrmovq:
+    addr = u->valc + reg[u->rb];
+    if (!get_word_val(m, addr, &val))
+	goto op_slow;
+    reg[u->ra] = val;
+    NEXT();
+
+ op_add:
+    argA = reg[u->ra];
+    argB = reg[u->rb];
+    val = (word_t) ((uword_t) argA + (uword_t) argB);
+    reg[u->rb] = val;
+    cc = ADD_CC(argA, argB, val);
+    NEXT();
+
+ op_sub:
+    argA = reg[u->ra];
+    argB = reg[u->rb];
+    val = (word_t) ((uword_t) argB - (uword_t) argA);
+    reg[u->rb] = val;
+    cc = SUB_CC(argA, argB, val);
+    NEXT();
+
+ op_and:
+    val = reg[u->ra] & reg[u->rb];
+    reg[u->rb] = val;
+    cc = LOGIC_CC(val);
+    NEXT();
+
+ op_xor:
+    val = reg[u->ra] ^ reg[u->rb];
+    reg[u->rb] = val;
+    cc = LOGIC_CC(val);
+    NEXT();
+
+ op_alu:
+    argA = reg[u->ra];
+    argB = reg[u->rb];
+    if (u->rb != REG_NONE)
+	reg[u->rb] = compute_alu(u->ifun, argA, argB);
+    cc = compute_cc(u->ifun, argA, argB);
+    NEXT();
+
+ op_iaddq:
+    argB = reg[u->rb];
+    val = (word_t) ((uword_t) argB + (uword_t) u->valc);
+    reg[u->rb] = val;
+    cc = ADD_CC(u->valc, argB, val);
+    NEXT();
+
+ op_pushq:
+    addr = reg[REG_RSP] - 8;
+    if (!set_word_val(m, addr, reg[u->ra]))
+	goto op_slow;
+    reg[REG_RSP] = addr;
+    pc = u->valp;
+    CHECK_CODE();
+    NEXT();
+
+ op_popq:
+    addr = reg[REG_RSP];
+    if (!get_word_val(m, addr, &val))
+	goto op_slow;
+    reg[REG_RSP] = addr + 8;
+    reg[u->ra] = val;
+    NEXT();
+
+ op_jmp:
+    pc = u->valc;
+    CHAIN(0);
+
+ op_jxx:
+    if (cond_holds(cc, u->ifun)) {
+	pc = u->valc;
+	CHAIN(1);
+    }
+    pc = u->valp;
+    CHAIN(0);
+
+ op_call:
+    addr = reg[REG_RSP] - 8;
+    if (!set_word_val(m, addr, u->valp))
+	goto op_slow;
+    reg[REG_RSP] = addr;
+    pc = u->valc;
+    CHECK_CODE();
+    CHAIN(0);
+
+ op_ret:
+    addr = reg[REG_RSP];
+    if (!get_word_val(m, addr, &val))
+	goto op_slow;
+    reg[REG_RSP] = addr + 8;
+    pc = val;
+    CHAIN(0);
+
+ op_exit:
+    pc = u->pc;
+    CHAIN(0);
+
+ code_hit:
+    /* The store at u changed translated code: the rest of this block
+       may be stale, so resume at the next instruction */
+    steps = base + u->idx + 1;
+    m->blocks->code_writes = m->code_writes;
+    invalidate_blocks(m, addr, 8);
+    if (steps >= max_steps)
+	goto done;
+    goto lookup;
+
+ op_slow:
+    /* Let step_state() execute the instruction and report any error */
+    steps = base + u->idx;
+    pc = u->pc;
+    SAVE_STATE();
+    e = step_state(s, error_file);
+    steps++;
+    if (m->code_writes != m->blocks->code_writes) {
+	/* step_state() overwrote translated code */
+	m->blocks->code_writes = m->code_writes;
+	reset_blocks(m->blocks);
+    }
+    if (e == STAT_AOK) {
+	if (steps >= max_steps)
+	    goto out;
+	goto load;
+    }
+    goto out;
+
+ tail:
+    /* Not enough steps left for a whole block */
+    SAVE_STATE();
+    e = run_state_threaded(s, max_steps - steps, &rest, error_file);
+    steps += rest;
+    goto out;
+
+ done:
+    SAVE_STATE();
+ out:
+    if (stepsp)
+	*stepsp = steps;
+    return e;
+#undef NEXT
+#undef CHECK_CODE
+#undef CHAIN
+#undef SAVE_STATE
+}
+
+#else /* !__GNUC__ */
+
+stat_t run_state_threaded(state_ptr s, word_t max_steps, word_t *stepsp,
+			  FILE *error_file)
+{
+    word_t steps = 0;
+    stat_t e = STAT_AOK;
+    while (steps < max_steps && e == STAT_AOK) {
+	e = step_state(s, error_file);
+	steps++;
+    }
+    if (stepsp)
+	*stepsp = steps;
+    return e;
+}
+
+stat_t run_state_block(state_ptr s, word_t max_steps, word_t *stepsp,
+		       FILE *error_file)
+{
+    return run_state_threaded(s, max_steps, stepsp, error_file);
+}
+
+#endif /* __GNUC__ */
+
+/**************** Batch execution ********************/
+
+/* Instructions between checks of the deadline */
+#define RUN_SLICE (1 << 16)
+
+static double wall_time()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+stat_t run_state(state_ptr s, word_t max_steps, run_stats *rs)
+{
+    double end = rs && rs->deadline > 0 ? wall_time() + rs->deadline : 0;
+    word_t steps = 0;
+    word_t n;
+    stat_t e = STAT_AOK;
+
+    s->stop.why = STOP_NONE;
+    while (e == STAT_AOK && steps < max_steps) {
+	word_t slice = max_steps - steps;
+	if (end > 0) {
+	    if (wall_time() >= end)
+		break;
+	    if (slice > RUN_SLICE)
+		slice = RUN_SLICE;
+	}
+	if (s->log || s->prof || s->trace) {
+	    /* The engines neither log, profile nor trace */
+	    e = step_state(s, NULL);
+	    n = 1;
+	} else
+	    e = run_state_block(s, slice, &n, NULL);
+	steps += n;
+    }
+    if (e == STAT_HLT) {
+	/* The engines finish halt themselves */
+	s->stop.why = STOP_HALT;
+	s->stop.pc = s->pc;
+    } else if (e == STAT_AOK) {
+	s->stop.why = steps < max_steps ? STOP_DEADLINE : STOP_BUDGET;
+	s->stop.pc = s->pc;
+    }
+    if (rs) {
+	rs->status = e;
+	rs->steps = steps;
+	rs->stop = s->stop;
+    }
+    return e;
+}
+
+/**************** Profiling ********************/
+
+prof_ptr new_prof(word_t len, bool_t timed)
+{
+    prof_ptr p = (prof_ptr) calloc(1, sizeof(prof_rec));
+    p->len = len;
+    p->count = (uword_t *) calloc(len, sizeof(uword_t));
+    p->cycles = timed ? (uword_t *) calloc(len, sizeof(uword_t)) : NULL;
+    return p;
+}
+
+void free_prof(prof_ptr p)
+{
+    prof_node_ptr n = p->root;
+    int i;
+    /* Free the tree in the order it is printed, children first */
+    while (n) {
+	prof_node_ptr next;
+	if (n->child) {
+	    n = n->child;
+	    continue;
+	}
+	next = n->next ? n->next : n->parent;
+	if (n->parent && n->parent->child == n)
+	    n->parent->child = n->next;
+	free((void *) n);
+	n = next;
+    }
+    for (i = 0; i < p->nlabels; i++)
+	free((void *) p->labels[i].name);
+    free((void *) p->labels);
+    free((void *) p->count);
+    free((void *) p->cycles);
+    free((void *) p);
+}
+
+static prof_node_ptr new_node(prof_node_ptr parent, word_t entry)
+{
+    prof_node_ptr n = (prof_node_ptr) calloc(1, sizeof(prof_node_rec));
+    n->entry = entry;
+    n->parent = parent;
+    if (parent) {
+	n->next = parent->child;
+	parent->child = n;
+    }
+    return n;
+}
+
+void prof_instr(prof_ptr p, word_t pc, int icode, int ifun, word_t cycles)
+{
+    if (p->in_call) {
+	/* Find the callee among the contexts called from here */
+	prof_node_ptr n = p->cur->child;
+	while (n && n->entry != pc)
+	    n = n->next;
+	p->cur = n ? n : new_node(p->cur, pc);
+	p->in_call = FALSE;
+    } else if (!p->cur)
+	p->root = p->cur = new_node(NULL, pc);
+    if ((uword_t) pc < (uword_t) p->len) {
+	p->count[pc]++;
+	if (p->cycles)
+	    p->cycles[pc] += cycles;
+    } else {
+	p->other_count++;
+	p->other_cycles += cycles;
+    }
+    p->ops[icode & 0xF][ifun & 0xF]++;
+    p->cur->count++;
+    p->cur->cycles += cycles;
+    if (icode == I_CALL)
+	p->in_call = TRUE;
+    else if (icode == I_RET && p->cur->parent)
+	p->cur = p->cur->parent;
+}
+
+static void add_label(prof_ptr p, word_t addr, const char *name, int len)
+{
+    p->labels = (label_rec *) realloc(p->labels,
+				      (p->nlabels + 1) * sizeof(label_rec));
+    p->labels[p->nlabels].addr = addr;
+    p->labels[p->nlabels].name = (char *) malloc(len + 1);
+    memcpy(p->labels[p->nlabels].name, name, len);
+    p->labels[p->nlabels].name[len] = '\0';
+    p->nlabels++;
+}
+
+/* Labels of a .yo listing: an identifier and colon at the start of the
+   source text, after the '|' */
+static void yo_labels(prof_ptr p, byte_t *image, size_t len)
+{
+    char *line = (char *) image;
+    char *end = line + len;
+    while (line < end) {
+	char *eol = memchr(line, '\n', end - line);
+	char *c = line;
+	word_t addr = 0;
+	if (!eol)
+	    eol = end;
+	while (c < eol && IS_SPACE(*c))
+	    c++;
+	if (eol - c > 2 && c[0] == '0' && (c[1] == 'x' || c[1] == 'X')) {
+	    for (c += 2; c < eol && hex_val[(byte_t) *c] >= 0; c++)
+		addr = addr * 16 + hex_val[(byte_t) *c];
+	    while (c < eol && *c != '|')
+		c++;
+	    if (c < eol) {
+		int n = 0;
+		for (c++; c < eol && IS_SPACE(*c); c++)
+		    ;
+		while (c + n < eol && (isalnum((int) c[n]) || c[n] == '_'))
+		    n++;
+		if (n > 0 && c + n < eol && c[n] == ':' && !isdigit((int) c[0]))
+		    add_label(p, addr, c, n);
+	    }
+	}
+	line = eol + 1;
+    }
+}
+
+/* Symbols of a .ybo file */
+static void ybo_labels(prof_ptr p, byte_t *image, size_t len)
+{
+    int nsect, nsym, i;
+    nsect = ybo_int(image + 16);
+    nsym = ybo_int(image + 20);
+    if (nsect < 0 || nsym < 0 || YBO_HEADER + (size_t) nsect * YBO_SECTION +
+	(size_t) nsym * YBO_SYMBOL > len)
+	return;
+    for (i = 0; i < nsym; i++) {
+	byte_t *sym = image + YBO_HEADER + nsect * YBO_SECTION +
+	    i * YBO_SYMBOL;
+	uword_t offset = ybo_word(sym + 8);
+	char *name = (char *) image + offset;
+	char *nul;
+	if (offset >= len || !(nul = memchr(name, 0, len - offset)))
+	    continue;
+	add_label(p, ybo_word(sym), name, nul - name);
+    }
+}
+
+static int label_cmp(const void *a, const void *b)
+{
+    const label_rec *la = (const label_rec *) a;
+    const label_rec *lb = (const label_rec *) b;
+    if (la->addr != lb->addr)
+	return la->addr < lb->addr ? -1 : 1;
+    return strcmp(la->name, lb->name);
+}
+
+int load_labels(prof_ptr p, FILE *infile)
+{
+    int c = getc(infile);
+    int old = p->nlabels;
+    byte_t *image;
+    size_t len;
+    bool_t mapped;
+    if (c == EOF)
+	return 0;
+    image = map_file(infile, c, &len, &mapped);
+    if (len >= YBO_HEADER && !memcmp(image, YBO_MAGIC, 8))
+	ybo_labels(p, image, len);
+    else
+	yo_labels(p, image, len);
+    unmap_file(image, len, mapped);
+    qsort(p->labels, p->nlabels, sizeof(label_rec), label_cmp);
+    return p->nlabels - old;
+}
+
+/* Index of the label covering pc, -1 if none */
+static int find_label(prof_ptr p, word_t pc)
+{
+    int lo = 0, hi = p->nlabels;
+    while (lo < hi) {
+	int mid = (lo + hi) / 2;
+	if ((uword_t) p->labels[mid].addr <= (uword_t) pc)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    /* Of several names for one address, use the first */
+    while (lo > 1 && p->labels[lo-2].addr == p->labels[lo-1].addr)
+	lo--;
+    return lo - 1;
+}
+
+/* Write pc as label+offset, or plain hex if no label covers it */
+static void pc_name(char *buf, prof_ptr p, word_t pc)
+{
+    int l = find_label(p, pc);
+    if (l < 0)
+	sprintf(buf, "0x%llx", pc);
+    else if (pc == p->labels[l].addr)
+	sprintf(buf, "%.60s", p->labels[l].name);
+    else
+	sprintf(buf, "%.60s+0x%llx", p->labels[l].name,
+		pc - p->labels[l].addr);
+}
+
+typedef struct {
+    word_t pc;          /* Or label index */
+    uword_t count, cycles;
+} hot_rec;
+
+static int hot_cmp(const void *a, const void *b)
+{
+    const hot_rec *ha = (const hot_rec *) a;
+    const hot_rec *hb = (const hot_rec *) b;
+    if (ha->cycles != hb->cycles)
+	return ha->cycles > hb->cycles ? -1 : 1;
+    if (ha->count != hb->count)
+	return ha->count > hb->count ? -1 : 1;
+    return ha->pc < hb->pc ? -1 : ha->pc > hb->pc;
+}
+
+static double percent(uword_t part, uword_t whole)
+{
+    return whole ? 100.0 * part / whole : 0.0;
+}
+
+void print_prof(FILE *outfile, prof_ptr p, int top)
+{
+    uword_t total = p->other_count, total_cycles = p->other_cycles;
+    hot_rec *pcs, *labs;
+    char name[80];
+    int npc = 0, cap = 64, nlab = p->nlabels + 1;
+    int i, j;
+    word_t pc;
+
+    pcs = (hot_rec *) malloc(cap * sizeof(hot_rec));
+    labs = (hot_rec *) calloc(nlab, sizeof(hot_rec));
+    for (i = 0; i < nlab; i++)
+	labs[i].pc = i - 1;
+    for (pc = 0; pc < p->len; pc++) {
+	uword_t cyc;
+	if (!p->count[pc])
+	    continue;
+	cyc = p->cycles ? p->cycles[pc] : 0;
+	total += p->count[pc];
+	total_cycles += cyc;
+	if (npc == cap)
+	    pcs = (hot_rec *) realloc(pcs, (cap *= 2) * sizeof(hot_rec));
+	pcs[npc].pc = pc;
+	pcs[npc].count = p->count[pc];
+	pcs[npc].cycles = cyc;
+	npc++;
+	/* Unlabeled code goes in slot 0 */
+	j = find_label(p, pc) + 1;
+	labs[j].count += p->count[pc];
+	labs[j].cycles += cyc;
+    }
+
+    fprintf(outfile, "%llu instructions", total);
+    if (p->cycles)
+	fprintf(outfile, ", %llu cycles, CPI %.2f", total_cycles,
+		total ? (double) total_cycles / total : 1.0);
+    fprintf(outfile, "\n\nInstruction mix:\n");
+    for (i = 0; i < 16; i++)
+	for (j = 0; j < 16; j++)
+	    if (p->ops[i][j])
+		fprintf(outfile, "  %-8s %12llu %6.2f%%\n", iname(HPACK(i, j)),
+			p->ops[i][j], percent(p->ops[i][j], total));
+
+    fprintf(outfile, "\nBy label:\n");
+    qsort(labs, nlab, sizeof(hot_rec), hot_cmp);
+    for (i = 0; i < nlab; i++) {
+	if (!labs[i].count)
+	    continue;
+	fprintf(outfile, "  %-24.24s %12llu %6.2f%%",
+		labs[i].pc < 0 ? "(none)" : p->labels[labs[i].pc].name,
+		labs[i].count, percent(labs[i].count, total));
+	if (p->cycles)
+	    fprintf(outfile, " %12llu %6.2f%%", labs[i].cycles,
+		    percent(labs[i].cycles, total_cycles));
+	fprintf(outfile, "\n");
+    }
+    if (p->other_count)
+	fprintf(outfile, "  %-24s %12llu %6.2f%%\n", "(beyond profile)",
+		p->other_count, percent(p->other_count, total));
+
+    fprintf(outfile, "\nHottest PCs:\n");
+    qsort(pcs, npc, sizeof(hot_rec), hot_cmp);
+    for (i = 0; i < npc && i < top; i++) {
+	pc_name(name, p, pcs[i].pc);
+	fprintf(outfile, "  0x%.4llx %-24.24s %12llu %6.2f%%", pcs[i].pc, name,
+		pcs[i].count, percent(pcs[i].count, total));
+	if (p->cycles)
+	    fprintf(outfile, " %12llu %6.2f%%", pcs[i].cycles,
+		    percent(pcs[i].cycles, total_cycles));
+	fprintf(outfile, "\n");
+    }
+    free((void *) pcs);
+    free((void *) labs);
+}
+
+void print_folded(FILE *outfile, prof_ptr p)
+{
+    prof_node_ptr *stack = NULL;
+    int cap = 0;
+    prof_node_ptr n = p->root;
+    char name[80];
+    while (n) {
+	uword_t weight = p->cycles ? n->cycles : n->count;
+	if (weight) {
+	    prof_node_ptr a;
+	    int depth = 0, i;
+	    for (a = n; a; a = a->parent) {
+		if (depth == cap) {
+		    cap = cap ? 2 * cap : 64;
+		    stack = (prof_node_ptr *)
+			realloc(stack, cap * sizeof(prof_node_ptr));
+		}
+		stack[depth++] = a;
+	    }
+	    for (i = depth - 1; i >= 0; i--) {
+		pc_name(name, p, stack[i]->entry);
+		fprintf(outfile, "%s%c", name, i > 0 ? ';' : ' ');
+	    }
+	    fprintf(outfile, "%llu\n", weight);
+	}
+	/* Preorder walk */
+	if (n->child)
+	    n = n->child;
+	else {
+	    while (n && !n->next)
+		n = n->parent;
+	    if (n)
+		n = n->next;
+	}
+    }
+    free((void *) stack);
+}
+
+/* Memory trace */
+
+trace_ptr open_trace(FILE *out, bool_t fetches)
+{
+    trace_ptr t = (trace_ptr) malloc(sizeof(trace_rec));
+    t->out = out;
+    t->fetches = fetches;
+    t->len = 0;
+    return t;
+}
+
+static void trace_flush(trace_ptr t)
+{
+    fwrite(t->buf, 1, t->len, t->out);
+    t->len = 0;
+}
+
+void close_trace(trace_ptr t)
+{
+    trace_flush(t);
+    fflush(t->out);
+    free((void *) t);
+}
+
+/* Longest line: kind, 16 hex digits, comma, length and newline */
+#define TRACE_LINE 32
+
+void trace_access(trace_ptr t, char kind, word_t addr, int len)
+{
+    static const char hex[] = "0123456789abcdef";
+    char *b;
+    int n;
+    if (kind == 'I' && !t->fetches)
+	return;
+    if (t->len + TRACE_LINE > TRACE_BUF)
+	trace_flush(t);
+    b = t->buf + t->len;
+    /* Lackey puts fetches in column 0 and data accesses in column 1,
+       with at least 8 address digits */
+    if (kind == 'I') {
+	*b++ = 'I';
+	*b++ = ' ';
+    } else {
+	*b++ = ' ';
+	*b++ = kind;
+    }
+    *b++ = ' ';
+    for (n = 8; n < 16 && ((uword_t) addr >> (4*n)); n++)
+	;
+    while (n-- > 0)
+	*b++ = hex[((uword_t) addr >> (4*n)) & 0xF];
+    *b++ = ',';
+    if (len >= 10)
+	*b++ = '0' + len / 10 % 10;
+    *b++ = '0' + len % 10;
+    *b++ = '\n';
+    t->len = b - t->buf;
+}
+
+/* Event log */
+
+log_ptr open_log(FILE *out, int level)
+{
+    log_ptr l = (log_ptr) malloc(sizeof(log_buf_rec));
+    l->out = out;
+    l->level = level;
+    l->len = 0;
+    return l;
+}
+
+void close_log(log_ptr l)
+{
+    flush_log(l);
+    free((void *) l);
+}
+
+void log_event(log_ptr l, const log_event_rec *ev, ...)
+{
+    log_rec *r;
+    const char *k;
+    int i;
+    va_list ap;
+    if (l->len == LOG_BUF)
+	flush_log(l);
+    r = &l->buf[l->len++];
+    r->event = ev;
+    va_start(ap, ev);
+    for (k = ev->kinds, i = 0; *k; k++, i++) {
+	if (*k == 'w')
+	    r->arg[i] = va_arg(ap, word_t);
+	else if (*k == 'S')
+	    r->arg[i] = (word_t) (size_t) va_arg(ap, const char *);
+	else
+	    r->arg[i] = va_arg(ap, int);
+    }
+    va_end(ap);
+}
+
+/* Text of an argument of a name kind */
+static const char *event_name(char k, word_t a)
+{
+    switch (k) {
+    case 'i':
+	return iname((int) a);
+    case 'r':
+	return reg_name((reg_id_t) a);
+    case 'C':
+	return cc_name((cc_t) a);
+    case 's':
+	return stat_name((stat_t) a);
+    default:
+	return (const char *) (size_t) a;
+    }
+}
+
+/* Format one event at b, returning the end of its text.  The plain
+   conversions the simulators use are done here; anything fancier goes
+   to sprintf().  An event's text must fit in LOG_LINE bytes. */
+#define LOG_LINE 1024
+
+static char *print_event(char *b, log_rec *r)
+{
+    static const char hex[] = "0123456789abcdef";
+    char digits[24];
+    char spec[16];
+    const char *f = r->event->format;
+    const char *k = r->event->kinds;
+    word_t *arg = r->arg;
+    int n, d;
+    uword_t v;
+    for (;;) {
+	n = strcspn(f, "%");
+	memcpy(b, f, n);
+	b += n;
+	f += n;
+	if (!*f)
+	    break;
+	if (f[1] == '%') {
+	    *b++ = '%';
+	    f += 2;
+	    continue;
+	}
+	for (n = 1; f[n] && !strchr("diouxXcs", f[n]); n++)
+	    ;
+	if (!f[n] || n >= (int) sizeof(spec) - 1)
+	    break;
+	if (n == 1 && f[1] == 's')
+	    b = stpcpy(b, event_name(*k, *arg));
+	else if (n == 1 && f[1] == 'c')
+	    *b++ = (char) *arg;
+	else if (n == 3 && f[1] == 'l' && f[2] == 'l' &&
+		 (f[3] == 'x' || (f[3] == 'd' && *arg >= 0))) {
+	    int base = f[3] == 'x' ? 16 : 10;
+	    v = (uword_t) *arg;
+	    d = 0;
+	    do {
+		digits[d++] = hex[v % base];
+		v /= base;
+	    } while (v);
+	    while (d > 0)
+		*b++ = digits[--d];
+	} else {
+	    memcpy(spec, f, n + 1);
+	    spec[n + 1] = '\0';
+	    if (*k == 'w')
+		b += sprintf(b, spec, *arg);
+	    else if (f[n] == 's')
+		b += sprintf(b, spec, event_name(*k, *arg));
+	    else
+		b += sprintf(b, spec, (int) *arg);
+	}
+	f += n + 1;
+	k++;
+	arg++;
+    }
+    return b;
+}
+
+void flush_log(log_ptr l)
+{
+    char text[16 * LOG_LINE];
+    char *b = text;
+    int i;
+    for (i = 0; i < l->len; i++) {
+	if (b - text > (int) sizeof(text) - LOG_LINE) {
+	    fwrite(text, 1, b - text, l->out);
+	    b = text;
+	}
+	b = print_event(b, &l->buf[i]);
+    }
+    fwrite(text, 1, b - text, l->out);
+    l->len = 0;
+}
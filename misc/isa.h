@@ -23,6 +23,8 @@ typedef enum { REG_RAX, REG_RCX, REG_RDX, REG_RBX,
 reg_id_t find_register(char *name);
 /* Return name of register given its ID */
 char *reg_name(reg_id_t id);
+/* Is ID one of the 15 program registers? */
+int reg_valid(reg_id_t id);
 
 /**************** Instruction Encoding **************/
 
@@ -88,24 +90,147 @@ typedef unsigned char byte_t;
 typedef long long int word_t;
 typedef long long unsigned uword_t;
 
-/* Represent a memory as an array of bytes */
+/* Little-endian word at p, at any alignment.  Where the host allows it
+   this is a single load or store. */
+static inline word_t load_word(const byte_t *p)
+{
+#if defined(__GNUC__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    word_t val;
+    __builtin_memcpy(&val, p, 8);
+    return val;
+#else
+    uword_t val = 0;
+    int i;
+    for (i = 7; i >= 0; i--)
+	val = (val << 8) | p[i];
+    return (word_t) val;
+#endif
+}
+
+static inline void store_word(byte_t *p, word_t val)
+{
+#if defined(__GNUC__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    __builtin_memcpy(p, &val, 8);
+#else
+    int i;
+    for (i = 0; i < 8; i++)
+	p[i] = (byte_t) ((uword_t) val >> (8*i));
+#endif
+}
+
+/* Longest instruction encoding, in bytes */
+#define MAX_INSTR_LEN 10
+
+/* Predecoded instruction, as seen by the fetch stage */
 typedef struct {
-  int len;
-  word_t maxaddr;
-  byte_t *contents;
+  byte_t valid;  /* Entry holds a decoded instruction */
+  byte_t instr;  /* Instruction byte (icode:ifun) */
+  byte_t icode;
+  byte_t ifun;
+  byte_t ra;     /* REG_NONE when no register byte */
+  byte_t rb;
+  byte_t ok0;    /* Instruction byte was readable */
+  byte_t ok1;    /* Register byte (if needed) was readable */
+  byte_t okc;    /* Constant word (if needed) was readable */
+  word_t valc;   /* Constant word, 0 when none */
+  word_t valp;   /* Address of following instruction */
+  void *handler; /* Dispatch target cached by the threaded engine */
+} decode_rec, *decode_ptr;
+
+/* Memory is kept in pages, allocated on first write */
+#define MEM_PAGE_BITS 12
+#define MEM_PAGE_SIZE (1 << MEM_PAGE_BITS)
+#define MEM_PAGE_MASK (MEM_PAGE_SIZE-1)
+
+/* Pages are found through a radix table indexed this many bits at a time */
+#define RADIX_BITS 9
+#define RADIX_SIZE (1 << RADIX_BITS)
+
+/* Pages and table nodes are shared between a memory and its copies,
+   and are duplicated when a memory writes to one that is shared */
+typedef struct {
+  byte_t data[MEM_PAGE_SIZE];  /* Kept first: run_state_jit() relies on it */
+  /* Predecode table for PCs within the page, allocated on first fetch */
+  decode_ptr decode;
+  int refs;         /* Number of table nodes pointing here */
+  /* Bit i set when line i has been written since the page was created.
+     Other lines still hold the contents of page base_id (0 for zeros),
+     which lets diff_mem() skip them. */
+  uword_t dirty;
+  uword_t id;
+  uword_t base_id;
+} page_rec, *page_ptr;
+
+/* Writes are tracked in lines of 64 bytes, one bit per line */
+#define MEM_LINE_BITS 6
+#define MEM_LINE_SIZE (1 << MEM_LINE_BITS)
+
+typedef struct {
+  int refs;
+  void *slot[RADIX_SIZE];  /* Child nodes, or pages at the bottom level */
+} radix_rec, *radix_ptr;
+
+/* Source of page ids, shared by a memory and its copies so that
+   diff_mem() can tell which of their pages are related */
+typedef struct {
+  int refs;
+  uword_t last;     /* Last id handed out */
+} serial_rec, *serial_ptr;
+
+/* Represent a memory as a sparse array of bytes.  A memory holds no
+   state outside of itself and its copies, so memories can be used from
+   different threads as long as a memory and all its copies stay with
+   one thread. */
+typedef struct mem_rec {
+  word_t len;       /* Size in bytes, or MEM_FULL */
+  uword_t maxaddr;  /* Highest valid address */
+  radix_ptr root;   /* Radix table, NULL until the first page is allocated */
+  int levels;       /* Number of table levels above the pages */
+  serial_ptr serial;
+  /* Last page read and last page written, with their page numbers.
+     The written page is always private to this memory. */
+  uword_t last_tag;
+  page_ptr last_page;
+  uword_t write_tag;
+  page_ptr write_page;
+  /* Last page instructions were decoded from */
+  uword_t code_tag;
+  page_ptr code_page;
+  /* Bytes [decode_lo, decode_hi) are covered by decoded instructions */
+  word_t decode_lo;
+  word_t decode_hi;
+  /* Result returned for PCs outside of memory */
+  decode_rec decode_bad;
+  /* Number of stores that overwrote predecoded instructions */
+  word_t code_writes;
+  /* Translated basic blocks, used by run_state_block() */
+  struct block_cache *blocks;
+  /* Host code from run_state_jit(), released along with the decode table */
+  struct jit_cache *jit;
+  void (*jit_release)(struct mem_rec *m);
 } mem_rec, *mem_t;
 
-/* Create a memory with len bytes */
-mem_t init_mem(int len);
+/* Memory size spanning the whole 64-bit address space */
+#define MEM_FULL 0
+
+/* Create a memory with len bytes.  Pages are only allocated when written,
+   and cost of copying and comparing scales with the pages touched. */
+mem_t init_mem(word_t len);
 void free_mem(mem_t m);
 
 /* Set contents of memory to 0 */
 void clear_mem(mem_t m);
 
-/* Make a copy of a memory */
+/* Make a copy of a memory.  This is a snapshot sharing all pages with
+   oldm, so it takes constant time; pages are duplicated as either one
+   writes to them. */
 mem_t copy_mem(mem_t oldm);
-/* Print the differences between two memories */
+/* Print the differences between two memories.  When one is a snapshot
+   of the other, only lines written since the snapshot are compared. */
 bool_t diff_mem(mem_t oldm, mem_t newm, FILE *outfile);
+/* Forget which lines of m have been written.  Later diffs against
+   snapshots taken before this compare m's pages in full. */
+void reset_dirty(mem_t m);
 
 /* How big should the memory be? */
 #ifdef BIG_MEM
@@ -116,9 +241,30 @@ bool_t diff_mem(mem_t oldm, mem_t newm, FILE *outfile);
 
 /*** In the following functions, a return value of 1 means success ***/
 
-/* Load memory from .yo file.  Return number of bytes read */
+/* Load memory from .yo or .ybo file.  Return number of bytes read */
 int load_mem(mem_t m, FILE *infile, int report_error);
 
+/* Same, also setting *entryp (if nonnull) to the initial PC, which is 0
+   for a .yo file */
+int load_object(mem_t m, FILE *infile, word_t *entryp, int report_error);
+
+/* Binary object file (.ybo), mapped rather than parsed when loaded.
+   All fields are little-endian.  The header holds the magic number, the
+   entry point (8 bytes), the number of sections and the number of
+   symbols (4 bytes each).  The section table follows, then the symbol
+   table.  Strings and section data come after, at any file offset. */
+#define YBO_MAGIC "\177YBO\001\0\0\0"
+#define YBO_HEADER 24
+
+/* Section: load address, size and file offset (8 bytes each), kind (4),
+   reserved (4).  A YBO_FILE section takes its bytes from the start of
+   the file whose name is the string at the offset. */
+#define YBO_SECTION 32
+typedef enum { YBO_DATA, YBO_FILE } ybo_kind_t;
+
+/* Symbol: value, file offset of the name string (8 bytes each) */
+#define YBO_SYMBOL 16
+
 /* Get byte from memory */
 bool_t get_byte_val(mem_t m, word_t pos, byte_t *dest);
 
@@ -131,25 +277,58 @@ bool_t set_byte_val(mem_t m, word_t pos, byte_t val);
 /* Set 8 bytes in memory */
 bool_t set_word_val(mem_t m, word_t pos, word_t val);
 
+/* Copy cnt bytes between memory starting at pos and a buffer, or set
+   them all to val.  Fail, changing nothing, unless all are in memory. */
+bool_t read_block(mem_t m, word_t pos, void *dest, word_t cnt);
+bool_t write_block(mem_t m, word_t pos, const void *src, word_t cnt);
+bool_t fill_block(mem_t m, word_t pos, byte_t val, word_t cnt);
+
 /* Print contents of memory */
 void dump_memory(FILE *outfile, mem_t m, word_t pos, int cnt);
 
+/* Page holding pos, allocated or unshared if need be, so that it can be
+   written directly.  The whole page counts as written.  NULL if pos is
+   not in memory. */
+page_ptr get_page(mem_t m, word_t pos);
+
+/* Decode instruction at pc, using the predecode table when possible.
+   Never returns NULL: a PC outside of memory yields an entry with ok0 clear.
+   The entry stays valid until the next store into its bytes. */
+decode_ptr decode_instr(mem_t m, word_t pc);
+
+/* Discard all predecoded instructions and translated blocks */
+void flush_decode(mem_t m);
+
 /********** Implementation of Register File *************/
 
-mem_t init_reg();
-void free_reg();
+/* The program registers, indexed by ID.  Slot REG_NONE always reads as
+   zero: writes to it land there and are cleared straight away, so that
+   accesses need no test on the ID. */
+typedef struct {
+  word_t val[REG_NONE+1];
+} reg_rec, *reg_t;
+
+reg_t init_reg();
+void free_reg(reg_t r);
+void clear_reg(reg_t r);
 
 /* Make a copy of a register file */
-mem_t copy_reg(mem_t oldr);
+reg_t copy_reg(reg_t oldr);
 /* Print the differences between two register files */
-bool_t diff_reg(mem_t oldr, mem_t newr, FILE *outfile);
-
+bool_t diff_reg(reg_t oldr, reg_t newr, FILE *outfile);
 
-word_t get_reg_val(mem_t r, reg_id_t id);
-void set_reg_val(mem_t r, reg_id_t id, word_t val);
-void dump_reg(FILE *outfile, mem_t r);
+static inline word_t get_reg_val(reg_t r, reg_id_t id)
+{
+    return r->val[id & REG_NONE];
+}
 
+static inline void set_reg_val(reg_t r, reg_id_t id, word_t val)
+{
+    r->val[id & REG_NONE] = val;
+    r->val[REG_NONE] = 0;
+}
 
+void dump_reg(FILE *outfile, reg_t r);
 
 /* ****************  ALU Function **********************/
 
@@ -180,16 +359,61 @@ typedef enum
 /* Describe Status */
 char *stat_name(stat_t e);
 
+/* Why execution stopped */
+typedef enum
+ {STOP_NONE, STOP_HALT, STOP_BUDGET, STOP_DEADLINE,
+  STOP_IMEM, STOP_DMEM, STOP_STACK, STOP_REG, STOP_INSTR} stop_t;
+
+/* Describe stop reason */
+char *stop_name(stop_t why);
+
+typedef struct {
+  stop_t why;
+  word_t pc;    /* Instruction that stopped */
+  word_t addr;  /* Bad data or stack address */
+  int val;      /* Bad register ID or instruction byte */
+} stop_rec, *stop_ptr;
+
+/* Print the diagnostic for a stop, nothing unless it was an error */
+void print_stop(FILE *outfile, stop_ptr sp);
+
 /* **************** ISA level implementation *********/
 
+/* Condition codes are computed lazily: step_state() records the last
+   ALU operation and its arguments, and get_cc() turns them into flags
+   when something asks.  cc_op is CC_LIVE when cc is up to date. */
+#define CC_LIVE (-1)
+
 typedef struct {
   word_t pc;
-  mem_t r;
+  reg_t r;
   mem_t m;
   cc_t cc;
+  int cc_op;              /* Operation of the pending flags, or CC_LIVE */
+  word_t cc_a, cc_b;      /* Its arguments */
+  struct delta_rec *log;  /* Where step_state() records changes, or NULL */
+  struct prof_rec *prof;  /* Where step_state() counts instructions, or NULL */
+  struct trace_rec *trace; /* Where step_state() traces memory, or NULL */
+  stop_rec stop;          /* Why the last instruction failed or halted */
 } state_rec, *state_ptr;
 
-state_ptr new_state(int memlen);
+/* Current condition codes of the state */
+static inline cc_t get_cc(state_ptr s)
+{
+    if (s->cc_op != CC_LIVE) {
+	s->cc = compute_cc((alu_t) s->cc_op, s->cc_a, s->cc_b);
+	s->cc_op = CC_LIVE;
+    }
+    return s->cc;
+}
+
+static inline void set_cc(state_ptr s, cc_t cc)
+{
+    s->cc = cc;
+    s->cc_op = CC_LIVE;
+}
+
+state_ptr new_state(word_t memlen);
 void free_state(state_ptr s);
 
 state_ptr copy_state(state_ptr s);
@@ -198,6 +422,225 @@ bool_t diff_state(state_ptr olds, state_ptr news, FILE *outfile);
 /* Determine if condition satisified */
 bool_t cond_holds(cc_t cc, cond_t bcond);
 
-/* Execute single instruction.  Return status. */
+/* Execute single instruction.  Return status.
+   If s->log is set, the step's writes and outcome are appended to it. */
 stat_t step_state(state_ptr s, FILE *error_file);
 
+/* Execute up to max_steps instructions with the threaded-code engine.
+   Equivalent to calling step_state() until it returns a status other
+   than STAT_AOK, including the diagnostics printed to error_file.
+   If stepsp nonnull, it is set to the number of instructions attempted. */
+stat_t run_state_threaded(state_ptr s, word_t max_steps, word_t *stepsp,
+			  FILE *error_file);
+
+/* Same contract as run_state_threaded(), but translates straight-line
+   code ending in jXX/call/ret/halt into micro-op blocks and executes a
+   whole block per dispatch.  Blocks are kept with the memory and are
+   dropped when a store overwrites their code. */
+stat_t run_state_block(state_ptr s, word_t max_steps, word_t *stepsp,
+		       FILE *error_file);
+
+/* Same contract again, executing hot blocks as x86-64 code generated on
+   the fly (jit.c).  Faults, the rare ALU forms and stores into code fall
+   back to step_state().  On other hosts this is run_state_block(). */
+stat_t run_state_jit(state_ptr s, word_t max_steps, word_t *stepsp,
+		     FILE *error_file);
+
+/* Outcome of run_state() */
+typedef struct {
+  double deadline;  /* Set by caller: seconds of wall-clock time, 0 for none */
+  stat_t status;
+  word_t steps;     /* Instructions attempted */
+  stop_rec stop;
+} run_stats;
+
+/* Execute up to max_steps instructions with the fastest portable engine,
+   printing nothing.  Stops early at an error, halt, or the deadline in
+   rs.  If rs nonnull, the outcome is stored there; hand rs->stop to
+   print_stop() for the diagnostic step_state() would have printed.
+   A state being logged, profiled or traced is run by step_state(). */
+stat_t run_state(state_ptr s, word_t max_steps, run_stats *rs);
+
+/* **************** Delta log *******************/
+
+/* Binary record of a run, one event per register or memory write and
+   one per completed step.  The log starts with DELTA_MAGIC, the memory
+   length, the initial PC, and the initial memory contents as D_MEM
+   events ended by D_START.  Words are little-endian. */
+#define DELTA_MAGIC "Y86DLOG1"
+
+typedef enum {
+  D_REG   = 0x00,  /* Plus register ID; followed by the value */
+  D_MEM   = 0x10,  /* Address and value of a word stored */
+  D_STEP  = 0x20,  /* PC, status byte, CC byte at the end of a step */
+  D_TEXT  = 0x30,  /* 4-byte length and text the preceding step printed */
+  D_START = 0x40   /* End of the initial memory image */
+} delta_t;
+
+/* Events are gathered in a large buffer, written out when it fills */
+#define DELTA_BUF (1<<20)
+
+typedef struct delta_rec {
+  FILE *out;
+  int len;
+  byte_t buf[DELTA_BUF];
+} delta_rec, *delta_ptr;
+
+/* Start a log on out, recording the PC and memory of s.  A log with
+   a NULL out records nothing up front and is emptied by take_writes(),
+   for checking a model one instruction at a time. */
+delta_ptr open_delta(FILE *out, state_ptr s);
+/* Flush and free the log.  Does not close its file. */
+void close_delta(delta_ptr d);
+
+void delta_reg(delta_ptr d, reg_id_t id, word_t val);
+void delta_mem(delta_ptr d, word_t pos, word_t val);
+void delta_step(delta_ptr d, word_t pc, stat_t e, cc_t cc);
+void delta_text(delta_ptr d, char *text, int len);
+
+/* Net writes of one instruction.  A register written twice keeps the
+   last value. */
+#define MAX_WRITES 4
+
+typedef struct {
+  int nreg;
+  reg_id_t reg[MAX_WRITES];
+  word_t reg_val[MAX_WRITES];
+  int nmem;
+  word_t mem_pos[MAX_WRITES];
+  word_t mem_val[MAX_WRITES];
+} writes_rec, *writes_ptr;
+
+void clear_writes(writes_ptr w);
+/* Ignores REG_NONE */
+void add_reg_write(writes_ptr w, reg_id_t id, word_t val);
+void add_mem_write(writes_ptr w, word_t pos, word_t val);
+
+/* Move the writes in a log opened on a NULL file into w */
+void take_writes(delta_ptr d, writes_ptr w);
+
+/* Compare the writes, printing any difference as old and new columns.
+   Return TRUE if they differ. */
+bool_t diff_writes(writes_ptr oldw, writes_ptr neww, FILE *outfile);
+
+/* **************** Profiling *******************/
+
+/* Where a program spends its time.  Counts are kept in flat arrays
+   indexed by PC, for PCs below len; higher PCs are lumped together.
+   Calls and returns build a calling context tree, for flame graphs. */
+typedef struct prof_node {
+  word_t entry;           /* First PC of the function */
+  uword_t count;          /* Instructions and cycles spent in this */
+  uword_t cycles;         /*   context, not counting callees */
+  struct prof_node *parent, *child, *next;
+} prof_node_rec, *prof_node_ptr;
+
+typedef struct {
+  word_t addr;
+  char *name;
+} label_rec;
+
+typedef struct prof_rec {
+  word_t len;
+  uword_t *count;         /* Executions of the instruction at each PC */
+  uword_t *cycles;        /* Cycles charged to each PC, NULL if untimed */
+  uword_t other_count, other_cycles;  /* Same, for PCs at or above len */
+  uword_t ops[16][16];    /* Executions by icode and ifun */
+  prof_node_ptr root, cur;
+  bool_t in_call;         /* Next instruction starts a function */
+  label_rec *labels;      /* Sorted by address */
+  int nlabels;
+} prof_rec, *prof_ptr;
+
+/* Profile PCs below len.  A timed profile also attributes cycles. */
+prof_ptr new_prof(word_t len, bool_t timed);
+void free_prof(prof_ptr p);
+
+/* Name code by the labels in a .yo listing, or the symbols of a .ybo
+   file.  Return the number of labels found. */
+int load_labels(prof_ptr p, FILE *infile);
+
+/* Count one instruction, which took cycles cycles */
+void prof_instr(prof_ptr p, word_t pc, int icode, int ifun, word_t cycles);
+
+/* Print the instruction mix, time per label, and the top hottest PCs */
+void print_prof(FILE *outfile, prof_ptr p, int top);
+
+/* Print the calling context tree as folded stacks ("main;f;g count"),
+   weighted by cycles if timed */
+void print_folded(FILE *outfile, prof_ptr p);
+
+/* **************** Memory trace *******************/
+
+/* Memory accesses in the text format of Valgrind's Lackey tool, which
+   csim replays: "I  addr,len" for an instruction fetch, " L addr,len"
+   for a load and " S addr,len" for a store.  Lines are formatted into
+   a large buffer, written out when it fills. */
+#define TRACE_BUF (1<<16)
+
+typedef struct trace_rec {
+  FILE *out;
+  bool_t fetches;         /* Also trace instruction fetches */
+  int len;
+  char buf[TRACE_BUF];
+} trace_rec, *trace_ptr;
+
+trace_ptr open_trace(FILE *out, bool_t fetches);
+/* Flush and free the trace.  Does not close its file. */
+void close_trace(trace_ptr t);
+
+/* Record an access of kind 'I', 'L' or 'S' */
+void trace_access(trace_ptr t, char kind, word_t addr, int len);
+
+/* **************** Event log *******************/
+
+/* A simulator describes what it reports with events: a printf format
+   and one letter per argument giving its kind.  Logging an event saves
+   the raw arguments in a buffer; names are looked up and the text is
+   formatted only when the buffer is flushed.  Argument kinds are
+     'w'  word_t, for %llx or %lld     'd'  int, for %d
+     'c'  int, for %c                  'S'  string constant
+     'i'  instruction byte, printed by iname()
+     'r'  register ID, printed by reg_name()
+     'C'  condition codes, printed by cc_name()
+     's'  status, printed by stat_name() */
+typedef struct {
+  const char *format;
+  const char *kinds;
+} log_event_rec;
+
+#define LOG_MAX_ARGS 9
+#define LOG_BUF 4096
+
+typedef struct {
+  const log_event_rec *event;
+  word_t arg[LOG_MAX_ARGS];
+} log_rec;
+
+typedef struct log_buf_rec {
+  FILE *out;
+  int level;              /* Events above this level are dropped */
+  int len;
+  log_rec buf[LOG_BUF];
+} log_buf_rec, *log_ptr;
+
+/* Events above LOG_LEVEL_MAX are compiled out */
+#ifndef LOG_LEVEL_MAX
+#define LOG_LEVEL_MAX 3
+#endif
+
+/* Log an event of level lvl to l, which may be NULL.  The arguments
+   are not evaluated unless the event is kept. */
+#define LOG_EVENT(l, lvl, ...)						\
+  do {									\
+    if ((lvl) <= LOG_LEVEL_MAX && (l) && (lvl) <= (l)->level)		\
+      log_event((l), __VA_ARGS__);					\
+  } while (0)
+
+log_ptr open_log(FILE *out, int level);
+/* Flush and free the log.  Does not close its file. */
+void close_log(log_ptr l);
+/* Format the events logged so far.  Call before writing anything else
+   to the log's file. */
+void flush_log(log_ptr l);
+void log_event(log_ptr l, const log_event_rec *ev, ...);
@@ -0,0 +1,662 @@
+/* Dynamic translation of Y86-64 code into x86-64 machine code */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "isa.h"
+
+#if defined(__x86_64__) && defined(__linux__)
+
+#include <sys/mman.h>
+
+/* Translation parameters */
+#define JIT_CODE_SIZE (4 << 20)   /* Bytes of host code buffer */
+#define JIT_BLOCK_SLACK (32 << 10) /* Room needed to translate one block */
+#define JIT_MAX_INSTR 64          /* Instructions per block */
+#define JIT_HOT 2                 /* Executions before a block is translated */
+#define JIT_HASH 1024
+#define JIT_HASH_IDX(pc) ((int) ((pc) & (JIT_HASH-1)))
+
+/* Ways a translated block returns to the dispatcher */
+typedef enum { X_NEXT, X_HALT, X_FAULT, X_CODE } jit_exit_t;
+
+/* State shared between the dispatcher and translated code */
+typedef struct {
+    word_t *reg;       /* Register file contents */
+    word_t limit;      /* Highest valid address of a word access */
+    mem_t m;
+    word_t tmp;        /* Result of get_word_val() */
+    word_t pc;         /* Where to continue */
+    word_t code_writes;/* m->code_writes when the code was translated */
+    int icount;        /* Instructions completed by the block */
+    cc_t cc;
+} jit_ctx;
+
+typedef int (*jit_fn)(jit_ctx *ctx);
+
+typedef struct jit_block {
+    word_t start;
+    int ninstr;
+    int hits;
+    bool_t nocode;           /* First instruction must go through step_state */
+    jit_fn code;
+    struct jit_block *hash_next;
+    struct jit_block *all_next;
+    struct jit_block *next;  /* Last successor, checked before hashing */
+} jit_block, *jit_block_ptr;
+
+struct jit_cache {
+    byte_t *buf;
+    byte_t *cp;              /* Next free byte of buf */
+    jit_block_ptr bucket[JIT_HASH];
+    jit_block_ptr all;
+    word_t code_writes;
+};
+
+/* Host registers */
+#define RAX 0
+#define RCX 1
+#define RDX 2
+#define RBX 3  /* Y86 register file */
+#define RSP 4
+#define RBP 5  /* jit_ctx */
+#define RSI 6
+#define RDI 7
+
+/* Host condition codes for jcc */
+#define HC_C   0x2
+#define HC_NC  0x3
+#define HC_NE  0x5
+#define HC_A   0x7
+#define HC_GE  0xD
+#define HC_LE  0xE
+
+#define CTX(f) ((int) offsetof(jit_ctx, f))
+#define MEM(f) ((int) offsetof(mem_rec, f))
+#define YREG(r) (8 * (int) (r))
+
+/* Forward references within a block, patched once the target is known */
+typedef struct {
+    byte_t *patch;
+    word_t pc;
+    int icount;
+    jit_exit_t kind;
+} jit_stub;
+
+typedef struct {
+    byte_t *cp;
+    jit_stub stubs[4 * JIT_MAX_INSTR];
+    int nstubs;
+} jit_emit;
+
+static void emit1(jit_emit *e, int b)
+{
+    *e->cp++ = (byte_t) b;
+}
+
+static void emit4(jit_emit *e, int v)
+{
+    memcpy(e->cp, &v, 4);
+    e->cp += 4;
+}
+
+static void emit8(jit_emit *e, word_t v)
+{
+    memcpy(e->cp, &v, 8);
+    e->cp += 8;
+}
+
+/* op r, [base+disp32], 64-bit operand size */
+static void emit_rm(jit_emit *e, int op, int r, int base, int disp)
+{
+    emit1(e, 0x48);
+    emit1(e, op);
+    emit1(e, 0x80 | (r << 3) | base);
+    emit4(e, disp);
+}
+
+#define LOAD(e, r, base, disp)  emit_rm(e, 0x8B, r, base, disp)
+#define STORE(e, base, disp, r) emit_rm(e, 0x89, r, base, disp)
+#define CMP(e, r, base, disp)   emit_rm(e, 0x3B, r, base, disp)
+
+/* op dst, src between registers */
+static void emit_rr(jit_emit *e, int op, int dst, int src)
+{
+    emit1(e, 0x48);
+    emit1(e, op);
+    emit1(e, 0xC0 | (src << 3) | dst);
+}
+
+#define MOVRR(e, d, s) emit_rr(e, 0x89, d, s)
+#define ADDRR(e, d, s) emit_rr(e, 0x01, d, s)
+
+static void emit_movi(jit_emit *e, int r, word_t v)
+{
+    emit1(e, 0x48);
+    emit1(e, 0xB8 + r);
+    emit8(e, v);
+}
+
+/* Conditional forward jump, returns location of rel32 to patch */
+static byte_t *emit_jcc(jit_emit *e, int cc)
+{
+    emit1(e, 0x0F);
+    emit1(e, 0x80 + cc);
+    emit4(e, 0);
+    return e->cp - 4;
+}
+
+static byte_t *emit_jmp(jit_emit *e)
+{
+    emit1(e, 0xE9);
+    emit4(e, 0);
+    return e->cp - 4;
+}
+
+static void patch_here(jit_emit *e, byte_t *patch)
+{
+    int rel = (int) (e->cp - (patch + 4));
+    memcpy(patch, &rel, 4);
+}
+
+/* Leave the block with ctx->icount = icount and return kind.
+   The continuation PC must already be in ctx->pc. */
+static void emit_leave(jit_emit *e, jit_exit_t kind, int icount)
+{
+    /* mov dword [rbp+icount], imm32 */
+    emit1(e, 0xC7);
+    emit1(e, 0x80 | RBP);
+    emit4(e, CTX(icount));
+    emit4(e, icount);
+    emit1(e, 0xB8);           /* mov eax, kind */
+    emit4(e, kind);
+    emit1(e, 0x48); emit1(e, 0x83); emit1(e, 0xC4); emit1(e, 0x08); /* add rsp, 8 */
+    emit1(e, 0x5D);           /* pop rbp */
+    emit1(e, 0x5B);           /* pop rbx */
+    emit1(e, 0xC3);           /* ret */
+}
+
+static void emit_exit(jit_emit *e, jit_exit_t kind, word_t pc, int icount)
+{
+    emit_movi(e, RAX, pc);
+    STORE(e, RBP, CTX(pc), RAX);
+    emit_leave(e, kind, icount);
+}
+
+/* Branch to an exit emitted after the end of the block */
+static void add_stub(jit_emit *e, byte_t *patch, jit_exit_t kind,
+		     word_t pc, int icount)
+{
+    jit_stub *st = &e->stubs[e->nstubs++];
+    st->patch = patch;
+    st->kind = kind;
+    st->pc = pc;
+    st->icount = icount;
+}
+
+/* Fault unless rax is the address of a word within memory.
+   Nothing has been changed yet, so step_state() redoes the instruction. */
+static void emit_check_addr(jit_emit *e, word_t pc, int idx)
+{
+    CMP(e, RAX, RBP, CTX(limit));
+    add_stub(e, emit_jcc(e, HC_A), X_FAULT, pc, idx);
+}
+
+/* With rax = address and rcx = m, branch to the two returned locations
+   unless the word lies within the page cached at m's tag/page fields.
+   Otherwise fall through with rcx = page data and rsi = offset in page. */
+static void emit_page_check(jit_emit *e, int tag, int page, byte_t **slow)
+{
+    MOVRR(e, RSI, RAX);
+    emit1(e, 0x48); emit1(e, 0xC1); emit1(e, 0xEE); emit1(e, MEM_PAGE_BITS); /* shr rsi, bits */
+    CMP(e, RSI, RCX, tag);
+    slow[0] = emit_jcc(e, HC_NE);
+    emit1(e, 0x89); emit1(e, 0xC6);           /* mov esi, eax */
+    emit1(e, 0x81); emit1(e, 0xE6);           /* and esi, mask */
+    emit4(e, MEM_PAGE_MASK);
+    emit1(e, 0x81); emit1(e, 0xFE);           /* cmp esi, size-8 */
+    emit4(e, MEM_PAGE_SIZE - 8);
+    slow[1] = emit_jcc(e, HC_A);
+    LOAD(e, RCX, RCX, page);                  /* page data is at offset 0 */
+}
+
+/* Set the dirty bit of the line holding byte edi of page rcx */
+static void emit_mark_dirty(jit_emit *e)
+{
+    emit1(e, 0xC1); emit1(e, 0xEF); emit1(e, MEM_LINE_BITS); /* shr edi, bits */
+    emit1(e, 0x48); emit1(e, 0x0F); emit1(e, 0xAB);          /* bts dirty, rdi */
+    emit1(e, 0x80 | (RDI << 3) | RCX);
+    emit4(e, (int) offsetof(page_rec, dirty));
+}
+
+/* rdx = M[rax], going through get_word_val() off the last pages read
+   and written */
+static void emit_load_mem(jit_emit *e)
+{
+    byte_t *slow[2], *wslow[2], *done[2];
+    LOAD(e, RCX, RBP, CTX(m));
+    emit_page_check(e, MEM(last_tag), MEM(last_page), slow);
+    emit1(e, 0x48); emit1(e, 0x8B); emit1(e, 0x14); emit1(e, 0x31); /* mov rdx, [rcx+rsi] */
+    done[0] = emit_jmp(e);
+    patch_here(e, slow[0]);
+    emit_page_check(e, MEM(write_tag), MEM(write_page), wslow);
+    emit1(e, 0x48); emit1(e, 0x8B); emit1(e, 0x14); emit1(e, 0x31); /* mov rdx, [rcx+rsi] */
+    done[1] = emit_jmp(e);
+    patch_here(e, slow[1]);
+    patch_here(e, wslow[0]);
+    patch_here(e, wslow[1]);
+    LOAD(e, RDI, RBP, CTX(m));
+    MOVRR(e, RSI, RAX);
+    emit_rm(e, 0x8D, RDX, RBP, CTX(tmp));     /* lea rdx, tmp */
+    emit_movi(e, RAX, (word_t) (size_t) get_word_val);
+    emit1(e, 0xFF); emit1(e, 0xD0);           /* call rax */
+    LOAD(e, RDX, RBP, CTX(tmp));
+    patch_here(e, done[0]);
+    patch_here(e, done[1]);
+}
+
+/* M[rax] = rdx.  Stores that might hit predecoded code, or that miss the
+   last page written, go through set_word_val().  If that invalidated code, the
+   block exits so that the dispatcher can drop stale translations. */
+static void emit_store_mem(jit_emit *e, word_t npc, int icount)
+{
+    byte_t *code[2], *slow[3], *done;
+    LOAD(e, RCX, RBP, CTX(m));
+    CMP(e, RAX, RCX, MEM(decode_hi));
+    code[0] = emit_jcc(e, HC_GE);
+    emit1(e, 0x48); emit1(e, 0x8D); emit1(e, 0x70); emit1(e, 0x08); /* lea rsi, [rax+8] */
+    CMP(e, RSI, RCX, MEM(decode_lo));
+    code[1] = emit_jcc(e, HC_LE);
+    slow[2] = emit_jmp(e);
+    patch_here(e, code[0]);
+    patch_here(e, code[1]);
+    emit_page_check(e, MEM(write_tag), MEM(write_page), slow);
+    emit1(e, 0x48); emit1(e, 0x89); emit1(e, 0x14); emit1(e, 0x31); /* mov [rcx+rsi], rdx */
+    /* Mark the lines of the first and last byte written */
+    emit1(e, 0x89); emit1(e, 0xF7);                   /* mov edi, esi */
+    emit_mark_dirty(e);
+    emit1(e, 0x8D); emit1(e, 0x7E); emit1(e, 0x07);   /* lea edi, [rsi+7] */
+    emit_mark_dirty(e);
+    done = emit_jmp(e);
+    patch_here(e, slow[0]);
+    patch_here(e, slow[1]);
+    patch_here(e, slow[2]);
+    LOAD(e, RDI, RBP, CTX(m));
+    MOVRR(e, RSI, RAX);
+    emit_movi(e, RAX, (word_t) (size_t) set_word_val);
+    emit1(e, 0xFF); emit1(e, 0xD0);           /* call rax */
+    LOAD(e, RCX, RBP, CTX(m));
+    LOAD(e, RAX, RCX, MEM(code_writes));
+    CMP(e, RAX, RBP, CTX(code_writes));
+    add_stub(e, emit_jcc(e, HC_NE), X_CODE, npc, icount);
+    patch_here(e, done);
+}
+
+/* Set carry iff condition ifun holds for ctx->cc */
+static void emit_test_cond(jit_emit *e, int ifun)
+{
+    int mask = 0;
+    int c;
+    for (c = 0; c < 8; c++)
+	if (cond_holds((cc_t) c, (cond_t) ifun))
+	    mask |= 1 << c;
+    emit1(e, 0x0F); emit1(e, 0xB6); emit1(e, 0x80 | (RAX << 3) | RBP); /* movzx eax, byte cc */
+    emit4(e, CTX(cc));
+    emit1(e, 0xB9);                     /* mov ecx, mask */
+    emit4(e, mask);
+    emit1(e, 0x0F); emit1(e, 0xA3); emit1(e, 0xC1); /* bt ecx, eax */
+}
+
+/* ctx->cc from the host flags of the last arithmetic instruction.
+   Host ZF/SF/OF agree with compute_cc() for add, sub, and, xor. */
+static void emit_save_cc(jit_emit *e)
+{
+    emit1(e, 0x0F); emit1(e, 0x94); emit1(e, 0xC0); /* setz al */
+    emit1(e, 0x0F); emit1(e, 0x98); emit1(e, 0xC1); /* sets cl */
+    emit1(e, 0x0F); emit1(e, 0x90); emit1(e, 0xC4); /* seto ah */
+    emit1(e, 0xC0); emit1(e, 0xE0); emit1(e, 0x02); /* shl al, 2 */
+    emit1(e, 0x00); emit1(e, 0xC9);                 /* add cl, cl */
+    emit1(e, 0x08); emit1(e, 0xC8);                 /* or al, cl */
+    emit1(e, 0x08); emit1(e, 0xE0);                 /* or al, ah */
+    emit1(e, 0x88); emit1(e, 0x80 | (RAX << 3) | RBP); /* mov byte cc, al */
+    emit4(e, CTX(cc));
+}
+
+/* Can instruction be translated?  Anything step_state() would report as
+   an error is left to it, as are the rarely used ALU forms. */
+static bool_t can_translate(decode_ptr d)
+{
+    if (!d->ok0)
+	return FALSE;
+    switch (d->icode) {
+    case I_NOP:
+    case I_HALT:
+    case I_RET:
+	return TRUE;
+    case I_RRMOVQ:
+	return d->ok1 && reg_valid(d->ra) && reg_valid(d->rb);
+    case I_IRMOVQ:
+    case I_IADDQ:
+	return d->ok1 && d->okc && reg_valid(d->rb);
+    case I_RMMOVQ:
+    case I_MRMOVQ:
+	return d->ok1 && d->okc && reg_valid(d->ra);
+    case I_ALU:
+	return d->ok1 && reg_valid(d->ra) && reg_valid(d->rb) &&
+	    d->ifun <= A_XOR;
+    case I_JMP:
+    case I_CALL:
+	return d->okc;
+    case I_PUSHQ:
+    case I_POPQ:
+	return d->ok1 && reg_valid(d->ra);
+    default:
+	return FALSE;
+    }
+}
+
+/* rax = valC + R[rb] */
+static void emit_ea(jit_emit *e, decode_ptr d)
+{
+    if (d->rb == REG_NONE)
+	emit_movi(e, RAX, d->valc);
+    else {
+	LOAD(e, RAX, RBX, YREG(d->rb));
+	emit_movi(e, RCX, d->valc);
+	ADDRR(e, RAX, RCX);
+    }
+}
+
+/* Translate one instruction, return TRUE if it ends the block */
+static bool_t translate_instr(jit_emit *e, decode_ptr d, word_t pc, int idx)
+{
+    static const int alu_op[] = { 0x01, 0x29, 0x21, 0x31 };
+    byte_t *p;
+
+    switch (d->icode) {
+    case I_NOP:
+	break;
+    case I_HALT:
+	emit_exit(e, X_HALT, pc, idx+1);
+	return TRUE;
+    case I_RRMOVQ:
+	p = NULL;
+	if (d->ifun != C_YES) {
+	    emit_test_cond(e, d->ifun);
+	    p = emit_jcc(e, HC_NC);
+	}
+	LOAD(e, RAX, RBX, YREG(d->ra));
+	STORE(e, RBX, YREG(d->rb), RAX);
+	if (p)
+	    patch_here(e, p);
+	break;
+    case I_IRMOVQ:
+	emit_movi(e, RAX, d->valc);
+	STORE(e, RBX, YREG(d->rb), RAX);
+	break;
+    case I_RMMOVQ:
+	emit_ea(e, d);
+	emit_check_addr(e, pc, idx);
+	LOAD(e, RDX, RBX, YREG(d->ra));
+	emit_store_mem(e, d->valp, idx+1);
+	break;
+    case I_MRMOVQ:
+	emit_ea(e, d);
+	emit_check_addr(e, pc, idx);
+	emit_load_mem(e);
+	STORE(e, RBX, YREG(d->ra), RDX);
+	break;
+    case I_ALU:
+	LOAD(e, RAX, RBX, YREG(d->ra));
+	LOAD(e, RDX, RBX, YREG(d->rb));
+	emit_rr(e, alu_op[d->ifun], RDX, RAX);
+	STORE(e, RBX, YREG(d->rb), RDX);
+	emit_save_cc(e);
+	break;
+    case I_IADDQ:
+	LOAD(e, RDX, RBX, YREG(d->rb));
+	emit_movi(e, RAX, d->valc);
+	ADDRR(e, RDX, RAX);
+	STORE(e, RBX, YREG(d->rb), RDX);
+	emit_save_cc(e);
+	break;
+    case I_JMP:
+	if (d->ifun != C_YES) {
+	    emit_test_cond(e, d->ifun);
+	    add_stub(e, emit_jcc(e, HC_C), X_NEXT, d->valc, idx+1);
+	    emit_exit(e, X_NEXT, d->valp, idx+1);
+	} else
+	    emit_exit(e, X_NEXT, d->valc, idx+1);
+	return TRUE;
+    case I_CALL:
+	LOAD(e, RAX, RBX, YREG(REG_RSP));
+	emit1(e, 0x48); emit1(e, 0x83); emit1(e, 0xE8); emit1(e, 0x08); /* sub rax, 8 */
+	emit_check_addr(e, pc, idx);
+	STORE(e, RBX, YREG(REG_RSP), RAX);
+	emit_movi(e, RDX, d->valp);
+	emit_store_mem(e, d->valc, idx+1);
+	emit_exit(e, X_NEXT, d->valc, idx+1);
+	return TRUE;
+    case I_RET:
+	LOAD(e, RAX, RBX, YREG(REG_RSP));
+	emit_check_addr(e, pc, idx);
+	emit_load_mem(e);
+	LOAD(e, RAX, RBX, YREG(REG_RSP));
+	emit1(e, 0x48); emit1(e, 0x83); emit1(e, 0xC0); emit1(e, 0x08); /* add rax, 8 */
+	STORE(e, RBX, YREG(REG_RSP), RAX);
+	STORE(e, RBP, CTX(pc), RDX);
+	emit_leave(e, X_NEXT, idx+1);
+	return TRUE;
+    case I_PUSHQ:
+	LOAD(e, RDX, RBX, YREG(d->ra));
+	LOAD(e, RAX, RBX, YREG(REG_RSP));
+	emit1(e, 0x48); emit1(e, 0x83); emit1(e, 0xE8); emit1(e, 0x08); /* sub rax, 8 */
+	emit_check_addr(e, pc, idx);
+	STORE(e, RBX, YREG(REG_RSP), RAX);
+	emit_store_mem(e, d->valp, idx+1);
+	break;
+    case I_POPQ:
+	LOAD(e, RAX, RBX, YREG(REG_RSP));
+	emit_check_addr(e, pc, idx);
+	emit_load_mem(e);
+	LOAD(e, RAX, RBX, YREG(REG_RSP));
+	emit1(e, 0x48); emit1(e, 0x83); emit1(e, 0xC0); emit1(e, 0x08); /* add rax, 8 */
+	STORE(e, RBX, YREG(REG_RSP), RAX);
+	STORE(e, RBX, YREG(d->ra), RDX);
+	break;
+    }
+    return FALSE;
+}
+
+static void jit_release(mem_t m);
+
+/* Drop all translations */
+static void jit_reset(struct jit_cache *jc)
+{
+    jit_block_ptr b, next;
+    for (b = jc->all; b; b = next) {
+	next = b->all_next;
+	free((void *) b);
+    }
+    jc->all = NULL;
+    memset(jc->bucket, 0, sizeof(jc->bucket));
+    jc->cp = jc->buf;
+}
+
+static struct jit_cache *jit_cache(mem_t m)
+{
+    struct jit_cache *jc = m->jit;
+    if (!jc) {
+	void *buf = mmap(NULL, JIT_CODE_SIZE, PROT_READ|PROT_WRITE|PROT_EXEC,
+			 MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (buf == MAP_FAILED)
+	    return NULL;
+	jc = (struct jit_cache *) calloc(1, sizeof(struct jit_cache));
+	jc->buf = jc->cp = (byte_t *) buf;
+	jc->code_writes = m->code_writes;
+	m->jit = jc;
+	m->jit_release = jit_release;
+    }
+    return jc;
+}
+
+static void jit_release(mem_t m)
+{
+    struct jit_cache *jc = m->jit;
+    jit_reset(jc);
+    munmap((void *) jc->buf, JIT_CODE_SIZE);
+    free((void *) jc);
+    m->jit = NULL;
+    m->jit_release = NULL;
+}
+
+/* Translate the block starting at b->start */
+static void jit_translate(struct jit_cache *jc, mem_t m, jit_block_ptr b)
+{
+    jit_emit e;
+    word_t pc = b->start;
+    bool_t ended = FALSE;
+    int n = 0;
+    int i;
+    decode_ptr d = decode_instr(m, pc);
+
+    if (!can_translate(d)) {
+	b->nocode = TRUE;
+	return;
+    }
+    if (jc->cp + JIT_BLOCK_SLACK > jc->buf + JIT_CODE_SIZE) {
+	/* Out of room.  Start over, keeping only this block */
+	jit_block_ptr keep = b;
+	jit_block_ptr *pp = &jc->all;
+	while (*pp != keep)
+	    pp = &(*pp)->all_next;
+	*pp = keep->all_next;
+	jit_reset(jc);
+	b->hash_next = NULL;
+	b->all_next = NULL;
+	b->next = NULL;
+	jc->all = b;
+	jc->bucket[JIT_HASH_IDX(b->start)] = b;
+    }
+    e.cp = jc->cp;
+    e.nstubs = 0;
+    /* push rbx; push rbp; sub rsp, 8; mov rbp, rdi; mov rbx, [rbp+reg] */
+    emit1(&e, 0x53);
+    emit1(&e, 0x55);
+    emit1(&e, 0x48); emit1(&e, 0x83); emit1(&e, 0xEC); emit1(&e, 0x08);
+    MOVRR(&e, RBP, RDI);
+    LOAD(&e, RBX, RBP, CTX(reg));
+    while (!ended && n < JIT_MAX_INSTR) {
+	d = decode_instr(m, pc);
+	if (!can_translate(d))
+	    break;
+	ended = translate_instr(&e, d, pc, n);
+	pc = d->valp;
+	n++;
+    }
+    if (!ended)
+	emit_exit(&e, X_NEXT, pc, n);
+    for (i = 0; i < e.nstubs; i++) {
+	jit_stub *st = &e.stubs[i];
+	patch_here(&e, st->patch);
+	emit_exit(&e, st->kind, st->pc, st->icount);
+    }
+    b->ninstr = n;
+    b->code = (jit_fn) (void *) jc->cp;
+    jc->cp = e.cp;
+}
+
+static jit_block_ptr jit_lookup(struct jit_cache *jc, word_t pc)
+{
+    int h = JIT_HASH_IDX(pc);
+    jit_block_ptr b;
+    for (b = jc->bucket[h]; b; b = b->hash_next)
+	if (b->start == pc)
+	    return b;
+    b = (jit_block_ptr) calloc(1, sizeof(jit_block));
+    b->start = pc;
+    b->hash_next = jc->bucket[h];
+    jc->bucket[h] = b;
+    b->all_next = jc->all;
+    jc->all = b;
+    return b;
+}
+
+stat_t run_state_jit(state_ptr s, word_t max_steps, word_t *stepsp,
+		     FILE *error_file)
+{
+    mem_t m = s->m;
+    struct jit_cache *jc = jit_cache(m);
+    jit_block_ptr b, prev = NULL;
+    jit_ctx ctx;
+    word_t steps = 0;
+    stat_t e = STAT_AOK;
+
+    if (!jc)
+	return run_state_block(s, max_steps, stepsp, error_file);
+    ctx.reg = s->r->val;
+    ctx.limit = m->maxaddr - 7;
+    ctx.m = m;
+    ctx.pc = s->pc;
+    ctx.cc = get_cc(s);
+
+    while (steps < max_steps && e == STAT_AOK) {
+	if (jc->code_writes != m->code_writes) {
+	    /* Stored into translated code */
+	    jit_reset(jc);
+	    jc->code_writes = m->code_writes;
+	    prev = NULL;
+	}
+	if (prev && prev->next && prev->next->start == ctx.pc)
+	    b = prev->next;
+	else {
+	    b = jit_lookup(jc, ctx.pc);
+	    if (prev)
+		prev->next = b;
+	}
+	prev = b;
+	if (!b->code && !b->nocode && ++b->hits >= JIT_HOT)
+	    jit_translate(jc, m, b);
+	if (b->code && steps + b->ninstr <= max_steps) {
+	    ctx.code_writes = m->code_writes;
+	    switch (b->code(&ctx)) {
+	    case X_NEXT:
+	    case X_CODE:
+		steps += ctx.icount;
+		continue;
+	    case X_HALT:
+		steps += ctx.icount;
+		e = STAT_HLT;
+		continue;
+	    case X_FAULT:
+		/* Let step_state() produce the error */
+		steps += ctx.icount;
+		break;
+	    }
+	}
+	/* Cold, untranslatable, faulting, or too close to the limit */
+	s->pc = ctx.pc;
+	set_cc(s, ctx.cc);
+	e = step_state(s, error_file);
+	steps++;
+	ctx.pc = s->pc;
+	ctx.cc = get_cc(s);
+    }
+    s->pc = ctx.pc;
+    set_cc(s, ctx.cc);
+    if (stepsp)
+	*stepsp = steps;
+    return e;
+}
+
+#else /* !x86-64 Linux */
+
+stat_t run_state_jit(state_ptr s, word_t max_steps, word_t *stepsp,
+		     FILE *error_file)
+{
+    return run_state_block(s, max_steps, stepsp, error_file);
+}
+
+#endif
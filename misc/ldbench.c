@@ -0,0 +1,76 @@
+/* Benchmark load_mem() on a generated .yo image */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "isa.h"
+
+void usage(char *pname)
+{
+    printf("Usage: %s [megabytes] [repeats]\n", pname);
+    printf("   Load a generated .yo listing holding about megabytes of\n");
+    printf("   text (default 32), repeats times (default 5)\n");
+    exit(0);
+}
+
+/* Write a listing in the form yas produces: instructions of assorted
+   lengths followed by .quad data, with .pos gaps between blocks */
+static word_t make_image(FILE *f, long size)
+{
+    word_t addr = 0;
+    unsigned seed = 1;
+    int lens[] = {1, 2, 10, 10, 2, 9, 1, 8};
+    int i, k = 0;
+    while (ftell(f) < size) {
+	int len = lens[k++ % 8];
+	fprintf(f, "0x%.3llx: ", addr);
+	for (i = 0; i < len; i++) {
+	    seed = seed * 1103515245 + 12345;
+	    fprintf(f, "%.2x", (seed >> 16) & 0xFF);
+	}
+	fprintf(f, "%*s| %s\n", 2 * (10 - len) + 1, "",
+		len == 8 ? ".quad" : "instr");
+	addr += len;
+	if (k % 4096 == 0) {
+	    fprintf(f, "                            | .pos 0x%llx\n",
+		    addr + 256);
+	    addr += 256;
+	}
+    }
+    return addr;
+}
+
+int main(int argc, char *argv[])
+{
+    long mbytes = argc > 1 ? atol(argv[1]) : 32;
+    int repeats = argc > 2 ? atoi(argv[2]) : 5;
+    FILE *f = tmpfile();
+    word_t span;
+    long size;
+    double best = 0.0;
+    int r, cnt = 0;
+
+    if (argc > 3 || mbytes <= 0 || repeats <= 0 || !f)
+	usage(argv[0]);
+    span = make_image(f, mbytes << 20);
+    size = ftell(f);
+    for (r = 0; r < repeats; r++) {
+	mem_t m = init_mem(MEM_FULL);
+	clock_t start;
+	double secs;
+	rewind(f);
+	start = clock();
+	cnt = load_mem(m, f, 1);
+	secs = (double) (clock() - start) / CLOCKS_PER_SEC;
+	if (r == 0 || secs < best)
+	    best = secs;
+	free_mem(m);
+    }
+    printf("%ld bytes of text, %d bytes of code over 0x%llx addresses\n",
+	   size, cnt, span);
+    printf("Best of %d loads: %.3f s, %.1f MB/s of text\n",
+	   repeats, best, best > 0 ? size / best / (1 << 20) : 0.0);
+    fclose(f);
+    return 0;
+}
@@ -0,0 +1,91 @@
+/* Microbenchmarks for the memory accessors in isa.c */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "isa.h"
+
+/* Addresses cycle through this many bytes, within two pages */
+#define SPAN 8000
+
+static double now()
+{
+    return (double) clock() / CLOCKS_PER_SEC;
+}
+
+static void report(char *what, double secs, long count)
+{
+    printf("%-32s %7.2f ns\n", what, secs * 1e9 / count);
+}
+
+int main(int argc, char *argv[])
+{
+    long n = argc > 1 ? atol(argv[1]) : 50000000;
+    mem_t m = init_mem(MEM_FULL);
+    byte_t block[4096];
+    word_t sum = 0, val;
+    word_t pos;
+    double start;
+    long i;
+
+    for (pos = 0; pos < SPAN; pos += 8)
+	set_word_val(m, pos, (word_t) ((uword_t) pos * 0x0101010101010101ULL));
+
+    start = now();
+    for (i = 0, pos = 0; i < n; i++) {
+	get_word_val(m, pos, &val);
+	sum += val;
+	pos = pos + 8 < SPAN ? pos + 8 : 0;
+    }
+    report("get_word_val, aligned", now() - start, n);
+
+    start = now();
+    for (i = 0, pos = 3; i < n; i++) {
+	get_word_val(m, pos, &val);
+	sum += val;
+	pos = pos + 8 < SPAN ? pos + 8 : 3;
+    }
+    report("get_word_val, unaligned", now() - start, n);
+
+    start = now();
+    for (i = 0, pos = 0; i < n; i++) {
+	set_word_val(m, pos, i);
+	pos = pos + 8 < SPAN ? pos + 8 : 0;
+    }
+    report("set_word_val, aligned", now() - start, n);
+
+    start = now();
+    for (i = 0, pos = 0; i < n / 64; i++) {
+	int k;
+	for (k = 0; k < 4096; k++)
+	    get_byte_val(m, 1024 + k, &block[k]);
+	sum += block[i & 4095];
+    }
+    report("4 KB by get_byte_val", now() - start, n / 64);
+
+#ifndef NO_BLOCK
+    start = now();
+    for (i = 0; i < n / 64; i++) {
+	read_block(m, 1024, block, sizeof(block));
+	sum += block[i & 4095];
+    }
+    report("4 KB by read_block", now() - start, n / 64);
+
+    start = now();
+    for (i = 0; i < n / 64; i++)
+	write_block(m, 1024 + (i & 7), block, sizeof(block));
+    report("4 KB by write_block", now() - start, n / 64);
+
+    start = now();
+    for (i = 0; i < n / 64; i++)
+	fill_block(m, 1024, (byte_t) i, sizeof(block));
+    report("4 KB by fill_block", now() - start, n / 64);
+#endif
+
+    /* Keep the loads from being optimized away */
+    if (sum == 42)
+	printf("%lld\n", sum);
+    free_mem(m);
+    return 0;
+}
@@ -0,0 +1,198 @@
+/* Run Y86-64 programs on many threads at once and check that every
+   run ends in the same state as a serial run of the same program */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "isa.h"
+
+/* Ways of running a program */
+typedef enum { E_STEP, E_RUN, E_THREADED, E_BLOCK, E_JIT, E_NENGINE } engine_t;
+
+static char *engine_names[E_NENGINE] =
+    {"step_state", "run_state", "threaded", "block", "jit"};
+
+/* Outcome of one run, reduced to a hash of the final state */
+typedef struct {
+    stat_t status;
+    word_t steps;
+    uword_t hash;
+} result_rec;
+
+static char **prog_names;
+static int nprog;
+static int rounds = 20;
+static word_t max_steps = 1000000;
+static result_rec *serial;
+
+/* Next job to hand out, and the number of mismatches */
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+static int next_job;
+static int failures;
+
+void usage(char *pname)
+{
+    printf("Usage: %s [-t threads] [-r rounds] [-s max_steps] file.yo...\n",
+	   pname);
+    printf("   -t     Number of threads (default 8)\n");
+    printf("   -r     Runs of each program with each engine (default 20)\n");
+    printf("   -s     Instruction limit per run (default 1000000)\n");
+    exit(0);
+}
+
+static uword_t fnv(uword_t h, const void *p, size_t cnt)
+{
+    const byte_t *b = (const byte_t *) p;
+    size_t i;
+    for (i = 0; i < cnt; i++)
+	h = (h ^ b[i]) * 0x100000001b3ULL;
+    return h;
+}
+
+static uword_t hash_state(state_ptr s)
+{
+    byte_t buf[MEM_PAGE_SIZE];
+    uword_t h = 0xcbf29ce484222325ULL;
+    cc_t cc = get_cc(s);
+    word_t pos;
+    h = fnv(h, &s->pc, sizeof(s->pc));
+    h = fnv(h, &cc, sizeof(cc));
+    h = fnv(h, s->r->val, sizeof(s->r->val));
+    for (pos = 0; (uword_t) pos < s->m->maxaddr; pos += sizeof(buf)) {
+	read_block(s->m, pos, buf, sizeof(buf));
+	h = fnv(h, buf, sizeof(buf));
+    }
+    return h;
+}
+
+/* Load and run program p, FALSE if it cannot be loaded */
+static bool_t run_prog(int p, engine_t engine, result_rec *res)
+{
+    FILE *f = fopen(prog_names[p], "r");
+    state_ptr s, init;
+    word_t steps = 0;
+    stat_t e = STAT_AOK;
+    run_stats rs;
+
+    if (!f)
+	return FALSE;
+    s = new_state(MEM_SIZE);
+    if (!load_object(s->m, f, &s->pc, 0)) {
+	fclose(f);
+	free_state(s);
+	return FALSE;
+    }
+    fclose(f);
+    /* Keep a copy, so that pages are shared while the program runs */
+    init = copy_state(s);
+    switch (engine) {
+    case E_STEP:
+	while (steps < max_steps && e == STAT_AOK) {
+	    e = step_state(s, NULL);
+	    steps++;
+	}
+	break;
+    case E_RUN:
+	rs.deadline = 0;
+	e = run_state(s, max_steps, &rs);
+	steps = rs.steps;
+	break;
+    case E_THREADED:
+	e = run_state_threaded(s, max_steps, &steps, NULL);
+	break;
+    case E_BLOCK:
+	e = run_state_block(s, max_steps, &steps, NULL);
+	break;
+    default:
+	e = run_state_jit(s, max_steps, &steps, NULL);
+	break;
+    }
+    res->status = e;
+    res->steps = steps;
+    res->hash = hash_state(s);
+    /* Comparing against the copy exercises the dirty line tracking */
+    diff_state(init, s, NULL);
+    free_state(init);
+    free_state(s);
+    return TRUE;
+}
+
+static void *worker(void *arg)
+{
+    int njobs = nprog * E_NENGINE * rounds;
+    for (;;) {
+	result_rec res;
+	int job, p;
+	engine_t engine;
+	pthread_mutex_lock(&job_lock);
+	job = next_job++;
+	pthread_mutex_unlock(&job_lock);
+	if (job >= njobs)
+	    break;
+	p = job % nprog;
+	engine = (engine_t) ((job / nprog) % E_NENGINE);
+	if (!run_prog(p, engine, &res) ||
+	    res.status != serial[p].status || res.steps != serial[p].steps ||
+	    res.hash != serial[p].hash) {
+	    pthread_mutex_lock(&job_lock);
+	    failures++;
+	    printf("%s, %s: %lld steps, status '%s' vs. serial %lld steps, "
+		   "status '%s'%s\n", prog_names[p], engine_names[engine],
+		   res.steps, stat_name(res.status), serial[p].steps,
+		   stat_name(serial[p].status),
+		   res.hash != serial[p].hash ? ", state differs" : "");
+	    pthread_mutex_unlock(&job_lock);
+	}
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    int nthreads = 8;
+    pthread_t *threads;
+    int c, i;
+
+    while ((c = getopt(argc, argv, "t:r:s:")) != -1) {
+	switch (c) {
+	case 't':
+	    nthreads = atoi(optarg);
+	    break;
+	case 'r':
+	    rounds = atoi(optarg);
+	    break;
+	case 's':
+	    max_steps = atoll(optarg);
+	    break;
+	default:
+	    usage(argv[0]);
+	}
+    }
+    if (optind >= argc || nthreads <= 0 || rounds <= 0)
+	usage(argv[0]);
+    prog_names = argv + optind;
+    nprog = argc - optind;
+
+    /* Reference results, one program at a time */
+    serial = (result_rec *) calloc(nprog, sizeof(result_rec));
+    for (i = 0; i < nprog; i++)
+	if (!run_prog(i, E_STEP, &serial[i])) {
+	    fprintf(stderr, "Can't load '%s'\n", prog_names[i]);
+	    exit(1);
+	}
+
+    threads = (pthread_t *) calloc(nthreads, sizeof(pthread_t));
+    for (i = 0; i < nthreads; i++)
+	pthread_create(&threads[i], NULL, worker, NULL);
+    for (i = 0; i < nthreads; i++)
+	pthread_join(threads[i], NULL);
+
+    printf("%d runs of %d programs on %d threads: %d mismatches\n",
+	   nprog * E_NENGINE * rounds, nprog, nthreads, failures);
+    free(threads);
+    free(serial);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,464 @@
+/* Run a manifest of Y86-64 simulation jobs on a pool of threads */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <spawn.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#include "isa.h"
+
+extern char **environ;
+
+#define LINELEN 4096
+
+typedef enum { M_YIS, M_SSIM, M_PSIM } sim_t;
+
+static char *mode_names[] = {"yis", "ssim", "psim"};
+
+/* A program, loaded once and shared by all the jobs that run it */
+typedef struct {
+    char *name;
+    byte_t *image;     /* Contents of memory after loading, NULL if none */
+    word_t entry;
+    char *text;        /* The object file, fed to ssim and psim */
+    size_t len;
+    char *error;       /* Why it could not be loaded, or NULL */
+} prog_rec, *prog_ptr;
+
+typedef enum { V_NONE, V_PASS, V_FAIL } verdict_t;
+
+static char *verdict_names[] = {"none", "pass", "fail"};
+
+typedef struct {
+    prog_ptr prog;
+    sim_t mode;
+    word_t max_steps;
+    /* Results */
+    bool_t ok;         /* FALSE if the simulation could not be run */
+    stat_t status;
+    word_t instr;
+    word_t cycles;
+    verdict_t check;
+    char *error;       /* What went to stderr, or NULL */
+    bool_t done;
+} job_rec, *job_ptr;
+
+/* Work queue of one thread.  The owner takes jobs from the tail,
+   threads that run out of work steal from the head. */
+typedef struct {
+    pthread_mutex_t lock;
+    int *jobs;
+    int head, tail;
+} deque_rec;
+
+static job_rec *jobs;
+static int njobs, jobs_cap;
+static prog_ptr *progs;
+static int nprogs, progs_cap;
+static deque_rec *queues;
+static int nthreads;
+
+static char *ssim_path = "../seq/ssim";
+static char *psim_path = "../pipe/psim";
+
+/* Results are printed in manifest order, as soon as all earlier jobs
+   are done */
+static pthread_mutex_t out_lock = PTHREAD_MUTEX_INITIALIZER;
+static int next_out;
+
+/* Held from opening a child's pipes until it is spawned.  The pipes
+   are not close-on-exec when opened, and a child spawned by another
+   thread in between would inherit them and hold them open. */
+static pthread_mutex_t spawn_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void usage(char *pname)
+{
+    printf("Usage: %s [-j threads] [-S ssim] [-P psim] manifest\n", pname);
+    printf("   Each manifest line is 'file.yo mode [max_steps]', with mode\n");
+    printf("   one of yis, ssim or psim.  Prints one result line per job.\n");
+    printf("   -j     Number of worker threads (default: one per CPU)\n");
+    printf("   -S     Path of the SEQ simulator (default %s)\n", ssim_path);
+    printf("   -P     Path of the PIPE simulator (default %s)\n", psim_path);
+    exit(0);
+}
+
+static void *grow(void *p, int *capp, int need, size_t size)
+{
+    if (need <= *capp)
+	return p;
+    while (*capp < need)
+	*capp = *capp ? 2 * *capp : 64;
+    p = realloc(p, *capp * size);
+    if (!p) {
+	fprintf(stderr, "Out of memory\n");
+	exit(1);
+    }
+    return p;
+}
+
+/* Read all of f into a buffer, setting *lenp to its length */
+static char *read_all(FILE *f, size_t *lenp)
+{
+    int cap = 0;
+    size_t len = 0, n;
+    char *buf = NULL;
+    do {
+	buf = grow(buf, &cap, (int) len + LINELEN, 1);
+	n = fread(buf + len, 1, cap - len, f);
+	len += n;
+    } while (n > 0);
+    *lenp = len;
+    return buf;
+}
+
+/* Find program name, loading it on first use */
+static prog_ptr find_prog(char *name)
+{
+    char buf[2 * LINELEN];
+    prog_ptr p;
+    mem_t m;
+    FILE *f;
+    int i;
+    for (i = 0; i < nprogs; i++)
+	if (!strcmp(progs[i]->name, name))
+	    return progs[i];
+    p = (prog_ptr) calloc(1, sizeof(prog_rec));
+    p->name = strdup(name);
+    f = fopen(name, "r");
+    if (f) {
+	p->text = read_all(f, &p->len);
+	rewind(f);
+	m = init_mem(MEM_SIZE);
+	if (load_object(m, f, &p->entry, 0)) {
+	    p->image = (byte_t *) malloc(MEM_SIZE);
+	    read_block(m, 0, p->image, MEM_SIZE);
+	} else {
+	    snprintf(buf, sizeof(buf), "No lines of code found in %s", name);
+	    p->error = strdup(buf);
+	}
+	free_mem(m);
+	fclose(f);
+    } else {
+	snprintf(buf, sizeof(buf), "Couldn't open object file %s", name);
+	p->error = strdup(buf);
+    }
+    progs = grow(progs, &progs_cap, nprogs + 1, sizeof(prog_ptr));
+    progs[nprogs++] = p;
+    return p;
+}
+
+static void read_manifest(FILE *f, char *fname)
+{
+    char buf[LINELEN];
+    int lineno = 0;
+    while (fgets(buf, LINELEN, f)) {
+	char name[LINELEN], mode[LINELEN];
+	long long steps = 10000;
+	job_ptr j;
+	int n, m;
+	lineno++;
+	n = sscanf(buf, "%s %s %lld", name, mode, &steps);
+	if (n <= 0 || name[0] == '#')
+	    continue;
+	for (m = M_YIS; m <= M_PSIM; m++)
+	    if (n >= 2 && !strcmp(mode, mode_names[m]))
+		break;
+	if (m > M_PSIM || steps <= 0) {
+	    fprintf(stderr, "%s:%d: Expected 'file mode [max_steps]'\n",
+		    fname, lineno);
+	    exit(1);
+	}
+	jobs = grow(jobs, &jobs_cap, njobs + 1, sizeof(job_rec));
+	j = &jobs[njobs++];
+	memset(j, 0, sizeof(job_rec));
+	j->prog = find_prog(name);
+	j->mode = (sim_t) m;
+	j->max_steps = steps;
+    }
+}
+
+static state_ptr image_state(prog_ptr p)
+{
+    state_ptr s = new_state(MEM_SIZE);
+    write_block(s->m, 0, p->image, MEM_SIZE);
+    s->pc = p->entry;
+    return s;
+}
+
+/* Run the job on the ISA simulator, checking the fast engine against
+   step_state() */
+static void run_yis(job_ptr j)
+{
+    state_ptr s, ref;
+    run_stats rs;
+    word_t steps = 0;
+    stat_t e = STAT_AOK;
+
+    if (!j->prog->image) {
+	j->error = j->prog->error;
+	return;
+    }
+    s = image_state(j->prog);
+    rs.deadline = 0;
+    run_state(s, j->max_steps, &rs);
+    ref = image_state(j->prog);
+    while (steps < j->max_steps && e == STAT_AOK) {
+	e = step_state(ref, NULL);
+	steps++;
+    }
+    j->ok = TRUE;
+    j->status = rs.status;
+    j->instr = j->cycles = rs.steps;
+    j->check = steps == rs.steps && e == rs.status &&
+	!diff_state(ref, s, NULL) ? V_PASS : V_FAIL;
+    free_state(ref);
+    free_state(s);
+}
+
+/* Keep what a child wrote to stderr as one line, for the job's result */
+static char *read_errors(FILE *err)
+{
+    size_t len, i;
+    char *text;
+    rewind(err);
+    text = read_all(err, &len);
+    while (len > 0 && text[len - 1] == '\n')
+	len--;
+    if (len == 0) {
+	free(text);
+	return NULL;
+    }
+    text[len] = '\0';
+    for (i = 0; i < len; i++)
+	if (text[i] == '\n')
+	    text[i] = ';';
+    return text;
+}
+
+/* Run the job as a child ssim or psim with the ISA check on, and pick
+   the results out of its output.  The child reads the object file from
+   stdin, from the copy loaded with the program. */
+static void run_sim(job_ptr j)
+{
+    char *path = j->mode == M_SSIM ? ssim_path : psim_path;
+    char limit[32];
+    char *argv[] = {path, "-t", "-v", "1", "-l", limit, NULL};
+    char buf[LINELEN];
+    posix_spawn_file_actions_t fa;
+    int fd[2], in[2];
+    size_t sent;
+    pid_t pid;
+    FILE *out, *err;
+    bool_t have_cpi = FALSE;
+    int i, wstat;
+
+    if (!j->prog->text) {
+	j->error = j->prog->error;
+	return;
+    }
+    sprintf(limit, "%lld", j->max_steps);
+    pthread_mutex_lock(&spawn_lock);
+    err = tmpfile();
+    if (!err || pipe(fd) < 0) {
+	if (err)
+	    fclose(err);
+	pthread_mutex_unlock(&spawn_lock);
+	return;
+    }
+    if (pipe(in) < 0) {
+	close(fd[0]);
+	close(fd[1]);
+	fclose(err);
+	pthread_mutex_unlock(&spawn_lock);
+	return;
+    }
+    fcntl(fd[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fd[1], F_SETFD, FD_CLOEXEC);
+    fcntl(in[0], F_SETFD, FD_CLOEXEC);
+    fcntl(in[1], F_SETFD, FD_CLOEXEC);
+    fcntl(fileno(err), F_SETFD, FD_CLOEXEC);
+    posix_spawn_file_actions_init(&fa);
+    posix_spawn_file_actions_adddup2(&fa, in[0], 0);
+    posix_spawn_file_actions_adddup2(&fa, fd[1], 1);
+    posix_spawn_file_actions_adddup2(&fa, fileno(err), 2);
+    i = posix_spawn(&pid, path, &fa, NULL, argv, environ);
+    pthread_mutex_unlock(&spawn_lock);
+    posix_spawn_file_actions_destroy(&fa);
+    close(fd[1]);
+    close(in[0]);
+    if (i != 0) {
+	close(fd[0]);
+	close(in[1]);
+	fclose(err);
+	snprintf(buf, LINELEN, "Couldn't run %s", path);
+	j->error = strdup(buf);
+	return;
+    }
+    /* The simulators read all their input before printing anything */
+    for (sent = 0; sent < j->prog->len; sent += i) {
+	i = write(in[1], j->prog->text + sent, j->prog->len - sent);
+	if (i <= 0)
+	    break;
+    }
+    close(in[1]);
+    out = fdopen(fd[0], "r");
+    while (fgets(buf, LINELEN, out)) {
+	char stat[16], c;
+	long long a, b;
+	/* Memory dump lines also start with a number */
+	if (!have_cpi &&
+	    sscanf(buf, "%lld instructions execute%c", &a, &c) == 2)
+	    j->instr = j->cycles = a;
+	else if (sscanf(buf, "Status = %15s", stat) == 1) {
+	    for (i = STAT_BUB; i <= STAT_PIP; i++)
+		if (!strcmp(stat, stat_name((stat_t) i)))
+		    j->status = (stat_t) i;
+	} else if (!strncmp(buf, "ISA Check Succeeds", 18))
+	    j->check = V_PASS;
+	else if (!strncmp(buf, "ISA Check Fails", 15))
+	    j->check = V_FAIL;
+	else if (sscanf(buf, "CPI: %lld cycles/%lld instructions", &a, &b) == 2) {
+	    j->cycles = a;
+	    j->instr = b;
+	    have_cpi = TRUE;
+	}
+    }
+    fclose(out);
+    waitpid(pid, &wstat, 0);
+    j->error = read_errors(err);
+    fclose(err);
+    j->ok = WIFEXITED(wstat) && WEXITSTATUS(wstat) == 0 && j->check != V_NONE;
+}
+
+static void print_job(int idx)
+{
+    job_ptr j = &jobs[idx];
+    char *c;
+    printf("job=%d prog=%s mode=%s", idx + 1, j->prog->name,
+	   mode_names[j->mode]);
+    if (!j->ok)
+	printf(" status=ERR instr=0 cycles=0 cpi=0.00 check=none");
+    else
+	printf(" status=%s instr=%lld cycles=%lld cpi=%.2f check=%s",
+	       stat_name(j->status), j->instr, j->cycles,
+	       j->instr > 0 ? (double) j->cycles / j->instr : 1.0,
+	       verdict_names[j->check]);
+    /* Quoted last, since it may hold spaces */
+    if (j->error) {
+	printf(" error=\"");
+	for (c = j->error; *c; c++) {
+	    if (*c == '"' || *c == '\\')
+		putchar('\\');
+	    putchar(*c);
+	}
+	putchar('"');
+    }
+    putchar('\n');
+}
+
+static void finish_job(int idx)
+{
+    pthread_mutex_lock(&out_lock);
+    jobs[idx].done = TRUE;
+    while (next_out < njobs && jobs[next_out].done)
+	print_job(next_out++);
+    fflush(stdout);
+    pthread_mutex_unlock(&out_lock);
+}
+
+/* Next job for thread id, -1 once every queue is empty */
+static int take_job(int id)
+{
+    int job = -1;
+    int i;
+    deque_rec *q = &queues[id];
+    pthread_mutex_lock(&q->lock);
+    if (q->head < q->tail)
+	job = q->jobs[--q->tail];
+    pthread_mutex_unlock(&q->lock);
+    for (i = 1; job < 0 && i < nthreads; i++) {
+	q = &queues[(id + i) % nthreads];
+	pthread_mutex_lock(&q->lock);
+	if (q->head < q->tail)
+	    job = q->jobs[q->head++];
+	pthread_mutex_unlock(&q->lock);
+    }
+    return job;
+}
+
+static void *worker(void *arg)
+{
+    int id = (int) (size_t) arg;
+    int job;
+    while ((job = take_job(id)) >= 0) {
+	if (jobs[job].mode == M_YIS)
+	    run_yis(&jobs[job]);
+	else
+	    run_sim(&jobs[job]);
+	finish_job(job);
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    pthread_t *threads;
+    FILE *f;
+    int c, i;
+
+    /* A child that exits early must not kill us as we feed it */
+    signal(SIGPIPE, SIG_IGN);
+    nthreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    while ((c = getopt(argc, argv, "j:S:P:")) != -1) {
+	switch (c) {
+	case 'j':
+	    nthreads = atoi(optarg);
+	    break;
+	case 'S':
+	    ssim_path = optarg;
+	    break;
+	case 'P':
+	    psim_path = optarg;
+	    break;
+	default:
+	    usage(argv[0]);
+	}
+    }
+    if (argc - optind != 1)
+	usage(argv[0]);
+    if (nthreads <= 0)
+	nthreads = 1;
+    f = strcmp(argv[optind], "-") ? fopen(argv[optind], "r") : stdin;
+    if (!f) {
+	fprintf(stderr, "Can't open manifest '%s'\n", argv[optind]);
+	exit(1);
+    }
+    read_manifest(f, argv[optind]);
+    if (f != stdin)
+	fclose(f);
+    if (nthreads > njobs)
+	nthreads = njobs > 0 ? njobs : 1;
+
+    /* Deal the jobs out round-robin, so each queue starts with a mix */
+    queues = (deque_rec *) calloc(nthreads, sizeof(deque_rec));
+    for (i = 0; i < nthreads; i++) {
+	pthread_mutex_init(&queues[i].lock, NULL);
+	queues[i].jobs = (int *) malloc((njobs / nthreads + 1) * sizeof(int));
+    }
+    for (i = njobs - 1; i >= 0; i--) {
+	deque_rec *q = &queues[i % nthreads];
+	q->jobs[q->tail++] = i;
+    }
+
+    threads = (pthread_t *) calloc(nthreads, sizeof(pthread_t));
+    for (i = 0; i < nthreads; i++)
+	pthread_create(&threads[i], NULL, worker, (void *) (size_t) i);
+    for (i = 0; i < nthreads; i++)
+	pthread_join(threads[i], NULL);
+    return 0;
+}
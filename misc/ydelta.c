@@ -0,0 +1,128 @@
+/* Print a delta log written by yis -l as yis's per-step trace */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "isa.h"
+
+static FILE *log_file;
+static char *log_name;
+
+static void bad_log(char *why)
+{
+    fprintf(stderr, "%s: %s\n", log_name, why);
+    exit(1);
+}
+
+static int get_byte()
+{
+    int c = getc(log_file);
+    if (c == EOF)
+	bad_log("Truncated log");
+    return c;
+}
+
+static word_t get_word()
+{
+    uword_t val = 0;
+    int i;
+    for (i = 0; i < 8; i++)
+	val |= (uword_t) get_byte() << (8*i);
+    return (word_t) val;
+}
+
+int main(int argc, char *argv[])
+{
+    char magic[8];
+    state_ptr s;
+    reg_t saver;
+    mem_t savem;
+    stat_t e = STAT_AOK;
+    int step = 0;
+    int pending = 0;
+    int c;
+
+    if (argc != 2) {
+	printf("Usage: %s log_file\n", argv[0]);
+	exit(0);
+    }
+    log_name = argv[1];
+    log_file = fopen(log_name, "rb");
+    if (!log_file) {
+	fprintf(stderr, "Can't open log file '%s'\n", log_name);
+	exit(1);
+    }
+    setvbuf(log_file, NULL, _IOFBF, DELTA_BUF);
+    if (fread(magic, 1, 8, log_file) != 8 || memcmp(magic, DELTA_MAGIC, 8))
+	bad_log("Not a delta log");
+    s = new_state(get_word());
+    s->pc = get_word();
+
+    /* Initial memory image */
+    while ((c = get_byte()) == D_MEM) {
+	word_t pos = get_word();
+	set_word_val(s->m, pos, get_word());
+    }
+    if (c != D_START)
+	bad_log("Bad memory image");
+    saver = copy_reg(s->r);
+    savem = copy_mem(s->m);
+
+    /* A step is printed once the text it produced, if any, is out */
+    for (;;) {
+	c = getc(log_file);
+	if (c == D_TEXT) {
+	    int len = 0;
+	    int i;
+	    for (i = 0; i < 4; i++)
+		len |= get_byte() << (8*i);
+	    for (i = 0; i < len; i++)
+		putchar(get_byte());
+	    continue;
+	}
+	if (pending) {
+	    printf("-------- Step %d --------\n", step);
+	    printf("PC = 0x%llx, Status '%s', CC %s\n",
+		   s->pc, stat_name(e), cc_name(get_cc(s)));
+	    printf("Changes to registers:\n");
+	    diff_reg(saver, s->r, stdout);
+
+	    printf("\nChanges to memory:\n");
+	    diff_mem(savem, s->m, stdout);
+	    printf("\n");
+	    pending = 0;
+	}
+	if (c == EOF)
+	    break;
+	if ((c & 0xF0) == D_REG) {
+	    set_reg_val(s->r, c & 0xF, get_word());
+	} else if (c == D_MEM) {
+	    word_t pos = get_word();
+	    set_word_val(s->m, pos, get_word());
+	} else if (c == D_STEP) {
+	    s->pc = get_word();
+	    e = get_byte();
+	    set_cc(s, get_byte());
+	    step++;
+	    pending = 1;
+	} else
+	    bad_log("Bad event");
+    }
+
+    printf("Stopped in %d steps at PC = 0x%llx.  Status '%s', CC %s\n",
+	   step, s->pc, stat_name(e), cc_name(get_cc(s)));
+
+    printf("Changes to registers:\n");
+    diff_reg(saver, s->r, stdout);
+
+    printf("\nChanges to memory:\n");
+    diff_mem(savem, s->m, stdout);
+
+    free_state(s);
+    free_reg(saver);
+    free_mem(savem);
+    fclose(log_file);
+
+    return 0;
+}
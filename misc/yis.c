@@ -2,52 +2,211 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
 
 #include "isa.h"
 
 void usage(char *pname)
 {
-    printf("Usage: %s code_file [max_steps]\n", pname);
+    printf("Usage: %s [-fbjcai] [-l log_file] [-p prof_file] [-F folded_file] "
+	   "[-M trace_file] code_file [max_steps]\n", pname);
+    printf("   -f     Fast mode: threaded engine, no per-step trace\n");
+    printf("   -b     Fast mode using the basic-block engine\n");
+    printf("   -j     Fast mode using the x86-64 translator\n");
+    printf("   -c     Check fast mode result against step_state\n");
+    printf("   -a     Use the full 64-bit address space\n");
+    printf("   -l     Write the per-step trace as a binary log (see ydelta)\n");
+    printf("   -p     Profile the run, writing counts by label and PC\n");
+    printf("   -F     Profile the run, writing folded stacks for flame graphs\n");
+    printf("   -M     Write the memory accesses as a csim trace ('-' for stdout)\n");
+    printf("   -i     Include instruction fetches in the memory trace\n");
     exit(0);
 }
 
+/* Move the diagnostics printed to error_file into the log */
+static void log_errors(delta_ptr log, FILE *error_file)
+{
+    char buf[1024];
+    int len;
+    fflush(error_file);
+    len = ftell(error_file);
+    if (len <= 0 || len > sizeof(buf))
+	return;
+    rewind(error_file);
+    len = fread(buf, 1, len, error_file);
+    delta_text(log, buf, len);
+    rewind(error_file);
+}
+
+/* Write the profile report, or its folded stacks, to file name */
+static void write_prof(prof_ptr p, char *name, bool_t folded)
+{
+    FILE *f = fopen(name, "w");
+    if (!f) {
+	fprintf(stderr, "Can't open profile file '%s'\n", name);
+	return;
+    }
+    if (folded)
+	print_folded(f, p);
+    else
+	print_prof(f, p, 20);
+    fclose(f);
+}
+
 int main(int argc, char *argv[])
 {
     FILE *code_file;
     int max_steps = 10000;
 
-    state_ptr s = new_state(MEM_SIZE);
-    mem_t saver = copy_reg(s->r);
+    state_ptr s = NULL;
+    reg_t saver;
     mem_t savem;
     int step = 0;
+    int fast = 0;
+    int check = 0;
+    word_t memlen = MEM_SIZE;
+    char *log_name = NULL;
+    FILE *log_file = NULL;
+    FILE *error_file = stdout;
+    char *prof_name = NULL;
+    char *folded_name = NULL;
+    char *trace_name = NULL;
+    FILE *trace_file = NULL;
+    bool_t fetches = FALSE;
+    FILE *out = stdout;
+    int c;
 
     stat_t e = STAT_AOK;
 
-    if (argc < 2 || argc > 3)
+    while ((c = getopt(argc, argv, "fbjcail:p:F:M:")) != -1) {
+	switch (c) {
+	case 'f':
+	    fast = 1;
+	    break;
+	case 'b':
+	    fast = 2;
+	    break;
+	case 'j':
+	    fast = 3;
+	    break;
+	case 'c':
+	    check = 1;
+	    break;
+	case 'a':
+	    memlen = MEM_FULL;
+	    break;
+	case 'l':
+	    log_name = optarg;
+	    break;
+	case 'p':
+	    prof_name = optarg;
+	    break;
+	case 'F':
+	    folded_name = optarg;
+	    break;
+	case 'M':
+	    trace_name = optarg;
+	    break;
+	case 'i':
+	    fetches = TRUE;
+	    break;
+	default:
+	    usage(argv[0]);
+	}
+    }
+    if (argc - optind < 1 || argc - optind > 2 || ((log_name || prof_name || folded_name || trace_name) && fast))
 	usage(argv[0]);
-    code_file = fopen(argv[1], "r");
+    s = new_state(memlen);
+    saver = copy_reg(s->r);
+    code_file = fopen(argv[optind], "r");
     if (!code_file) {
-	fprintf(stderr, "Can't open code file '%s'\n", argv[1]);
+	fprintf(stderr, "Can't open code file '%s'\n", argv[optind]);
 	exit(1);
     }
 
-    if (!load_mem(s->m, code_file, 1)) {
+    if (!load_object(s->m, code_file, &s->pc, 1)) {
 	printf("Exiting\n");
 	return 1;
     }
 
     savem = copy_mem(s->m);
+
+    if (prof_name || folded_name) {
+	s->prof = new_prof(memlen == MEM_FULL ? MEM_SIZE : memlen, FALSE);
+	rewind(code_file);
+	load_labels(s->prof, code_file);
+    }
+
+    if (trace_name) {
+	if (!strcmp(trace_name, "-")) {
+	    /* The trace has stdout to itself, for piping into csim */
+	    trace_file = stdout;
+	    out = error_file = stderr;
+	} else if (!(trace_file = fopen(trace_name, "w"))) {
+	    fprintf(stderr, "Can't open trace file '%s'\n", trace_name);
+	    exit(1);
+	}
+	s->trace = open_trace(trace_file, fetches);
+    }
+
+    if (log_name) {
+	log_file = fopen(log_name, "wb");
+	if (!log_file) {
+	    fprintf(stderr, "Can't open log file '%s'\n", log_name);
+	    exit(1);
+	}
+	s->log = open_delta(log_file, s);
+	/* Diagnostics go into the log, after the step that printed them */
+	error_file = tmpfile();
+    }
   
-    if (argc > 2)
-	max_steps = atoi(argv[2]);
+    if (argc - optind > 1)
+	max_steps = atoi(argv[optind+1]);
+
+    if (fast) {
+	word_t steps = 0;
+	state_ptr ref = check ? copy_state(s) : NULL;
+	if (fast == 3)
+	    e = run_state_jit(s, max_steps, &steps, NULL);
+	else if (fast == 2)
+	    e = run_state_block(s, max_steps, &steps, NULL);
+	else
+	    e = run_state_threaded(s, max_steps, &steps, NULL);
+	if (e != STAT_AOK && e != STAT_HLT)
+	    print_stop(stdout, &s->stop);
+	step = steps;
+	if (ref) {
+	    /* Replay one instruction at a time and compare */
+	    stat_t re = STAT_AOK;
+	    int rstep;
+	    for (rstep = 0; rstep < max_steps && re == STAT_AOK; rstep++)
+		re = step_state(ref, NULL);
+	    if (rstep != step || re != e || diff_state(ref, s, stdout)) {
+		printf("Fast mode check fails: %d steps, status '%s' vs. ",
+		       rstep, stat_name(re));
+		printf("%d steps, status '%s'\n", step, stat_name(e));
+	    } else
+		printf("Fast mode check succeeds\n");
+	    free_state(ref);
+	}
+    }
 
-    for (step = 0; step < max_steps && e == STAT_AOK; step++) {
+    for (; step < max_steps && e == STAT_AOK; step++) {
         /* Execute one instruction at a time */
-        e = step_state(s, stdout);
+        e = step_state(s, error_file);
+
+	if (s->log) {
+	    if (e != STAT_AOK)
+		log_errors(s->log, error_file);
+	    continue;
+	}
+	if (s->prof || s->trace)
+	    continue;
 
         printf("-------- Step %d --------\n", step + 1);
         printf("PC = 0x%llx, Status '%s', CC %s\n",
-	        s->pc, stat_name(e), cc_name(s->cc));
+	        s->pc, stat_name(e), cc_name(get_cc(s)));
         printf("Changes to registers:\n");
         diff_reg(saver, s->r, stdout);
 
@@ -57,15 +216,31 @@ int main(int argc, char *argv[])
     }
 	
 
-    printf("Stopped in %d steps at PC = 0x%llx.  Status '%s', CC %s\n",
-	   step, s->pc, stat_name(e), cc_name(s->cc));
-
-    printf("Changes to registers:\n");
-    diff_reg(saver, s->r, stdout);
-
-    printf("\nChanges to memory:\n");
-    diff_mem(savem, s->m, stdout);
-
+    fprintf(out, "Stopped in %d steps at PC = 0x%llx.  Status '%s', CC %s\n",
+	    step, s->pc, stat_name(e), cc_name(get_cc(s)));
+
+    fprintf(out, "Changes to registers:\n");
+    diff_reg(saver, s->r, out);
+
+    fprintf(out, "\nChanges to memory:\n");
+    diff_mem(savem, s->m, out);
+
+    if (prof_name)
+	write_prof(s->prof, prof_name, FALSE);
+    if (folded_name)
+	write_prof(s->prof, folded_name, TRUE);
+    if (s->prof)
+	free_prof(s->prof);
+    if (s->trace) {
+	close_trace(s->trace);
+	if (trace_file != stdout)
+	    fclose(trace_file);
+    }
+    if (s->log) {
+	close_delta(s->log);
+	fclose(log_file);
+	fclose(error_file);
+    }
     free_state(s);
     free_reg(saver);
     free_mem(savem);
@@ -0,0 +1,330 @@
+/* Convert a .yo listing into a .ybo binary object, or list a .ybo */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+
+#include "isa.h"
+
+typedef struct {
+    word_t addr;
+    word_t size;
+    word_t pos;    /* Offset in data[], or in strings[] for YBO_FILE */
+    int kind;
+} sect_rec;
+
+typedef struct {
+    word_t value;
+    word_t name;   /* Offset in strings[] */
+} sym_rec;
+
+static sect_rec *sects;
+static int nsect, sect_cap;
+static sym_rec *syms;
+static int nsym, sym_cap;
+static byte_t *data;
+static word_t data_len, data_cap;
+static char *strings;
+static word_t str_len, str_cap;
+
+void usage(char *pname)
+{
+    printf("Usage: %s [-e entry] [-d addr:file]... [-o out.ybo] file.yo\n",
+	   pname);
+    printf("       %s -t file.ybo\n", pname);
+    printf("   -e     Set the entry point (default 0)\n");
+    printf("   -d     Load the contents of file at addr when the object is loaded\n");
+    printf("   -o     Name of the object file (default: file.ybo)\n");
+    printf("   -t     List the sections and symbols of an object file\n");
+    exit(0);
+}
+
+static int hexval(char c)
+{
+    if (isdigit((int)c))
+	return c - '0';
+    return tolower((int)c) - 'a' + 10;
+}
+
+static void *grow(void *p, word_t *capp, word_t need, size_t size)
+{
+    if (need <= *capp)
+	return p;
+    while (*capp < need)
+	*capp = *capp ? 2 * *capp : 256;
+    p = realloc(p, *capp * size);
+    if (!p) {
+	fprintf(stderr, "Out of memory\n");
+	exit(1);
+    }
+    return p;
+}
+
+static sect_rec *new_sect(word_t addr, int kind)
+{
+    word_t cap = sect_cap;
+    sect_rec *sp;
+    sects = grow(sects, &cap, nsect + 1, sizeof(sect_rec));
+    sect_cap = cap;
+    sp = &sects[nsect++];
+    sp->addr = addr;
+    sp->size = 0;
+    sp->pos = kind == YBO_DATA ? data_len : str_len;
+    sp->kind = kind;
+    return sp;
+}
+
+static word_t add_string(char *s, int len)
+{
+    word_t pos = str_len;
+    strings = grow(strings, &str_cap, str_len + len + 1, 1);
+    memcpy(strings + str_len, s, len);
+    strings[str_len + len] = '\0';
+    str_len += len + 1;
+    return pos;
+}
+
+static void add_symbol(char *name, int len, word_t value)
+{
+    word_t cap = sym_cap;
+    syms = grow(syms, &cap, nsym + 1, sizeof(sym_rec));
+    sym_cap = cap;
+    syms[nsym].value = value;
+    syms[nsym].name = add_string(name, len);
+    nsym++;
+}
+
+/* Read the listing, starting a new section wherever the bytes are not
+   contiguous with the previous line's */
+static void read_yo(FILE *in, char *fname)
+{
+    char buf[4096];
+    int lineno = 0;
+    sect_rec *cur = NULL;
+    while (fgets(buf, sizeof(buf), in)) {
+	int cpos = 0;
+	word_t addr = 0;
+	word_t line_addr;
+	char *bar;
+	lineno++;
+	while (isspace((int)buf[cpos]))
+	    cpos++;
+	if (buf[cpos] != '0' ||
+	    (buf[cpos+1] != 'x' && buf[cpos+1] != 'X'))
+	    continue;
+	cpos += 2;
+	while (isxdigit((int)buf[cpos]))
+	    addr = addr*16 + hexval(buf[cpos++]);
+	line_addr = addr;
+	while (isspace((int)buf[cpos]))
+	    cpos++;
+	if (buf[cpos++] != ':') {
+	    fprintf(stderr, "%s:%d: Expected colon\n", fname, lineno);
+	    exit(1);
+	}
+	while (isspace((int)buf[cpos]))
+	    cpos++;
+	while (isxdigit((int)buf[cpos]) && isxdigit((int)buf[cpos+1])) {
+	    if (!cur || cur->addr + cur->size != addr)
+		cur = new_sect(addr, YBO_DATA);
+	    data = grow(data, &data_cap, data_len + 1, 1);
+	    data[data_len++] = hexval(buf[cpos])*16 + hexval(buf[cpos+1]);
+	    cur->size++;
+	    addr++;
+	    cpos += 2;
+	}
+	/* A label at the start of the source text names the address */
+	bar = strchr(buf + cpos, '|');
+	if (bar) {
+	    char *name = bar + 1;
+	    int len = 0;
+	    while (isspace((int)*name))
+		name++;
+	    while (isalnum((int)name[len]) || name[len] == '_')
+		len++;
+	    if (len > 0 && name[len] == ':' && !isdigit((int)name[0]))
+		add_symbol(name, len, line_addr);
+	}
+    }
+}
+
+static void put_word(FILE *out, word_t val)
+{
+    int i;
+    for (i = 0; i < 8; i++)
+	putc((int) (((uword_t) val >> (8*i)) & 0xFF), out);
+}
+
+static void put_int(FILE *out, int val)
+{
+    int i;
+    for (i = 0; i < 4; i++)
+	putc((int) (((unsigned) val >> (8*i)) & 0xFF), out);
+}
+
+static void write_ybo(FILE *out, word_t entry)
+{
+    word_t str_base = YBO_HEADER + (word_t) nsect * YBO_SECTION +
+	(word_t) nsym * YBO_SYMBOL;
+    word_t data_base = (str_base + str_len + 7) & ~7;
+    int i;
+    fwrite(YBO_MAGIC, 1, 8, out);
+    put_word(out, entry);
+    put_int(out, nsect);
+    put_int(out, nsym);
+    for (i = 0; i < nsect; i++) {
+	put_word(out, sects[i].addr);
+	put_word(out, sects[i].size);
+	put_word(out, (sects[i].kind == YBO_DATA ? data_base : str_base)
+		 + sects[i].pos);
+	put_int(out, sects[i].kind);
+	put_int(out, 0);
+    }
+    for (i = 0; i < nsym; i++) {
+	put_word(out, syms[i].value);
+	put_word(out, str_base + syms[i].name);
+    }
+    fwrite(strings, 1, str_len, out);
+    for (i = str_base + str_len; i < data_base; i++)
+	putc(0, out);
+    fwrite(data, 1, data_len, out);
+}
+
+static word_t get_word(byte_t *b)
+{
+    uword_t val = 0;
+    int i;
+    for (i = 7; i >= 0; i--)
+	val = (val << 8) | b[i];
+    return (word_t) val;
+}
+
+static int get_int(byte_t *b)
+{
+    return (int) (b[0] | (b[1] << 8) | (b[2] << 16) | ((unsigned) b[3] << 24));
+}
+
+static void list_ybo(char *fname)
+{
+    FILE *in = fopen(fname, "rb");
+    byte_t *image = NULL;
+    word_t len = 0, cap = 0;
+    size_t n;
+    int i, ns, nm;
+    if (!in) {
+	fprintf(stderr, "Can't open object file '%s'\n", fname);
+	exit(1);
+    }
+    do {
+	image = grow(image, &cap, len + 4096, 1);
+	n = fread(image + len, 1, cap - len, in);
+	len += n;
+    } while (n > 0);
+    fclose(in);
+    if (len < YBO_HEADER || memcmp(image, YBO_MAGIC, 8)) {
+	fprintf(stderr, "%s: Not a .ybo file\n", fname);
+	exit(1);
+    }
+    ns = get_int(image + 16);
+    nm = get_int(image + 20);
+    if (ns < 0 || nm < 0 || YBO_HEADER + (word_t) ns * YBO_SECTION +
+	(word_t) nm * YBO_SYMBOL > len) {
+	fprintf(stderr, "%s: Bad tables\n", fname);
+	exit(1);
+    }
+    printf("Entry point 0x%llx\n", get_word(image + 8));
+    printf("Sections:\n");
+    for (i = 0; i < ns; i++) {
+	byte_t *sp = image + YBO_HEADER + i * YBO_SECTION;
+	word_t off = get_word(sp + 16);
+	printf("  0x%.4llx  %6lld bytes", get_word(sp), get_word(sp + 8));
+	if (get_int(sp + 24) == YBO_FILE)
+	    printf("  from '%s'\n", off < len ? (char *) image + off : "?");
+	else
+	    printf("  at offset 0x%llx\n", off);
+    }
+    if (nm > 0)
+	printf("Symbols:\n");
+    for (i = 0; i < nm; i++) {
+	byte_t *sp = image + YBO_HEADER + ns * YBO_SECTION + i * YBO_SYMBOL;
+	word_t off = get_word(sp + 8);
+	printf("  0x%.4llx  %s\n", get_word(sp),
+	       off < len ? (char *) image + off : "?");
+    }
+    free(image);
+}
+
+int main(int argc, char *argv[])
+{
+    char *out_name = NULL;
+    char *in_name;
+    word_t entry = 0;
+    FILE *in, *out;
+    int c;
+
+    while ((c = getopt(argc, argv, "e:d:o:t")) != -1) {
+	switch (c) {
+	case 'e':
+	    entry = strtoll(optarg, NULL, 0);
+	    break;
+	case 'd': {
+	    /* Raw data segment: addr:file */
+	    char *colon = strchr(optarg, ':');
+	    FILE *df;
+	    sect_rec *sp;
+	    if (!colon)
+		usage(argv[0]);
+	    df = fopen(colon + 1, "rb");
+	    if (!df) {
+		fprintf(stderr, "Can't open data file '%s'\n", colon + 1);
+		exit(1);
+	    }
+	    fseek(df, 0, SEEK_END);
+	    sp = new_sect(strtoll(optarg, NULL, 0), YBO_FILE);
+	    sp->size = ftell(df);
+	    fclose(df);
+	    add_string(colon + 1, strlen(colon + 1));
+	    break;
+	}
+	case 'o':
+	    out_name = optarg;
+	    break;
+	case 't':
+	    if (argc - optind != 1)
+		usage(argv[0]);
+	    list_ybo(argv[optind]);
+	    return 0;
+	default:
+	    usage(argv[0]);
+	}
+    }
+    if (argc - optind != 1)
+	usage(argv[0]);
+    in_name = argv[optind];
+    in = fopen(in_name, "r");
+    if (!in) {
+	fprintf(stderr, "Can't open code file '%s'\n", in_name);
+	exit(1);
+    }
+    read_yo(in, in_name);
+    fclose(in);
+
+    if (!out_name) {
+	int len = strlen(in_name);
+	out_name = malloc(len + 5);
+	strcpy(out_name, in_name);
+	if (len > 3 && !strcmp(in_name + len - 3, ".yo"))
+	    out_name[len - 3] = '\0';
+	strcat(out_name, ".ybo");
+    }
+    out = fopen(out_name, "wb");
+    if (!out) {
+	fprintf(stderr, "Can't open object file '%s'\n", out_name);
+	exit(1);
+    }
+    write_ybo(out, entry);
+    fclose(out);
+    return 0;
+}
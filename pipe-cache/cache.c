@@ -33,28 +33,6 @@ typedef unsigned long long int mem_addr_t;
 typedef unsigned char byte_t;
 typedef long long int word_t;
 
-/* Globals set by command line args */
-int verbosity_cache = 0; /* print trace if set */
-int s = 0; /* set index bits */
-int b = 0; /* block offset bits */
-int E = 0; /* associativity */
-
-/* Derived from command line args */
-int S; /* number of sets */
-int B; /* block size (bytes) */
-
-/* Counters used to record cache statistics in printSummary().
-   test-cache uses these numbers to verify correctness of the cache. */
-
-//Increment when a miss occurs
-int miss_count = 0;
-
-//Increment when a hit occurs
-int hit_count = 0;
-
-//Increment when an eviction occurs
-int eviction_count = 0;
-
 /* 
  * A possible hierarchy for the cache. The helper functions defined below
  * are based on this cache structure.
@@ -71,13 +49,7 @@ typedef struct cache_set {
     cache_line_t *lines;
 } cache_set_t;
 
-typedef struct cache {
-    cache_set_t *sets;
-} cache_t;
-
-cache_t cache;
-
-/* TODO: add more globals, structs, macros if necessary */
+/* TODO: add more structs, macros if necessary */
 
 
 /* 
@@ -87,48 +59,52 @@ cache_t cache;
  * The code provided here shows you how to initialize a cache structure
  * defined above. It's not complete and feel free to modify/add code.
  */
-void initCache(int s_in, int b_in, int E_in)
+cache_t *initCache(int s_in, int b_in, int E_in)
 {
     /* see cache-runner for the meaning of each argument */
-    s = s_in;
-    b = b_in;
-    E = E_in;
-    S = (unsigned int) pow(2, s);
-    B = (unsigned int) pow(2, b);
+    cache_t *cache = (cache_t *) calloc(1, sizeof(cache_t));
+    int S, E, B;
+    cache->s = s_in;
+    cache->b = b_in;
+    cache->E = E = E_in;
+    cache->S = S = (unsigned int) pow(2, s_in);
+    cache->B = B = (unsigned int) pow(2, b_in);
 
     int i, j;
-    cache.sets = (cache_set_t*) calloc(S, sizeof(cache_set_t));
+    cache->sets = (cache_set_t*) calloc(S, sizeof(cache_set_t));
     for (i=0; i<S; i++){
-        cache.sets[i].lines = (cache_line_t*) calloc(E, sizeof(cache_line_t));
+        cache->sets[i].lines = (cache_line_t*) calloc(E, sizeof(cache_line_t));
         for (j=0; j<E; j++){
-            cache.sets[i].lines[j].valid = 0;
-            cache.sets[i].lines[j].tag = 0;
-            cache.sets[i].lines[j].lru = 0;
-            cache.sets[i].lines[j].data = calloc(B, sizeof(byte_t));
+            cache->sets[i].lines[j].valid = 0;
+            cache->sets[i].lines[j].tag = 0;
+            cache->sets[i].lines[j].lru = 0;
+            cache->sets[i].lines[j].data = calloc(B, sizeof(byte_t));
         }
     }
 
     /* TODO: add more code for initialization */
+    return cache;
 }
 
-int get_block_size() {
-    return B;
+int get_block_size(cache_t *cache) {
+    return cache->B;
 }
 
-word_t get_block_address(word_t pos) {
-    return pos & (~(B - 1));
+word_t get_block_address(cache_t *cache, word_t pos) {
+    return pos & (~(cache->B - 1));
 }
 
 /* 
  * Free allocated memory. Feel free to modify it
  */
-void freeCache()
+void freeCache(cache_t *cache)
 {
     int i;
-    for (i=0; i<S; i++){
-        free(cache.sets[i].lines);     
+    for (i=0; i<cache->S; i++){
+        free(cache->sets[i].lines);     
     }
-    free(cache.sets);
+    free(cache->sets);
+    free(cache);
 }
 
 
@@ -137,7 +113,7 @@ void freeCache()
  * On hit, return the cache line holding the address
  * On miss, returns NULL
  */
-cache_line_t *get_line(word_t addr)
+cache_line_t *get_line(cache_t *cache, word_t addr)
 {
     /* your implementation */
     return NULL;
@@ -148,7 +124,7 @@ cache_line_t *get_line(word_t addr)
  * Select the line to fill with the new cache line
  * Return the cache line selected to filled in by addr
  */
-cache_line_t *select_line(word_t addr)
+cache_line_t *select_line(cache_t *cache, word_t addr)
 {
     /* your implementation */
     return NULL;
@@ -158,7 +134,7 @@ cache_line_t *select_line(word_t addr)
  * Check if the address is hit in the cache, updating hit and miss data. 
  * Return True if pos hits in the cache.
  */
-bool check_hit(word_t pos) 
+bool check_hit(cache_t *cache, word_t pos) 
 {
     /* your implementation */
     return false;
@@ -170,7 +146,7 @@ bool check_hit(word_t pos)
  * If block is not NULL, copy the data from block into the cache line. 
  * Return True if a line was evicted.
  */ 
-bool handle_miss(word_t pos, void *block, word_t *evicted_pos, void *evicted_block) 
+bool handle_miss(cache_t *cache, word_t pos, void *block, word_t *evicted_pos, void *evicted_block) 
 {
     /* your implementation */
     return false;
@@ -182,7 +158,7 @@ bool handle_miss(word_t pos, void *block, word_t *evicted_pos, void *evicted_blo
  * On miss, call get_byte_val() and update cache
  * Return TRUE on success
  */
-void get_byte_cache(word_t pos, byte_t *dest)
+void get_byte_cache(cache_t *cache, word_t pos, byte_t *dest)
 {
     /* your implementation */
 }
@@ -194,7 +170,7 @@ void get_byte_cache(word_t pos, byte_t *dest)
  * On miss, call get_byte_val() and update cache
  * Return TRUE on success
  */
-void get_word_cache(word_t pos, word_t *dest) {
+void get_word_cache(cache_t *cache, word_t pos, word_t *dest) {
 
     /* your implementation */
 }
@@ -205,7 +181,7 @@ void get_word_cache(word_t pos, word_t *dest) {
  * On miss, call get_byte_val() and update cache
  * Return TRUE on success
  */
-void set_byte_cache(word_t pos, byte_t val)
+void set_byte_cache(cache_t *cache, word_t pos, byte_t val)
 {
 
     /* your implementation */
@@ -218,7 +194,7 @@ void set_byte_cache(word_t pos, byte_t val)
  * On miss, call get_byte_val() and update cache
  * Return TRUE on success
  */
-void set_word_cache(word_t pos, word_t val)
+void set_word_cache(cache_t *cache, word_t pos, word_t val)
 {
     /* your implementation */
 }
@@ -232,8 +208,8 @@ void set_word_cache(word_t pos, word_t val)
  * Called by cache-runner; no need to modify it if you implement
  * check_hit() and handle_miss()
  */
-void accessData(mem_addr_t addr)
+void accessData(cache_t *cache, mem_addr_t addr)
 {
-    if(!check_hit(addr))
-        handle_miss(addr, NULL, NULL, NULL);
+    if(!check_hit(cache, addr))
+        handle_miss(cache, addr, NULL, NULL, NULL);
 }
\ No newline at end of file
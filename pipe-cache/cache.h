@@ -7,19 +7,34 @@ typedef unsigned long long int mem_addr_t;
 typedef long long word_t;
 typedef unsigned char byte_t;
 
-void initCache(int s_in, int b_in, int E_in);
-void freeCache();
-void accessData(mem_addr_t addr);
+/* All the state of one simulated cache */
+typedef struct cache {
+    int verbosity;          /* print trace if set */
+    int s;                  /* set index bits */
+    int b;                  /* block offset bits */
+    int E;                  /* associativity */
+    int S;                  /* number of sets */
+    int B;                  /* block size (bytes) */
+    /* Statistics */
+    int miss_count;
+    int hit_count;
+    int eviction_count;
+    struct cache_set *sets;
+} cache_t;
 
-int get_block_size();
-word_t get_block_address();
+cache_t *initCache(int s_in, int b_in, int E_in);
+void freeCache(cache_t *cache);
+void accessData(cache_t *cache, mem_addr_t addr);
 
-void get_byte_cache(word_t pos, byte_t *dest);
-void get_word_cache(word_t pos, word_t *dest);
-void set_byte_cache(word_t pos, byte_t val);
-void set_word_cache(word_t pos, word_t val);
+int get_block_size(cache_t *cache);
+word_t get_block_address(cache_t *cache, word_t pos);
 
-bool handle_miss(word_t pos, void *block, word_t *evicted_pos, void *evicted_block);
-bool check_hit(word_t pos);
+void get_byte_cache(cache_t *cache, word_t pos, byte_t *dest);
+void get_word_cache(cache_t *cache, word_t pos, word_t *dest);
+void set_byte_cache(cache_t *cache, word_t pos, byte_t val);
+void set_word_cache(cache_t *cache, word_t pos, word_t val);
+
+bool handle_miss(cache_t *cache, word_t pos, void *block, word_t *evicted_pos, void *evicted_block);
+bool check_hit(cache_t *cache, word_t pos);
 
 #endif /* CACHELAB_H */
\ No newline at end of file
@@ -2,6 +2,9 @@
 #include <ctype.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "isa.h"
 #include "cache.h"
 
@@ -136,6 +139,10 @@ mem_t init_mem(int len)
     len = ((len+BPL-1)/BPL)*BPL;
     result->len = len;
     result->contents = (byte_t *) calloc(len, 1);
+    result->cache = NULL;
+    result->inflight = FALSE;
+    result->inflight_cycles = 0;
+    result->inflight_pos = 0;
     return result;
 }
 
@@ -167,28 +174,17 @@ static bool_t get_byte_val(mem_t m, word_t pos, byte_t *dest)
 
 static bool_t get_word_val(mem_t m, word_t pos, word_t *dest)
 {
-    int i;
-    word_t val;
     if (pos < 0 || pos + 8 > m->len)
 	return FALSE;
-    val = 0;
-    for (i = 0; i < 8; i++) {
-	word_t b =  m->contents[pos+i] & 0xFF;
-	val = val | (b <<(8*i));
-    }
-    *dest = val;
+    *dest = load_word(m->contents + pos);
     return TRUE;
 }
 
 static bool_t set_word_val(mem_t m, word_t pos, word_t val)
 {
-    int i;
     if (pos < 0 || pos + 8 > m->len)
 	return FALSE;
-    for (i = 0; i < 8; i++) {
-	m->contents[pos+i] = (byte_t) val & 0xFF;
-	val >>= 8;
-    }
+    store_word(m->contents + pos, val);
     return TRUE;
 }
 
@@ -201,8 +197,8 @@ bool_t diff_mem(mem_t oldm, mem_t newm, FILE *outfile)
 	len = newm->len;
     for (pos = 0; (!diff || outfile) && pos < len; pos += 8) {
         word_t ov = 0;  word_t nv = 0;
-		if(check_hit(pos)) {
-			get_word_cache(pos, &nv);
+		if(newm->cache && check_hit(newm->cache, pos)) {
+			get_word_cache(newm->cache, pos, &nv);
 		} else {
 			get_word_val(newm, pos, &nv);
 		}
@@ -226,71 +222,299 @@ int hex2dig(char c)
 	return c - 'a' + 10;
 }
 
+static word_t ybo_word(byte_t *b)
+{
+    uword_t val = 0;
+    int i;
+    for (i = 7; i >= 0; i--)
+	val = (val << 8) | b[i];
+    return (word_t) val;
+}
+
+static int ybo_int(byte_t *b)
+{
+    return (int) (b[0] | (b[1] << 8) | (b[2] << 16) | ((unsigned) b[3] << 24));
+}
+
+/* Map or read in the whole of file f.  If first is not EOF, it is the
+   byte already taken from f.  *mappedp tells which was done. */
+static byte_t *map_file(FILE *f, int first, size_t *lenp, bool_t *mappedp)
+{
+    struct stat st;
+    byte_t *image;
+    size_t len, cap;
+    size_t n;
+    if (fstat(fileno(f), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+	image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+	if (image != MAP_FAILED) {
+	    *lenp = st.st_size;
+	    *mappedp = TRUE;
+	    return image;
+	}
+    }
+    cap = 1 << 16;
+    image = (byte_t *) malloc(cap);
+    len = 0;
+    if (first != EOF)
+	image[len++] = first;
+    while ((n = fread(image + len, 1, cap - len, f)) > 0) {
+	len += n;
+	if (len == cap)
+	    image = (byte_t *) realloc(image, cap *= 2);
+    }
+    *lenp = len;
+    *mappedp = FALSE;
+    return image;
+}
+
+static void unmap_file(byte_t *image, size_t len, bool_t mapped)
+{
+    if (mapped)
+	munmap(image, len);
+    else
+	free(image);
+}
+
+/* Value of each hex digit character, -1 for anything else */
+static const signed char hex_val[256] = {
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+     0,  1,  2,  3,  4,  5,  6,  7,  8,  9, -1, -1, -1, -1, -1, -1,
+    -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1
+};
+
+#define IS_SPACE(c) ((c) == ' ' || ((c) >= '\t' && (c) <= '\r'))
+
 #define LINELEN 4096
-int load_mem(mem_t m, FILE *infile, int report_error)
+
+/* End of the line starting at text, split where fgets() with a LINELEN
+   buffer would split it */
+static char *line_end(char *text, char *end)
+{
+    int max = end - text < LINELEN-1 ? end - text : LINELEN-1;
+    char *nl = memchr(text, '\n', max);
+    return nl ? nl + 1 : text + max;
+}
+
+/* Character at position pos of the fgets() buffer just after reading
+   the line at cur: either from that line, its terminator, or left over
+   from an earlier, longer line.  Error messages have always shown it. */
+static char line_buf_char(char *text, char *cur, char *end, int pos)
 {
-    /* Read contents of .yo file */
-    char buf[LINELEN];
-    char c, ch, cl;
+    char c = '\0';
+    while (text <= cur && text < end) {
+	char *lend = line_end(text, end);
+	if (lend - text > pos)
+	    c = text[pos];
+	else if (lend - text == pos)
+	    c = '\0';
+	text = lend;
+    }
+    return c;
+}
+
+static int load_yo(mem_t m, FILE *infile, int report_error)
+{
+    /* Read contents of .yo file, all at once */
+    size_t len;
+    bool_t mapped;
+    byte_t *image = map_file(infile, EOF, &len, &mapped);
+    char *text = (char *) image;
+    char *end = text + len;
+    byte_t bytes[LINELEN/2 + 8];
     int byte_cnt = 0;
     int lineno = 0;
-    word_t bytepos = 0;
-    while (fgets(buf, LINELEN, infile)) {
+    while (text < end) {
+	char *line = text;
+	char *lend = line_end(text, end);
+	int llen = lend - line;
 	int cpos = 0;
+	int nbytes, ndig, i;
+	char c;
+	uword_t bytepos = 0;
+	text = lend;
 	lineno++;
 	/* Skip white space */
-	while (isspace((int)buf[cpos]))
+	while (cpos < llen && IS_SPACE(line[cpos]))
 	    cpos++;
 
-	if (buf[cpos] != '0' ||
-	    (buf[cpos+1] != 'x' && buf[cpos+1] != 'X'))
-	    continue; /* Skip this line */      
+	if (llen - cpos < 2 || line[cpos] != '0' ||
+	    (line[cpos+1] != 'x' && line[cpos+1] != 'X'))
+	    continue; /* Skip this line */
 	cpos+=2;
 
 	/* Get address */
-	bytepos = 0;
-	while (isxdigit((int)(c=buf[cpos]))) {
-	    cpos++;
-	    bytepos = bytepos*16 + hex2dig(c);
-	}
+	while (cpos < llen && hex_val[(byte_t) line[cpos]] >= 0)
+	    bytepos = bytepos*16 + hex_val[(byte_t) line[cpos++]];
 
-	while (isspace((int)buf[cpos]))
+	while (cpos < llen && IS_SPACE(line[cpos]))
 	    cpos++;
 
-	if (buf[cpos++] != ':') {
+	c = cpos < llen ? line[cpos] : '\0';
+	cpos++;
+	if (c != ':') {
 	    if (report_error) {
 		fprintf(stderr, "Error reading file. Expected colon\n");
-		fprintf(stderr, "Line %d:%s\n", lineno, buf);
-		fprintf(stderr,
-			"Reading '%c' at position %d\n", buf[cpos], cpos);
+		fprintf(stderr, "Line %d:%.*s\n", lineno, llen, line);
+		fprintf(stderr, "Reading '%c' at position %d\n",
+			line_buf_char((char *) image, line, end, cpos), cpos);
 	    }
+	    unmap_file(image, len, mapped);
 	    return 0;
 	}
 
-	while (isspace((int)buf[cpos]))
+	while (cpos < llen && IS_SPACE(line[cpos]))
 	    cpos++;
 
-	/* Get code */
-	while (isxdigit((int)(ch=buf[cpos++])) && 
-	       isxdigit((int)(cl=buf[cpos++]))) {
-	    byte_t byte = 0;
-	    if (bytepos >= m->len) {
-		if (report_error) {
+	/* Get code: pairs of hex digits, 16 digits to a word at a time */
+	ndig = 0;
+	while (cpos + ndig < llen && hex_val[(byte_t) line[cpos+ndig]] >= 0)
+	    ndig++;
+	nbytes = ndig / 2;
+	for (i = 0; i < nbytes; i += 8) {
+	    const char *d = line + cpos + 2*i;
+	    uword_t w = 0;
+	    int k, n = nbytes - i < 8 ? nbytes - i : 8;
+	    for (k = n-1; k >= 0; k--)
+		w = (w << 8) | (hex_val[(byte_t) d[2*k]] << 4) |
+		    hex_val[(byte_t) d[2*k+1]];
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	    memcpy(bytes + i, &w, 8);
+#else
+	    for (k = 0; k < 8; k++)
+		bytes[i+k] = (byte_t) (w >> (8*k));
+#endif
+	}
+	if (nbytes > 0 && bytepos + nbytes > (uword_t) m->len) {
+	    /* Store what fits, then complain about the first byte that
+	       does not */
+	    uword_t bad = bytepos >= m->len ? bytepos : m->len;
+	    if (bad > bytepos)
+		memcpy(m->contents + bytepos, bytes, bad - bytepos);
+	    if (report_error) {
+		fprintf(stderr,
+			"Error reading file. Invalid address. 0x%llx\n",
+			bad);
+		fprintf(stderr, "Line %d:%.*s\n", lineno, llen, line);
+	    }
+	    unmap_file(image, len, mapped);
+	    return 0;
+	}
+	memcpy(m->contents + bytepos, bytes, nbytes);
+	byte_cnt += nbytes;
+    }
+    unmap_file(image, len, mapped);
+    return byte_cnt;
+}
+
+/* Copy the sections of a .ybo image into memory */
+static int load_ybo(mem_t m, byte_t *image, size_t len, int report_error)
+{
+    int nsect, i;
+    int byte_cnt = 0;
+    if (len < YBO_HEADER || memcmp(image, YBO_MAGIC, 8)) {
+	if (report_error)
+	    fprintf(stderr, "Error reading file. Bad object header\n");
+	return 0;
+    }
+    nsect = ybo_int(image + 16);
+    if (nsect < 0 || YBO_HEADER + (size_t) nsect * YBO_SECTION > len) {
+	if (report_error)
+	    fprintf(stderr, "Error reading file. Bad section table\n");
+	return 0;
+    }
+    for (i = 0; i < nsect; i++) {
+	byte_t *sect = image + YBO_HEADER + i * YBO_SECTION;
+	word_t addr = ybo_word(sect);
+	word_t size = ybo_word(sect + 8);
+	uword_t offset = ybo_word(sect + 16);
+	int kind = ybo_int(sect + 24);
+	if (size <= 0)
+	    continue;
+	if (addr < 0 || addr >= m->len || size > m->len - addr) {
+	    if (report_error)
+		fprintf(stderr,
+			"Error reading file. Invalid address. 0x%llx\n",
+			addr >= 0 && addr < m->len ? (word_t) m->len : addr);
+	    return 0;
+	}
+	if (kind == YBO_DATA) {
+	    if (offset > len || (uword_t) size > len - offset) {
+		if (report_error)
 		    fprintf(stderr,
-			    "Error reading file. Invalid address. 0x%llx\n",
-			    bytepos);
-		    fprintf(stderr, "Line %d:%s\n", lineno, buf);
-		}
+			    "Error reading file. Section %d out of bounds\n", i);
+		return 0;
+	    }
+	    memcpy(m->contents + addr, image + offset, size);
+	} else if (kind == YBO_FILE) {
+	    /* Raw data from another file, named by a string in the image */
+	    char *name = (char *) image + offset;
+	    byte_t *data;
+	    size_t dlen;
+	    bool_t mapped;
+	    FILE *df;
+	    if (offset >= len || !memchr(name, 0, len - offset)) {
+		if (report_error)
+		    fprintf(stderr,
+			    "Error reading file. Section %d out of bounds\n", i);
+		return 0;
+	    }
+	    df = fopen(name, "rb");
+	    if (!df) {
+		if (report_error)
+		    fprintf(stderr, "Can't open data file '%s'\n", name);
+		return 0;
+	    }
+	    data = map_file(df, EOF, &dlen, &mapped);
+	    fclose(df);
+	    if (dlen < (uword_t) size) {
+		if (report_error)
+		    fprintf(stderr, "Data file '%s' is too short\n", name);
+		unmap_file(data, dlen, mapped);
 		return 0;
 	    }
-	    byte = hex2dig(ch)*16+hex2dig(cl);
-	    m->contents[bytepos++] = byte;
-	    byte_cnt++;
+	    memcpy(m->contents + addr, data, size);
+	    unmap_file(data, dlen, mapped);
+	} else {
+	    if (report_error)
+		fprintf(stderr, "Error reading file. Bad section kind %d\n",
+			kind);
+	    return 0;
 	}
+	byte_cnt += size;
     }
     return byte_cnt;
 }
 
+int load_mem(mem_t m, FILE *infile, int report_error)
+{
+    int c = getc(infile);
+    byte_t *image;
+    size_t len;
+    bool_t mapped;
+    int byte_cnt;
+    if (c != YBO_MAGIC[0]) {
+	if (c != EOF)
+	    ungetc(c, infile);
+	return load_yo(m, infile, report_error);
+    }
+    image = map_file(infile, c, &len, &mapped);
+    byte_cnt = load_ybo(m, image, len, report_error);
+    unmap_file(image, len, mapped);
+    return byte_cnt;
+}
 
 // Instruction Memory Functions
 
@@ -304,70 +528,75 @@ bool_t get_byte_val_I(mem_t m, word_t pos, byte_t *dest)
 
 bool_t get_word_val_I(mem_t m, word_t pos, word_t *dest)
 {
-    int i;
-    word_t val;
     if (pos < 0 || pos + 8 > m->len)
 	return FALSE;
-    val = 0;
-    for (i = 0; i < 8; i++) {
-	word_t b =  m->contents[pos+i] & 0xFF;
-	val = val | (b <<(8*i));
-    }
-    *dest = val;
+    *dest = load_word(m->contents + pos);
     return TRUE;
 }
 
-// Read and Write Cache blocks to memory.
+// Read and Write blocks of memory, such as cache lines.
 
-static void write_block(mem_t m, word_t pos, void *block) {
-	char *block_c = (char*) block;
-	for(int i = 0; i < get_block_size(); i++) {
-		m->contents[pos + i] = block_c[i];
-	}
+static bool_t block_ok(mem_t m, word_t pos, word_t cnt)
+{
+    return pos >= 0 && cnt >= 0 && pos <= m->len && cnt <= m->len - pos;
 }
 
-static void read_block(mem_t m, word_t pos, void *block) {
-	char *block_c = (char*) block;
-	for(int i = 0; i < get_block_size(); i++) {
-		block_c[i] = m->contents[pos + i];
-	}
+bool_t read_block(mem_t m, word_t pos, void *dest, word_t cnt)
+{
+    if (!block_ok(m, pos, cnt))
+	return FALSE;
+    memcpy(dest, m->contents + pos, cnt);
+    return TRUE;
 }
 
-bool_t inflight = FALSE;
-size_t inflight_cycles = 0;
-word_t inflight_pos = 0;
+bool_t write_block(mem_t m, word_t pos, const void *src, word_t cnt)
+{
+    if (!block_ok(m, pos, cnt))
+	return FALSE;
+    memcpy(m->contents + pos, src, cnt);
+    return TRUE;
+}
+
+bool_t fill_block(mem_t m, word_t pos, byte_t val, word_t cnt)
+{
+    if (!block_ok(m, pos, cnt))
+	return FALSE;
+    memset(m->contents + pos, val, cnt);
+    return TRUE;
+}
 
 // Accesses Memory. Memory has a five cycle delay unless a cache hit occurs.
 
 static mem_status_t access_memory(mem_t m, word_t pos) {
 	
-	word_t block_address = get_block_address(pos); 
-	if(check_hit(block_address)) {
+	struct cache *c = m->cache;
+	word_t block_address = get_block_address(c, pos); 
+	if(check_hit(c, block_address)) {
 		return READY;
 	}
 
-	if(inflight_pos != block_address || !inflight) {
-		inflight_pos = block_address;
-		inflight_cycles = 5;
-		inflight = TRUE;
+	if(m->inflight_pos != block_address || !m->inflight) {
+		m->inflight_pos = block_address;
+		m->inflight_cycles = 5;
+		m->inflight = TRUE;
 	}
 
-	inflight_cycles--;
-	if(inflight_cycles > 0) {
+	m->inflight_cycles--;
+	if(m->inflight_cycles > 0) {
 		return IN_FLIGHT;
 	}
 
-	inflight = FALSE;
+	m->inflight = FALSE;
 
-	void *block = calloc(get_block_size(), 1);
-	void *evicted_block = calloc(get_block_size(), 1);
-	read_block(m, block_address, block);
+	void *block = calloc(get_block_size(c), 1);
+	void *evicted_block = calloc(get_block_size(c), 1);
+	read_block(m, block_address, block, get_block_size(c));
 
 	word_t evicted_pos = 0;
-	bool_t evicted = handle_miss(block_address, block, &evicted_pos, evicted_block);
+	bool_t evicted = handle_miss(c, block_address, block, &evicted_pos, evicted_block);
 
 	if (evicted) {
-		write_block(m, evicted_pos, evicted_block);
+		write_block(m, evicted_pos, evicted_block, get_block_size(c));
 	}
 
 	free(block);
@@ -385,7 +614,7 @@ mem_status_t get_word_val_D(mem_t m, word_t pos, word_t *dest)
 
     mem_status_t status = access_memory(m, pos);
 	if(status == READY) {
-		get_word_cache(pos, dest);
+		get_word_cache(m->cache, pos, dest);
 	}
     return status;
 }
@@ -397,7 +626,7 @@ mem_status_t set_byte_val_D(mem_t m, word_t pos, byte_t val)
 
     mem_status_t status = access_memory(m, pos);
 	if(status == READY) {
-		set_byte_cache(pos, val);
+		set_byte_cache(m->cache, pos, val);
 	}
 	return status;
 }
@@ -409,7 +638,7 @@ mem_status_t set_word_val_D(mem_t m, word_t pos, word_t val)
 
 	mem_status_t status = access_memory(m, pos);
 	if(status == READY) {
-		set_word_cache(pos, val);
+		set_word_cache(m->cache, pos, val);
 	}
 	return status;
 }
@@ -421,7 +650,7 @@ mem_status_t get_byte_val_D(mem_t m, word_t pos, byte_t *dest)
 
 	mem_status_t status = access_memory(m, pos);
 	if(status == READY) {
-		get_byte_cache(pos, dest);
+		get_byte_cache(m->cache, pos, dest);
 	}
 	return status;
 }
@@ -623,6 +852,7 @@ state_ptr new_state(int memlen)
     result->r = init_reg();
     result->m = init_mem(memlen);
     result->cc = DEFAULT_CC;
+    memset(&result->stop, 0, sizeof(stop_rec));
     return result;
 }
 
@@ -639,6 +869,7 @@ state_ptr copy_state(state_ptr s) {
     result->r = copy_reg(s->r);
     result->m = copy_mem(s->m);
     result->cc = s->cc;
+    result->stop = s->stop;
     return result;
 }
 
@@ -702,8 +933,18 @@ bool_t cond_holds(cc_t cc, cond_t bcond) {
 }
 
 
+/* Note why the instruction at s->pc stopped execution */
+static stat_t fault(state_ptr s, stat_t e, stop_t why, word_t addr, int val)
+{
+    s->stop.why = why;
+    s->stop.pc = s->pc;
+    s->stop.addr = addr;
+    s->stop.val = val;
+    return e;
+}
+
 /* Execute single instruction.  Return status. */
-stat_t step_state(state_ptr s, FILE *error_file)
+static stat_t exec_instr(state_ptr s)
 {
     word_t argA, argB;
     byte_t byte0 = 0;
@@ -720,12 +961,8 @@ stat_t step_state(state_ptr s, FILE *error_file)
     bool_t need_imm;
     word_t ftpc = s->pc;  /* Fall-through PC */
 
-    if (!get_byte_val(s->m, ftpc, &byte0)) {
-	if (error_file)
-	    fprintf(error_file,
-		    "PC = 0x%llx, Invalid instruction address\n", s->pc);
-	return STAT_ADR;
-    }
+    if (!get_byte_val(s->m, ftpc, &byte0))
+	return fault(s, STAT_ADR, STOP_IMEM, 0, 0);
     ftpc++;
 
     hi0 = HI4(byte0);
@@ -757,124 +994,60 @@ stat_t step_state(state_ptr s, FILE *error_file)
 	s->pc = ftpc;
 	break;
     case I_HALT:
-	return STAT_HLT;
-	break;
+	return fault(s, STAT_HLT, STOP_HALT, 0, 0);
     case I_RRMOVQ:  /* Both unconditional and conditional moves */
-	if (!ok1) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid instruction address\n", s->pc);
-	    return STAT_ADR;
-	}
-	if (!reg_valid(hi1)) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid register ID 0x%.1x\n",
-			s->pc, hi1);
-	    return STAT_INS;
-	}
-	if (!reg_valid(lo1)) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid register ID 0x%.1x\n",
-			s->pc, lo1);
-	    return STAT_INS;
-	}
+	if (!ok1)
+	    return fault(s, STAT_ADR, STOP_IMEM, 0, 0);
+	if (!reg_valid(hi1))
+	    return fault(s, STAT_INS, STOP_REG, 0, hi1);
+	if (!reg_valid(lo1))
+	    return fault(s, STAT_INS, STOP_REG, 0, lo1);
 	val = get_reg_val(s->r, hi1);
 	if (cond_holds(s->cc, lo0))
 	  set_reg_val(s->r, lo1, val);
 	s->pc = ftpc;
 	break;
     case I_IRMOVQ:
-	if (!ok1) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid instruction address\n", s->pc);
-	    return STAT_ADR;
-	}
-	if (!okc) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid instruction address",
-			s->pc);
-	    return STAT_INS;
-	}
-	if (!reg_valid(lo1)) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid register ID 0x%.1x\n",
-			s->pc, lo1);
-	    return STAT_INS;
-	}
+	if (!ok1)
+	    return fault(s, STAT_ADR, STOP_IMEM, 0, 0);
+	if (!okc)
+	    return fault(s, STAT_INS, STOP_IMEM, 0, 0);
+	if (!reg_valid(lo1))
+	    return fault(s, STAT_INS, STOP_REG, 0, lo1);
 	set_reg_val(s->r, lo1, cval);
 	s->pc = ftpc;
 	break;
     case I_RMMOVQ:
-	if (!ok1) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid instruction address\n", s->pc);
-	    return STAT_ADR;
-	}
-	if (!okc) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid instruction address\n", s->pc);
-	    return STAT_INS;
-	}
-	if (!reg_valid(hi1)) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid register ID 0x%.1x\n",
-			s->pc, hi1);
-	    return STAT_INS;
-	}
+	if (!ok1)
+	    return fault(s, STAT_ADR, STOP_IMEM, 0, 0);
+	if (!okc)
+	    return fault(s, STAT_INS, STOP_IMEM, 0, 0);
+	if (!reg_valid(hi1))
+	    return fault(s, STAT_INS, STOP_REG, 0, hi1);
 	if (reg_valid(lo1)) 
 	    cval += get_reg_val(s->r, lo1);
 	val = get_reg_val(s->r, hi1);
-	if (!set_word_val(s->m, cval, val)) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid data address 0x%llx\n",
-			s->pc, cval);
-	    return STAT_ADR;
-	}
+	if (!set_word_val(s->m, cval, val))
+	    return fault(s, STAT_ADR, STOP_DMEM, cval, 0);
 	s->pc = ftpc;
 	break;
     case I_MRMOVQ:
-	if (!ok1) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid instruction address\n", s->pc);
-	    return STAT_ADR;
-	}
-	if (!okc) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid instruction addres\n", s->pc);
-	    return STAT_INS;
-	}
-	if (!reg_valid(hi1)) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid register ID 0x%.1x\n",
-			s->pc, hi1);
-	    return STAT_INS;
-	}
+	if (!ok1)
+	    return fault(s, STAT_ADR, STOP_IMEM, 0, 0);
+	if (!okc)
+	    return fault(s, STAT_INS, STOP_IMEM, 0, 0);
+	if (!reg_valid(hi1))
+	    return fault(s, STAT_INS, STOP_REG, 0, hi1);
 	if (reg_valid(lo1)) 
 	    cval += get_reg_val(s->r, lo1);
 	if (!get_word_val(s->m, cval, &val))
-	    return STAT_ADR;
+	    return fault(s, STAT_ADR, STOP_DMEM, cval, 0);
 	set_reg_val(s->r, hi1, val);
 	s->pc = ftpc;
 	break;
     case I_ALU:
-	if (!ok1) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid instruction address\n", s->pc);
-	    return STAT_ADR;
-	}
+	if (!ok1)
+	    return fault(s, STAT_ADR, STOP_IMEM, 0, 0);
 	argA = get_reg_val(s->r, hi1);
 	argB = get_reg_val(s->r, lo1);
 	val = compute_alu(lo0, argA, argB);
@@ -883,129 +1056,65 @@ stat_t step_state(state_ptr s, FILE *error_file)
 	s->pc = ftpc;
 	break;
     case I_JMP:
-	if (!ok1) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid instruction address\n", s->pc);
-	    return STAT_ADR;
-	}
-	if (!okc) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid instruction address\n", s->pc);
-	    return STAT_ADR;
-	}
+	if (!ok1)
+	    return fault(s, STAT_ADR, STOP_IMEM, 0, 0);
+	if (!okc)
+	    return fault(s, STAT_ADR, STOP_IMEM, 0, 0);
 	if (cond_holds(s->cc, lo0))
 	    s->pc = cval;
 	else
 	    s->pc = ftpc;
 	break;
     case I_CALL:
-	if (!ok1) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid instruction address\n", s->pc);
-	    return STAT_ADR;
-	}
-	if (!okc) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid instruction address\n", s->pc);
-	    return STAT_ADR;
-	}
+	if (!ok1)
+	    return fault(s, STAT_ADR, STOP_IMEM, 0, 0);
+	if (!okc)
+	    return fault(s, STAT_ADR, STOP_IMEM, 0, 0);
 	val = get_reg_val(s->r, REG_RSP) - 8;
 	set_reg_val(s->r, REG_RSP, val);
-	if (!set_word_val(s->m, val, ftpc)) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid stack address 0x%llx\n", s->pc, val);
-	    return STAT_ADR;
-	}
+	if (!set_word_val(s->m, val, ftpc))
+	    return fault(s, STAT_ADR, STOP_STACK, val, 0);
 	s->pc = cval;
 	break;
     case I_RET:
 	/* Return Instruction.  Pop address from stack */
 	dval = get_reg_val(s->r, REG_RSP);
-	if (!get_word_val(s->m, dval, &val)) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid stack address 0x%llx\n",
-			s->pc, dval);
-	    return STAT_ADR;
-	}
+	if (!get_word_val(s->m, dval, &val))
+	    return fault(s, STAT_ADR, STOP_STACK, dval, 0);
 	set_reg_val(s->r, REG_RSP, dval + 8);
 	s->pc = val;
 	break;
     case I_PUSHQ:
-	if (!ok1) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid instruction address\n", s->pc);
-	    return STAT_ADR;
-	}
-	if (!reg_valid(hi1)) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid register ID 0x%.1x\n", s->pc, hi1);
-	    return STAT_INS;
-	}
+	if (!ok1)
+	    return fault(s, STAT_ADR, STOP_IMEM, 0, 0);
+	if (!reg_valid(hi1))
+	    return fault(s, STAT_INS, STOP_REG, 0, hi1);
 	val = get_reg_val(s->r, hi1);
 	dval = get_reg_val(s->r, REG_RSP) - 8;
 	set_reg_val(s->r, REG_RSP, dval);
-	if  (!set_word_val(s->m, dval, val)) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid stack address 0x%llx\n", s->pc, dval);
-	    return STAT_ADR;
-	}
+	if (!set_word_val(s->m, dval, val))
+	    return fault(s, STAT_ADR, STOP_STACK, dval, 0);
 	s->pc = ftpc;
 	break;
     case I_POPQ:
-	if (!ok1) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid instruction address\n", s->pc);
-	    return STAT_ADR;
-	}
-	if (!reg_valid(hi1)) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid register ID 0x%.1x\n", s->pc, hi1);
-	    return STAT_INS;
-	}
+	if (!ok1)
+	    return fault(s, STAT_ADR, STOP_IMEM, 0, 0);
+	if (!reg_valid(hi1))
+	    return fault(s, STAT_INS, STOP_REG, 0, hi1);
 	dval = get_reg_val(s->r, REG_RSP);
 	set_reg_val(s->r, REG_RSP, dval+8);
-	if (!get_word_val(s->m, dval, &val)) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid stack address 0x%llx\n",
-			s->pc, dval);
-	    return STAT_ADR;
-	}
+	if (!get_word_val(s->m, dval, &val))
+	    return fault(s, STAT_ADR, STOP_STACK, dval, 0);
 	set_reg_val(s->r, hi1, val);
 	s->pc = ftpc;
 	break;
     case I_IADDQ:
-	if (!ok1) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid instruction address\n", s->pc);
-	    return STAT_ADR;
-	}
-	if (!okc) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid instruction address",
-			s->pc);
-	    return STAT_INS;
-	}
-	if (!reg_valid(lo1)) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid register ID 0x%.1x\n",
-			s->pc, lo1);
-	    return STAT_INS;
-	}
+	if (!ok1)
+	    return fault(s, STAT_ADR, STOP_IMEM, 0, 0);
+	if (!okc)
+	    return fault(s, STAT_INS, STOP_IMEM, 0, 0);
+	if (!reg_valid(lo1))
+	    return fault(s, STAT_INS, STOP_REG, 0, lo1);
 	argB = get_reg_val(s->r, lo1);
 	val = argB + cval;
 	set_reg_val(s->r, lo1, val);
@@ -1013,10 +1122,90 @@ stat_t step_state(state_ptr s, FILE *error_file)
 	s->pc = ftpc;
 	break;
     default:
-	if (error_file)
-	    fprintf(error_file,
-		    "PC = 0x%llx, Invalid instruction %.2x\n", s->pc, byte0);
-	return STAT_INS;
+	return fault(s, STAT_INS, STOP_INSTR, 0, byte0);
     }
     return STAT_AOK;
 }
+
+stat_t step_state(state_ptr s, FILE *error_file)
+{
+    stat_t e = exec_instr(s);
+    if (e != STAT_AOK && error_file)
+	print_stop(error_file, &s->stop);
+    return e;
+}
+
+static char *stop_names[] =
+    {"none", "halt", "budget", "deadline", "imem", "dmem", "stack",
+     "reg", "instr"};
+
+char *stop_name(stop_t why)
+{
+    if (why >= STOP_NONE && why <= STOP_INSTR)
+	return stop_names[why];
+    else
+	return "????";
+}
+
+void print_stop(FILE *outfile, stop_ptr sp)
+{
+    switch (sp->why) {
+    case STOP_IMEM:
+	fprintf(outfile, "PC = 0x%llx, Invalid instruction address\n",
+		sp->pc);
+	break;
+    case STOP_DMEM:
+	fprintf(outfile, "PC = 0x%llx, Invalid data address 0x%llx\n",
+		sp->pc, sp->addr);
+	break;
+    case STOP_STACK:
+	fprintf(outfile, "PC = 0x%llx, Invalid stack address 0x%llx\n",
+		sp->pc, sp->addr);
+	break;
+    case STOP_REG:
+	fprintf(outfile, "PC = 0x%llx, Invalid register ID 0x%.1x\n",
+		sp->pc, sp->val);
+	break;
+    case STOP_INSTR:
+	fprintf(outfile, "PC = 0x%llx, Invalid instruction %.2x\n",
+		sp->pc, sp->val);
+	break;
+    default:
+	break;
+    }
+}
+
+/* Instructions between checks of the deadline */
+#define RUN_SLICE (1 << 16)
+
+static double wall_time()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+stat_t run_state(state_ptr s, word_t max_steps, run_stats *rs)
+{
+    double end = rs && rs->deadline > 0 ? wall_time() + rs->deadline : 0;
+    word_t steps = 0;
+    stat_t e = STAT_AOK;
+
+    s->stop.why = STOP_NONE;
+    while (e == STAT_AOK && steps < max_steps) {
+	if (end > 0 && steps % RUN_SLICE == 0 && wall_time() >= end)
+	    break;
+	e = exec_instr(s);
+	steps++;
+    }
+    if (e == STAT_AOK) {
+	s->stop.why = steps < max_steps ? STOP_DEADLINE : STOP_BUDGET;
+	s->stop.pc = s->pc;
+    }
+    if (rs) {
+	rs->status = e;
+	rs->steps = steps;
+	rs->stop = s->stop;
+    }
+    return e;
+}
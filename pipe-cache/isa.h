@@ -95,11 +95,45 @@ typedef unsigned char byte_t;
 typedef long long int word_t;
 typedef long long unsigned uword_t;
 
+/* Little-endian word at p, at any alignment.  Where the host allows it
+   this is a single load or store. */
+static inline word_t load_word(const byte_t *p)
+{
+#if defined(__GNUC__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    word_t val;
+    __builtin_memcpy(&val, p, 8);
+    return val;
+#else
+    uword_t val = 0;
+    int i;
+    for (i = 7; i >= 0; i--)
+	val = (val << 8) | p[i];
+    return (word_t) val;
+#endif
+}
+
+static inline void store_word(byte_t *p, word_t val)
+{
+#if defined(__GNUC__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    __builtin_memcpy(p, &val, 8);
+#else
+    int i;
+    for (i = 0; i < 8; i++)
+	p[i] = (byte_t) ((uword_t) val >> (8*i));
+#endif
+}
+
 /* Represent a memory as an array of bytes */
 typedef struct {
   int len;
   word_t maxaddr;
   byte_t *contents;
+  /* Data cache seen by the _D accessors, or NULL, and the block being
+     fetched into it */
+  struct cache *cache;
+  bool_t inflight;
+  int inflight_cycles;
+  word_t inflight_pos;
 } mem_rec, *mem_t;
 
 /* Create a memory with len bytes */
@@ -123,15 +157,28 @@ bool_t diff_mem(mem_t oldm, mem_t newm, FILE *outfile);
 
 /*** In the following functions, a return value of 1 means success ***/
 
-/* Load memory from .yo file.  Return number of bytes read */
+/* Load memory from .yo or .ybo file.  Return number of bytes read */
 int load_mem(mem_t m, FILE *infile, int report_error);
 
+/* Binary object file (.ybo), in the format described in misc/isa.h */
+#define YBO_MAGIC "\177YBO\001\0\0\0"
+#define YBO_HEADER 24
+#define YBO_SECTION 32
+typedef enum { YBO_DATA, YBO_FILE } ybo_kind_t;
+
 /* Get byte from memory */
 bool_t get_byte_val_I(mem_t m, word_t pos, byte_t *dest);
 
 /* Get 8 bytes from memory */
 bool_t get_word_val_I(mem_t m, word_t pos, word_t *dest);
 
+/* Copy cnt bytes between memory starting at pos and a buffer, or set
+   them all to val, bypassing the cache.  Fail, changing nothing, unless
+   all are in memory. */
+bool_t read_block(mem_t m, word_t pos, void *dest, word_t cnt);
+bool_t write_block(mem_t m, word_t pos, const void *src, word_t cnt);
+bool_t fill_block(mem_t m, word_t pos, byte_t val, word_t cnt);
+
 
 
 /* Get byte from memory */
@@ -195,6 +242,24 @@ typedef enum
 /* Describe Status */
 char *stat_name(stat_t e);
 
+/* Why execution stopped */
+typedef enum
+ {STOP_NONE, STOP_HALT, STOP_BUDGET, STOP_DEADLINE,
+  STOP_IMEM, STOP_DMEM, STOP_STACK, STOP_REG, STOP_INSTR} stop_t;
+
+/* Describe stop reason */
+char *stop_name(stop_t why);
+
+typedef struct {
+  stop_t why;
+  word_t pc;    /* Instruction that stopped */
+  word_t addr;  /* Bad data or stack address */
+  int val;      /* Bad register ID or instruction byte */
+} stop_rec, *stop_ptr;
+
+/* Print the diagnostic for a stop, nothing unless it was an error */
+void print_stop(FILE *outfile, stop_ptr sp);
+
 /* **************** ISA level implementation *********/
 
 typedef struct {
@@ -202,6 +267,7 @@ typedef struct {
   mem_t r;
   mem_t m;
   cc_t cc;
+  stop_rec stop;  /* Why the last instruction failed or halted */
 } state_rec, *state_ptr;
 
 state_ptr new_state(int memlen);
@@ -215,3 +281,16 @@ bool_t cond_holds(cc_t cc, cond_t bcond);
 
 /* Execute single instruction.  Return status. */
 stat_t step_state(state_ptr s, FILE *error_file);
+
+/* Outcome of run_state() */
+typedef struct {
+  double deadline;  /* Set by caller: seconds of wall-clock time, 0 for none */
+  stat_t status;
+  word_t steps;     /* Instructions attempted */
+  stop_rec stop;
+} run_stats;
+
+/* Execute up to max_steps instructions without printing.  Stops early
+   at an error, halt, or the deadline in rs.  If rs nonnull, the outcome
+   is stored there; print_stop() formats the diagnostic. */
+stat_t run_state(state_ptr s, word_t max_steps, run_stats *rs);
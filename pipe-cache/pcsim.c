@@ -40,7 +40,7 @@ bool_t verbosity = 2;    /* Verbosity level [TTY only] (-v) */
 word_t instr_limit = 10000; /* Instruction limit [TTY only] (-l) */
 bool_t do_check = FALSE; /* Test with ISA simulator? [TTY only] (-t) */
 
-extern int verbosity_cache;
+cache_t *dcache;         /* Data cache, shaped by -s, -b and -E */
 
 /************* 
  * End Globals 
@@ -136,7 +136,7 @@ int sim_main(int argc, char **argv)
 	}
 
 
-    initCache(s, b, E);
+    dcache = initCache(s, b, E);
     run_tty_sim();
 
     exit(0);
@@ -167,7 +167,7 @@ static void run_tty_sim()
     sim_init();
 
     if (verbosity >= 2)
-        verbosity_cache = 1;
+        dcache->verbosity = 1;
 
     /* Emit simulator name */
     if (verbosity >= 2)
@@ -194,7 +194,7 @@ static void run_tty_sim()
     reg0 = copy_mem(reg);
     
     icount = sim_run_pipe(instr_limit, 5*instr_limit, &run_status, &result_cc);
-    verbosity_cache = 0;
+    dcache->verbosity = 0;
     if (verbosity > 0) {
 	printf("%lld instructions executed\n", icount);
 	printf("Status = %s\n", stat_name(run_status));
@@ -205,12 +205,12 @@ static void run_tty_sim()
 	diff_mem(mem0, mem, stdout);
     }
     if (do_check) {
-	byte_t e = STAT_AOK;
-	word_t step;
 	bool_t match = TRUE;
-	for (step = 0; step < instr_limit && e == STAT_AOK; step++) {
-	    e = step_state(isa_state, stdout);
-	}
+	run_stats rs;
+
+	rs.deadline = 0;
+	run_state(isa_state, instr_limit, &rs);
+	print_stop(stdout, &rs.stop);
 
 	if (diff_reg(isa_state->r, reg, NULL)) {
 	    match = FALSE;
@@ -379,21 +379,10 @@ void sim_stall_stage(stage_id_t stage) {
 
 static int initialized = 0;
 
-void sim_init()
+/* Point the stages at the current and next halves of the pipe
+   registers, which update_pipes() swaps */
+static void connect_pipes()
 {
-    /* Create memory and register files */
-    initialized = 1;
-    mem = init_mem(MEM_SIZE);
-    reg = init_reg();
-    
-    /* create 5 pipe registers */
-    pc_state     = new_pipe(sizeof(pc_ele), (void *) &bubble_pc);
-    if_id_state  = new_pipe(sizeof(if_id_ele), (void *) &bubble_if_id);
-    id_ex_state  = new_pipe(sizeof(id_ex_ele), (void *) &bubble_id_ex);
-    ex_mem_state = new_pipe(sizeof(ex_mem_ele), (void *) &bubble_ex_mem);
-    mem_wb_state = new_pipe(sizeof(mem_wb_ele), (void *) &bubble_mem_wb);
-  
-    /* connect them to the pipeline stages */
     pc_next   = pc_state->next;
     pc_curr   = pc_state->current;
   
@@ -408,6 +397,25 @@ void sim_init()
 
     mem_wb_next = mem_wb_state->next;
     mem_wb_curr = mem_wb_state->current;
+}
+
+void sim_init()
+{
+    /* Create memory and register files */
+    initialized = 1;
+    mem = init_mem(MEM_SIZE);
+    mem->cache = dcache;
+    reg = init_reg();
+    
+    /* create 5 pipe registers */
+    pc_state     = new_pipe(sizeof(pc_ele), (void *) &bubble_pc);
+    if_id_state  = new_pipe(sizeof(if_id_ele), (void *) &bubble_if_id);
+    id_ex_state  = new_pipe(sizeof(id_ex_ele), (void *) &bubble_id_ex);
+    ex_mem_state = new_pipe(sizeof(ex_mem_ele), (void *) &bubble_ex_mem);
+    mem_wb_state = new_pipe(sizeof(mem_wb_ele), (void *) &bubble_mem_wb);
+  
+    /* connect them to the pipeline stages */
+    connect_pipes();
 
     sim_reset();
     clear_mem(mem);
@@ -439,6 +447,10 @@ void sim_reset()
 
 /* Text representation of status */
 void tty_report(word_t cyc) {
+  /* Skip looking up the names when nothing is logged */
+  if (!dumpfile)
+    return;
+
   sim_log("\nCycle %lld. CC=%s, Stat=%s\n", cyc, cc_name(cc), stat_name(status));
 
   sim_log("F: predPC = 0x%llx\n", pc_curr->pc);
@@ -488,6 +500,7 @@ static byte_t sim_step_pipe(word_t max_instr, word_t ccount)
 {
     /* Update pipe registers */
     update_pipes();
+    connect_pipes();
     /* print status report in TTY mode */
     tty_report(ccount);
     /* error checking */
@@ -755,6 +768,15 @@ void sim_log( const char *format, ... ) {
 static pipe_ptr pipes[MAX_STAGE];
 static int pipe_count = 0;
 
+/* All the pipe registers live in one arena, each half starting on its
+   own cache line */
+#define PIPE_LINE 64
+#define PIPE_ARENA 4096
+
+static pipe_ele pipe_recs[MAX_STAGE];
+static unsigned char pipe_arena[PIPE_ARENA] __attribute__((aligned(PIPE_LINE)));
+static int arena_used = 0;
+
 /******************************************************************************
  *	function definitions
  ******************************************************************************/
@@ -763,9 +785,15 @@ static int pipe_count = 0;
 /* bubble_val indicates state corresponding to pipeline bubble */
 pipe_ptr new_pipe(int count, void *bubble_val)
 {
-  pipe_ptr result = (pipe_ptr) malloc(sizeof(pipe_ele));
-  result->current = malloc(count);
-  result->next = malloc(count);
+  pipe_ptr result = &pipe_recs[pipe_count];
+  int size = (count + PIPE_LINE - 1) & ~(PIPE_LINE - 1);
+  if (pipe_count == MAX_STAGE || arena_used + 2 * size > PIPE_ARENA) {
+    fprintf(stderr, "Too many pipe registers\n");
+    exit(1);
+  }
+  result->current = pipe_arena + arena_used;
+  result->next = pipe_arena + arena_used + size;
+  arena_used += 2 * size;
   memcpy(result->current, bubble_val, count);
   memcpy(result->next, bubble_val, count);
   result->count = count;
@@ -789,8 +817,13 @@ void update_pipes()
       	break;
       
       case P_LOAD:
-      	/* copy calculated state from previous stage */
-      	memcpy(p->current, p->next, p->count);
+      	/* calculated state from previous stage becomes current, and
+      	   the old current half is reused for the next state */
+      	{
+      	  void *t = p->current;
+      	  p->current = p->next;
+      	  p->next = t;
+      	}
       	break;
       case P_ERROR:
 	  /* Like a bubble, but insert error condition */
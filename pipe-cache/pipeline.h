@@ -18,7 +18,7 @@
  ******************************************************************************/
 
 /* Different control operations for pipeline register */
-/* LOAD:   Copy next state to current   */
+/* LOAD:   Next state becomes current   */
 /* STALL:  Keep current state unchanged */
 /* BUBBLE: Set current state to nop     */
 /* ERROR:  Occurs when both stall & load signals set */
@@ -26,7 +26,7 @@
 typedef enum { P_LOAD, P_STALL, P_BUBBLE, P_ERROR } p_stat_t;
 
 typedef struct {
-    /* Current and next register state */
+    /* Current and next register state, swapped on a load */
     void *current;
     void *next;
     /* Contents of register when bubble occurs */
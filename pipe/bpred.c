@@ -0,0 +1,297 @@
+/*
+ * bpred.c - Branch predictors for the fetch stage of PIPE
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "isa.h"
+#include "bpred.h"
+
+#define MAX_BITS 24
+
+/* 2-bit saturating counters: 0 and 1 predict not taken, 2 and 3 taken */
+static void count(byte_t *c, bool_t taken)
+{
+    if (taken && *c < 3)
+	(*c)++;
+    else if (!taken && *c > 0)
+	(*c)--;
+}
+
+static int local_idx(bpred_ptr bp, word_t pc)
+{
+    return (int) (pc & ((1 << bp->bits) - 1));
+}
+
+static int global_idx(bpred_ptr bp, word_t pc)
+{
+    word_t hist = bp->history & ((1 << bp->hist_bits) - 1);
+    return (int) ((pc ^ hist) & ((1 << bp->bits) - 1));
+}
+
+static void no_update(bpred_ptr bp, word_t pc, word_t target, bool_t taken)
+{
+}
+
+static bool_t taken_predict(bpred_ptr bp, word_t pc, word_t target)
+{
+    return TRUE;
+}
+
+static bool_t nottaken_predict(bpred_ptr bp, word_t pc, word_t target)
+{
+    return FALSE;
+}
+
+/* Backward taken, forward not taken: loops branch back */
+static bool_t btfnt_predict(bpred_ptr bp, word_t pc, word_t target)
+{
+    return target <= pc;
+}
+
+static bool_t bimodal_predict(bpred_ptr bp, word_t pc, word_t target)
+{
+    return bp->local[local_idx(bp, pc)] >= 2;
+}
+
+static void bimodal_update(bpred_ptr bp, word_t pc, word_t target,
+			   bool_t taken)
+{
+    count(&bp->local[local_idx(bp, pc)], taken);
+}
+
+static bool_t gshare_predict(bpred_ptr bp, word_t pc, word_t target)
+{
+    return bp->global[global_idx(bp, pc)] >= 2;
+}
+
+static void gshare_update(bpred_ptr bp, word_t pc, word_t target,
+			  bool_t taken)
+{
+    count(&bp->global[global_idx(bp, pc)], taken);
+    bp->history = (bp->history << 1) | (taken ? 1 : 0);
+}
+
+/* Choose between bimodal and gshare by which has been right more often
+   for this jump */
+static bool_t tournament_predict(bpred_ptr bp, word_t pc, word_t target)
+{
+    if (bp->chooser[local_idx(bp, pc)] >= 2)
+	return gshare_predict(bp, pc, target);
+    return bimodal_predict(bp, pc, target);
+}
+
+static void tournament_update(bpred_ptr bp, word_t pc, word_t target,
+			      bool_t taken)
+{
+    bool_t l = bimodal_predict(bp, pc, target) == taken;
+    bool_t g = gshare_predict(bp, pc, target) == taken;
+    if (l != g)
+	count(&bp->chooser[local_idx(bp, pc)], g);
+    bimodal_update(bp, pc, target, taken);
+    gshare_update(bp, pc, target, taken);
+}
+
+/* Counters start weakly taken, like the always-taken default */
+static byte_t *new_table(int bits)
+{
+    byte_t *t = (byte_t *) malloc(1 << bits);
+    memset(t, 2, 1 << bits);
+    return t;
+}
+
+/* Parse ":n" at *sp into *val, moving *sp past it.  Return FALSE if
+   there is no number after the colon */
+static bool_t parse_field(char **sp, int *val)
+{
+    char *end;
+    long v = strtol(*sp + 1, &end, 10);
+    if (end == *sp + 1 || v < 0 || v > MAX_BITS)
+	return FALSE;
+    *val = (int) v;
+    *sp = end;
+    return TRUE;
+}
+
+bpred_ptr new_bpred(char *spec)
+{
+    char kind[32];
+    int bits = 10, hist_bits;
+    bool_t have_hist = FALSE;
+    size_t len = strcspn(spec, ":");
+    char *p = spec + len;
+    bpred_ptr bp;
+    if (len == 0 || len >= sizeof(kind))
+	return NULL;
+    memcpy(kind, spec, len);
+    kind[len] = '\0';
+    if (*p == ':' && !parse_field(&p, &bits))
+	return NULL;
+    if (*p == ':') {
+	if (!parse_field(&p, &hist_bits))
+	    return NULL;
+	have_hist = TRUE;
+    }
+    /* The whole spec has to be used */
+    if (*p != '\0' || bits < 1)
+	return NULL;
+    if (!have_hist)
+	hist_bits = bits;
+    if (hist_bits > bits)
+	return NULL;
+    bp = (bpred_ptr) calloc(1, sizeof(bpred_rec));
+    bp->bits = bits;
+    bp->hist_bits = hist_bits;
+    bp->update = no_update;
+    if (!strcmp(kind, "taken")) {
+	bp->name = "taken";
+	bp->predict = taken_predict;
+    } else if (!strcmp(kind, "nottaken")) {
+	bp->name = "nottaken";
+	bp->predict = nottaken_predict;
+    } else if (!strcmp(kind, "btfnt")) {
+	bp->name = "btfnt";
+	bp->predict = btfnt_predict;
+    } else if (!strcmp(kind, "bimodal")) {
+	bp->name = "bimodal";
+	bp->predict = bimodal_predict;
+	bp->update = bimodal_update;
+	bp->local = new_table(bits);
+    } else if (!strcmp(kind, "gshare")) {
+	bp->name = "gshare";
+	bp->predict = gshare_predict;
+	bp->update = gshare_update;
+	bp->global = new_table(bits);
+    } else if (!strcmp(kind, "tournament")) {
+	bp->name = "tournament";
+	bp->predict = tournament_predict;
+	bp->update = tournament_update;
+	bp->local = new_table(bits);
+	bp->global = new_table(bits);
+	/* Start out trusting bimodal, which learns faster */
+	bp->chooser = new_table(bits);
+	memset(bp->chooser, 1, 1 << bits);
+    } else {
+	free((void *) bp);
+	return NULL;
+    }
+    return bp;
+}
+
+void free_bpred(bpred_ptr bp)
+{
+    free((void *) bp->local);
+    free((void *) bp->global);
+    free((void *) bp->chooser);
+    free((void *) bp);
+}
+
+void bpred_resolve(bpred_ptr bp, word_t pc, word_t target, bool_t taken,
+		   bool_t predicted)
+{
+    bp->predictions++;
+    if (taken != predicted) {
+	bp->mispredictions++;
+	/* The instructions fetched into D and F behind the jump */
+	bp->squashed += 2;
+    }
+    bp->update(bp, pc, target, taken);
+}
+
+void print_bpred(FILE *outfile, bpred_ptr bp, word_t cycles,
+		 word_t instructions)
+{
+    double cpi, ideal;
+    fprintf(outfile, "Branch predictor: %s", bp->name);
+    if (bp->local || bp->global)
+	fprintf(outfile, ", %d entries", 1 << bp->bits);
+    if (bp->global)
+	fprintf(outfile, ", %d history bits", bp->hist_bits);
+    fprintf(outfile, "\n");
+    fprintf(outfile, "Branches: %lld predicted, %lld mispredicted (%.2f%%), "
+	    "%lld slots squashed\n", bp->predictions, bp->mispredictions,
+	    bp->predictions > 0 ?
+	    100.0 * bp->mispredictions / bp->predictions : 0.0,
+	    bp->squashed);
+    if (instructions <= 0)
+	return;
+    cpi = (double) cycles / instructions;
+    ideal = (double) (cycles - bp->squashed) / instructions;
+    fprintf(outfile, "CPI: %.3f, %.3f without mispredictions (%+.3f)\n",
+	    cpi, ideal, ideal - cpi);
+}
+
+ras_ptr new_ras(int depth)
+{
+    ras_ptr ras = (ras_ptr) calloc(1, sizeof(ras_rec));
+    ras->depth = depth;
+    ras->stack = (word_t *) calloc(depth, sizeof(word_t));
+    return ras;
+}
+
+void free_ras(ras_ptr ras)
+{
+    free((void *) ras->stack);
+    free((void *) ras);
+}
+
+word_t ras_top(ras_ptr ras)
+{
+    return ras->sp > 0 ? ras->stack[(ras->sp - 1) % ras->depth] : 0;
+}
+
+bool_t ras_predict(ras_ptr ras, word_t *target)
+{
+    if (ras->sp <= 0)
+	return FALSE;
+    *target = ras_top(ras);
+    return TRUE;
+}
+
+void ras_push(ras_ptr ras, word_t addr)
+{
+    ras->stack[ras->sp % ras->depth] = addr;
+    ras->sp++;
+}
+
+void ras_pop(ras_ptr ras)
+{
+    if (ras->sp > 0)
+	ras->sp--;
+}
+
+void ras_restore(ras_ptr ras, word_t sp, word_t top)
+{
+    ras->sp = sp;
+    if (sp > 0)
+	ras->stack[(sp - 1) % ras->depth] = top;
+}
+
+void ras_verify_call(ras_ptr ras, word_t sp)
+{
+    if (sp > ras->depth)
+	ras->overflows++;
+}
+
+void ras_verify_ret(ras_ptr ras, bool_t predicted, bool_t hit)
+{
+    if (!predicted)
+	ras->empty++;
+    else if (hit)
+	ras->hits++;
+    else
+	ras->misses++;
+}
+
+void print_ras(FILE *outfile, ras_ptr ras)
+{
+    word_t predicted = ras->hits + ras->misses;
+    fprintf(outfile, "Return address stack: %d entries\n", ras->depth);
+    fprintf(outfile, "Returns: %lld predicted, %lld hit, %lld missed (%.2f%%), "
+	    "%lld with the stack empty, %lld overflows\n",
+	    predicted, ras->hits, ras->misses,
+	    predicted > 0 ? 100.0 * ras->misses / predicted : 0.0,
+	    ras->empty, ras->overflows);
+}
@@ -0,0 +1,87 @@
+/*
+ * bpred.h - Branch predictors for the fetch stage of PIPE
+ *
+ * A predictor guesses the direction of each conditional jump when it
+ * is fetched, and learns the outcome when the jump is resolved in the
+ * execute stage.  Unconditional jumps and calls are always taken and
+ * do not go through the predictor.
+ *
+ * A return address stack predicts where each ret goes: fetch pushes
+ * the return address of every call and pops it at the matching ret.
+ */
+
+#ifndef BPRED_H
+#define BPRED_H
+
+typedef struct bpred_rec {
+    char *name;
+    /* Guess whether the jump at pc to target is taken */
+    bool_t (*predict)(struct bpred_rec *bp, word_t pc, word_t target);
+    /* Learn the outcome of the jump at pc */
+    void (*update)(struct bpred_rec *bp, word_t pc, word_t target,
+		   bool_t taken);
+    /* Tables of 2-bit saturating counters, each with 1<<bits entries */
+    int bits;
+    int hist_bits;        /* Bits of global history used by gshare */
+    byte_t *local;        /* Indexed by PC: bimodal, and tournament */
+    byte_t *global;       /* Indexed by PC xor history: gshare, tournament */
+    byte_t *chooser;      /* Tournament: >= 2 means trust global */
+    word_t history;       /* Outcomes of the last jumps, newest in bit 0 */
+    /* Outcomes, counted as jumps are resolved */
+    word_t predictions;
+    word_t mispredictions;
+    word_t squashed;      /* Instruction slots lost to mispredictions */
+} bpred_rec, *bpred_ptr;
+
+/* Make a predictor from a spec "kind[:bits[:hist_bits]]", with kind
+   one of taken, nottaken, btfnt, bimodal, gshare or tournament.
+   Return NULL if the spec is invalid. */
+bpred_ptr new_bpred(char *spec);
+void free_bpred(bpred_ptr bp);
+
+/* Count the jump at pc as resolved, updating the predictor and the
+   statistics */
+void bpred_resolve(bpred_ptr bp, word_t pc, word_t target, bool_t taken,
+		   bool_t predicted);
+
+/* Print the statistics and the CPI without mispredictions */
+void print_bpred(FILE *outfile, bpred_ptr bp, word_t cycles,
+		 word_t instructions);
+
+typedef struct {
+    int depth;
+    word_t *stack;        /* Circular, so overflows lose the oldest */
+    word_t sp;            /* Pushes less pops; the top is stack[(sp-1) % depth] */
+    /* Outcomes, counted as calls and rets are verified, so that the
+       wrong path does not count */
+    word_t hits;
+    word_t misses;
+    word_t empty;         /* Rets fetched with the stack empty */
+    word_t overflows;     /* Calls whose push overwrote a live entry */
+} ras_rec, *ras_ptr;
+
+/* Make a return address stack of depth entries */
+ras_ptr new_ras(int depth);
+void free_ras(ras_ptr ras);
+
+/* Set *target to the predicted return address.  Return FALSE, and
+   predict nothing, if the stack is empty */
+bool_t ras_predict(ras_ptr ras, word_t *target);
+void ras_push(ras_ptr ras, word_t addr);
+void ras_pop(ras_ptr ras);
+word_t ras_top(ras_ptr ras);
+
+/* Put back the stack pointer and top entry saved before a squash, so
+   that calls and rets fetched down the wrong path are forgotten */
+void ras_restore(ras_ptr ras, word_t sp, word_t top);
+
+/* Count a call as verified, given the stack pointer after its push */
+void ras_verify_call(ras_ptr ras, word_t sp);
+
+/* Count a ret as verified: predicted or fetched with the stack empty,
+   and if predicted, whether the prediction was right */
+void ras_verify_ret(ras_ptr ras, bool_t predicted, bool_t hit);
+
+void print_ras(FILE *outfile, ras_ptr ras);
+
+#endif /* BPRED_H */
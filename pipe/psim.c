@@ -10,11 +10,13 @@
 #include <stdarg.h>
 #include <unistd.h>
 #include <string.h>
+#include <math.h>
 
 #include "isa.h"
 #include "pipeline.h"
 #include "stages.h"
 #include "sim.h"
+#include "bpred.h"
 
 #define MAXBUF 1024
 #define DEFAULTNAME "Y86-64 Simulator: "
@@ -38,6 +40,34 @@ FILE *object_file;       /* Input file handle */
 bool_t verbosity = 2;    /* Verbosity level [TTY only] (-v) */ 
 word_t instr_limit = 10000; /* Instruction limit [TTY only] (-l) */
 bool_t do_check = FALSE; /* Test with ISA simulator? [TTY only] (-t) */
+bool_t do_lockstep = FALSE; /* Test each instruction as it retires? (-T) */
+
+/* ISA simulator checking the pipeline, and whether lockstep checking
+   has found a difference */
+static state_ptr isa_state = NULL;
+static bool_t lockstep_failed = FALSE;
+char *prof_name = NULL;  /* Profile report file [TTY only] (-p) */
+char *folded_name = NULL; /* Folded stacks file [TTY only] (-F) */
+/* Sampled simulation [TTY only] (-S): fast-forward on the ISA simulator,
+   then warm up the pipeline and measure a window, over and over */
+word_t sample_ff = 0;
+word_t sample_warm = 0;
+word_t sample_window = 0;
+char *trace_name = NULL; /* Memory trace file [TTY only] (-M) */
+bool_t trace_fetches = FALSE; /* Trace instruction fetches too? (-i) */
+/* Predictor of conditional jumps (-B), always taken by default */
+bpred_ptr bpred = NULL;
+bool_t bpred_report = FALSE;
+ras_ptr ras = NULL;     /* Return address stack, if any (-R) */
+/* Bypass paths switched on (-b), and how often each was used or would
+   have saved a stall */
+static char *bypass_names[MUX_COUNT] =
+    {"reg", "e_valE", "m_valM", "M_valE", "W_valM", "W_valE", "load"};
+bool_t bypass_on[MUX_COUNT] = {TRUE, TRUE, TRUE, TRUE, TRUE, TRUE, FALSE};
+bool_t bypass_report = FALSE;
+static word_t bypass_uses[MUX_COUNT];
+static word_t bypass_stalls[MUX_COUNT];
+static word_t load_use_stalls = 0;  /* Stalls no bypass path can remove */
 
 /************* 
  * End Globals 
@@ -50,7 +80,13 @@ bool_t do_check = FALSE; /* Test with ISA simulator? [TTY only] (-t) */
 
 word_t sim_run_pipe(word_t max_instr, word_t max_cycle, byte_t *statusp, cc_t *ccp);
 static void usage(char *name);           /* Print helpful usage message */
+static bool_t set_bypass(char *list);    /* Switch on bypass paths */
+static void write_prof(char *name, bool_t folded); /* Write profile */
 static void run_tty_sim();               /* Run simulator in TTY mode */
+static void run_sampled();               /* Same, sampling the pipeline */
+static byte_t sim_step_pipe(word_t max_instr, word_t ccount);
+static void update_ras();
+static void count_bypass();
 
 /*************************
  * End function prototypes
@@ -75,7 +111,7 @@ int sim_main(int argc, char **argv)
     int c;
     
     /* Parse the command line arguments */
-    while ((c = getopt(argc, argv, "htl:v:")) != -1) {
+    while ((c = getopt(argc, argv, "htTil:v:p:F:S:M:B:R:b:")) != -1) {
 	switch(c) {
 	case 'h':
 	    usage(argv[0]);
@@ -93,6 +129,55 @@ int sim_main(int argc, char **argv)
 	case 't':
 	    do_check = TRUE;
 	    break;
+	case 'T':
+	    do_check = do_lockstep = TRUE;
+	    break;
+	case 'p':
+	    prof_name = optarg;
+	    break;
+	case 'F':
+	    folded_name = optarg;
+	    break;
+	case 'M':
+	    trace_name = optarg;
+	    break;
+	case 'B':
+	    if (bpred)
+		free_bpred(bpred);
+	    bpred = new_bpred(optarg);
+	    if (!bpred) {
+		printf("Invalid branch predictor '%s'\n", optarg);
+		usage(argv[0]);
+	    }
+	    bpred_report = TRUE;
+	    break;
+	case 'R':
+	    if (atoi(optarg) <= 0) {
+		printf("Invalid return address stack depth '%s'\n", optarg);
+		usage(argv[0]);
+	    }
+	    if (ras)
+		free_ras(ras);
+	    ras = new_ras(atoi(optarg));
+	    break;
+	case 'b':
+	    if (!set_bypass(optarg)) {
+		printf("Invalid bypass paths '%s'\n", optarg);
+		usage(argv[0]);
+	    }
+	    bypass_report = TRUE;
+	    break;
+	case 'i':
+	    trace_fetches = TRUE;
+	    break;
+	case 'S':
+	    if (sscanf(optarg, "%lld:%lld:%lld", &sample_ff, &sample_warm,
+		       &sample_window) != 3 || sample_ff < 0 ||
+		sample_warm < 0 || sample_window <= 0) {
+		printf("Invalid sampling parameters '%s'\n", optarg);
+		usage(argv[0]);
+	    }
+	    break;
 	default:
 	    printf("Invalid option '%c'\n", c);
 	    usage(argv[0]);
@@ -111,6 +196,37 @@ int sim_main(int argc, char **argv)
     }
 
 
+    if (!bpred)
+	bpred = new_bpred("taken");
+
+    /* Sampled windows would make a trace full of gaps */
+    if (trace_name && sample_window > 0) {
+	printf("Can't trace memory while sampling\n");
+	usage(argv[0]);
+    }
+    /* Checks, profiles and the predictor and bypass reports cover a
+       whole run, which sampling never makes */
+    if (sample_window > 0 && (do_check || prof_name || folded_name ||
+			      bpred_report || ras || bypass_report)) {
+	printf("Can't use -t, -T, -p, -F, -B, -R or -b while sampling\n");
+	usage(argv[0]);
+    }
+    if (trace_name) {
+	FILE *trace_file;
+	if (!strcmp(trace_name, "-")) {
+	    /* Keep stdout for the trace, for piping into csim, and send
+	       everything else to stderr */
+	    trace_file = fdopen(dup(1), "w");
+	    dup2(2, 1);
+	} else
+	    trace_file = fopen(trace_name, "w");
+	if (!trace_file) {
+	    fprintf(stderr, "Couldn't open trace file %s\n", trace_name);
+	    exit(1);
+	}
+	trace = open_trace(trace_file, trace_fetches);
+    }
+
     /* The single unflagged argument should be the object file name */
     object_filename = NULL;
     object_file = NULL;
@@ -140,8 +256,8 @@ static void run_tty_sim()
     byte_t run_status = STAT_AOK;
     cc_t result_cc = 0;
     word_t byte_cnt = 0;
-    mem_t mem0, reg0;
-    state_ptr isa_state = NULL;
+    mem_t mem0;
+    reg_t reg0;
 
 
     /* In TTY mode, the default object file comes from stdin */
@@ -164,18 +280,29 @@ static void run_tty_sim()
     } else if (verbosity >= 2) {
 	printf("%lld bytes of code read\n", byte_cnt);
     }
+    if (prof_name || folded_name) {
+	prof = new_prof(MEM_SIZE, TRUE);
+	rewind(object_file);
+	load_labels(prof, object_file);
+    }
     fclose(object_file);
+    if (sample_window > 0) {
+	run_sampled();
+	return;
+    }
     if (do_check) {
 	isa_state = new_state(0);
-	free_mem(isa_state->r);
+	free_reg(isa_state->r);
 	free_mem(isa_state->m);
 	isa_state->m = copy_mem(mem);
-	isa_state->r = copy_mem(reg);
-	isa_state->cc = cc;
+	isa_state->r = copy_reg(reg);
+	set_cc(isa_state, cc);
+	if (do_lockstep)
+	    isa_state->log = open_delta(NULL, isa_state);
     }
 
     mem0 = copy_mem(mem);
-    reg0 = copy_mem(reg);
+    reg0 = copy_reg(reg);
     
     icount = sim_run_pipe(instr_limit, 5*instr_limit, &run_status, &result_cc);
     if (verbosity > 0) {
@@ -188,29 +315,40 @@ static void run_tty_sim()
 	diff_mem(mem0, mem, stdout);
     }
     if (do_check) {
-	byte_t e = STAT_AOK;
-	word_t step;
 	bool_t match = TRUE;
-
-	for (step = 0; step < instr_limit && e == STAT_AOK; step++) {
-	    e = step_state(isa_state, stdout);
+	/* Stopped on the instruction limit, the pipeline's CC and memory
+	   include writes by instructions that have not retired.  Lockstep
+	   already checked each retired write, so only compare them when
+	   the pipeline stopped on a status. */
+	bool_t whole = !do_lockstep || run_status != STAT_AOK;
+	run_stats rs;
+
+	if (do_lockstep) {
+	    /* Already stepped along with the pipeline */
+	    print_stop(stdout, &isa_state->stop);
+	    /* A difference was reported where it happened */
+	    match = !lockstep_failed;
+	} else {
+	    rs.deadline = 0;
+	    run_state(isa_state, instr_limit, &rs);
+	    print_stop(stdout, &rs.stop);
 	}
 
-	if (diff_reg(isa_state->r, reg, NULL)) {
+	if (!lockstep_failed && diff_reg(isa_state->r, reg, NULL)) {
 	    match = FALSE;
 	    if (verbosity > 0) {
 		printf("ISA Register != Pipeline Register File\n");
 		diff_reg(isa_state->r, reg, stdout);
 	    }
 	}
-	if (diff_mem(isa_state->m, mem, NULL)) {
+	if (!lockstep_failed && whole && diff_mem(isa_state->m, mem, NULL)) {
 	    match = FALSE;
 	    if (verbosity > 0) {
 		printf("ISA Memory != Pipeline Memory\n");
 		diff_mem(isa_state->m, mem, stdout);
 	    }
 	}
-	if (isa_state->cc != result_cc) {
+	if (!lockstep_failed && whole && get_cc(isa_state) != result_cc) {
 	    match = FALSE;
 	    if (verbosity > 0) {
 		printf("ISA Cond. Codes (%s) != Pipeline Cond. Codes (%s)\n",
@@ -230,7 +368,157 @@ static void run_tty_sim()
 	printf("CPI: %lld cycles/%lld instructions = %.2f\n",
 	       cycles, instructions, cpi);
     }
+    if (bpred_report)
+	print_bpred(stdout, bpred, cycles, instructions);
+    if (ras)
+	print_ras(stdout, ras);
+    if (bypass_report) {
+	int i;
+	for (i = MUX_EX_E; i < MUX_COUNT; i++)
+	    printf("Bypass %-6s %-3s %lld operands, %lld stall cycles\n",
+		   bypass_names[i], bypass_on[i] ? "on" : "off",
+		   bypass_uses[i], bypass_stalls[i]);
+	printf("Load-use stall cycles no bypass removes: %lld\n",
+	       load_use_stalls);
+    }
 
+    if (prof_name)
+	write_prof(prof_name, FALSE);
+    if (folded_name)
+	write_prof(folded_name, TRUE);
+    if (trace) {
+	FILE *trace_file = trace->out;
+	close_trace(trace);
+	fclose(trace_file);
+    }
+}
+
+/*
+ * run_pipe_window - Run the pipeline from the architectural state of s
+ * until it retires sample_warm + sample_window instructions or stops.
+ * Set *cyclesp and *instrp to the cycles and instructions of the window
+ * after the warm-up, and *stoppedp if the pipeline stopped.  Return the
+ * number of instructions retired.
+ */
+static word_t run_pipe_window(state_ptr s, word_t *cyclesp, word_t *instrp,
+			      bool_t *stoppedp)
+{
+    word_t c0 = 0, i0 = 0;
+    bool_t measuring = FALSE;
+    byte_t run_status = STAT_AOK;
+
+    sim_reset();
+    free_mem(mem);
+    free_reg(reg);
+    mem = copy_mem(s->m);
+    reg = copy_reg(s->r);
+    cc = get_cc(s);
+    pc_curr->pc = pc_next->pc = s->pc;
+    *cyclesp = *instrp = 0;
+    for (;;) {
+	if (!measuring && instructions >= sample_warm) {
+	    c0 = cycles;
+	    i0 = instructions;
+	    measuring = TRUE;
+	}
+	if (instructions >= sample_warm + sample_window ||
+	    (run_status != STAT_AOK && run_status != STAT_BUB))
+	    break;
+	run_status = sim_step_pipe(sample_warm + sample_window - instructions,
+				   cycles);
+    }
+    if (measuring) {
+	*cyclesp = cycles - c0;
+	*instrp = instructions - i0;
+    }
+    *stoppedp = run_status != STAT_AOK && run_status != STAT_BUB;
+    sim_flush_log();
+    return instructions;
+}
+
+/*
+ * run_sampled - Estimate the CPI by systematic sampling.  The ISA
+ * simulator runs the program; every sample_ff instructions it hands its
+ * state to the pipeline, which warms up and measures one window.  The
+ * ISA simulator then executes the instructions the pipeline retired and
+ * carries on.
+ */
+static void run_sampled()
+{
+    state_ptr s = new_state(0);
+    run_stats rs;
+    stat_t e = STAT_AOK;
+    word_t total = 0;
+    word_t wcycles = 0, winstr = 0;
+    int n = 0, bad = 0;
+    double sum = 0.0, sumsq = 0.0;
+
+    free_reg(s->r);
+    free_mem(s->m);
+    s->m = copy_mem(mem);
+    s->r = copy_reg(reg);
+    set_cc(s, cc);
+    rs.deadline = 0;
+    while (e == STAT_AOK && total < instr_limit) {
+	word_t len = instr_limit - total;
+	word_t dc, di;
+	bool_t stopped;
+	if (len > sample_ff)
+	    len = sample_ff;
+	if (len > 0) {
+	    e = run_state(s, len, &rs);
+	    total += rs.steps;
+	    if (e != STAT_AOK || total >= instr_limit)
+		break;
+	}
+	len = run_pipe_window(s, &dc, &di, &stopped);
+	/* Once the pipeline stops, say at a halt it does not retire, the
+	   ISA simulator runs the program out */
+	if (stopped || len > instr_limit - total)
+	    len = instr_limit - total;
+	e = run_state(s, len, &rs);
+	total += rs.steps;
+	/* Registers are only written in WB, so they must agree */
+	if (diff_reg(s->r, reg, NULL))
+	    bad++;
+	if (di > 0) {
+	    double cpi = (double) dc / di;
+	    n++;
+	    sum += cpi;
+	    sumsq += cpi * cpi;
+	    wcycles += dc;
+	    winstr += di;
+	}
+    }
+
+    printf("%lld instructions executed\n", total);
+    printf("Status = %s\n", stat_name(e));
+    if (e != STAT_AOK && e != STAT_HLT)
+	print_stop(stdout, &s->stop);
+    printf("%d windows of %lld instructions, after %lld of warm-up, "
+	   "every %lld\n", n, sample_window, sample_warm,
+	   sample_ff + sample_warm + sample_window);
+    if (bad)
+	printf("Pipeline registers differ from ISA in %d windows\n", bad);
+    if (n == 0)
+	return;
+    {
+	double mean = sum / n;
+	double var = n > 1 ? (sumsq - n * mean * mean) / (n - 1) : 0.0;
+	double sd = var > 0 ? sqrt(var) : 0.0;
+	printf("CPI: %lld cycles/%lld instructions measured = %.2f\n",
+	       wcycles, winstr, (double) wcycles / winstr);
+	if (n < 2)
+	    return;
+	/* Normal approximation, as in SMARTS */
+	printf("CPI: %.3f +/- %.3f (95%% confidence), %.3f +/- %.3f "
+	       "(99.7%%)\n", mean, 1.96 * sd / sqrt(n), mean,
+	       3.0 * sd / sqrt(n));
+	if (mean > 0)
+	    printf("Coefficient of variation %.3f; +/-3%% at 99.7%% "
+		   "confidence needs %.0f windows\n", sd / mean,
+		   ceil(pow(3.0 * sd / mean / 0.03, 2)));
+    }
 }
 
 /*
@@ -243,9 +531,68 @@ static void usage(char *name)
     printf("   -l m   Set instruction limit to m [TTY mode only] (default %lld)\n", instr_limit);
     printf("   -v n   Set verbosity level to 0 <= n <= 2 [TTY mode only] (default %d)\n", verbosity);
     printf("   -t     Test result against ISA simulator [TTY mode only]\n");
+    printf("   -T     Test each instruction against ISA simulator as it retires\n");
+    printf("   -p f   Write cycles by label and PC to file f [TTY mode only]\n");
+    printf("   -F f   Write folded stacks of cycles to file f [TTY mode only]\n");
+    printf("   -S f:w:n  Sample: fast-forward f instructions, warm up the\n");
+    printf("          pipeline for w, measure n, and repeat [TTY mode only]\n");
+    printf("   -M f   Write memory accesses as a csim trace to file f, '-' for\n");
+    printf("          stdout [TTY mode only]\n");
+    printf("   -i     Include instruction fetches in the memory trace\n");
+    printf("   -B p   Predict conditional jumps with p[:bits[:history]], one of\n");
+    printf("          taken (default), nottaken, btfnt, bimodal, gshare or\n");
+    printf("          tournament, with 1<<bits table entries (default 10)\n");
+    printf("   -R n   Predict rets with a return address stack of n entries\n");
+    printf("   -b l   Switch on only the bypass paths in the comma-separated\n");
+    printf("          list l, from e_valE, m_valM, M_valE, W_valM, W_valE and\n");
+    printf("          load (store data from a load in M), or none (default\n");
+    printf("          all but load)\n");
     exit(0);
 }
 
+/*
+ * set_bypass - Switch on just the bypass paths named in the
+ * comma-separated list, or none.  Return FALSE if a name is unknown.
+ */
+static bool_t set_bypass(char *list)
+{
+    char buf[256];
+    char *name;
+    int i;
+    for (i = MUX_EX_E; i < MUX_COUNT; i++)
+	bypass_on[i] = FALSE;
+    strncpy(buf, list, sizeof(buf) - 1);
+    buf[sizeof(buf) - 1] = '\0';
+    for (name = strtok(buf, ","); name; name = strtok(NULL, ",")) {
+	if (!strcmp(name, "none"))
+	    continue;
+	for (i = MUX_EX_E; i < MUX_COUNT; i++)
+	    if (!strcmp(name, bypass_names[i]))
+		break;
+	if (i == MUX_COUNT)
+	    return FALSE;
+	bypass_on[i] = TRUE;
+    }
+    return TRUE;
+}
+
+/*
+ * write_prof - write the profile report, or its folded stacks
+ */
+static void write_prof(char *name, bool_t folded)
+{
+    FILE *f = fopen(name, "w");
+    if (!f) {
+	fprintf(stderr, "Can't open profile file '%s'\n", name);
+	return;
+    }
+    if (folded)
+	print_folded(f, prof);
+    else
+	print_prof(f, prof, 20);
+    fclose(f);
+}
+
 
 /*********************************************************
  * Part 2: This part contains the core simulator routines.
@@ -266,6 +613,16 @@ word_t instructions = 0;
 /* Has simulator gotten past initial bubbles? */
 static int starting_up = 1;
 
+/* Profile, if any.  Each instruction leaving WB is charged the cycles
+   since the previous one left, so stalls count against the instruction
+   held up by them. */
+prof_ptr prof = NULL;
+static word_t prof_cycles = 0;
+
+/* Memory trace, if any.  Data accesses are traced as the memory stage
+   makes them, fetches whenever the fetch stage moves on. */
+trace_ptr trace = NULL;
+
 
 
 /* Both instruction and data memory */
@@ -274,7 +631,7 @@ word_t minAddr = 0;
 word_t memCnt = 0;
 
 /* Register file */
-mem_t reg;
+reg_t reg;
 /* Condition code register */
 cc_t cc;
 /* Status code */
@@ -328,6 +685,42 @@ pipe_ptr pc_state, if_id_state, id_ex_state, ex_mem_state, mem_wb_state;
 sim_mode_t sim_mode = S_FORWARD;
 /* Log file */
 FILE *dumpfile = NULL;
+/* What goes to it, kept as events until there is something else to
+   print */
+log_ptr sim_events = NULL;
+
+static const log_event_rec ev_cycle =
+    {"\nCycle %lld. CC=%s, Stat=%s\n", "wCs"};
+static const log_event_rec ev_f = {"F: predPC = 0x%llx\n", "w"};
+static const log_event_rec ev_d =
+    {"D: instr = %s, rA = %s, rB = %s, valC = 0x%llx, valP = 0x%llx, Stat = %s\n",
+     "irrwws"};
+static const log_event_rec ev_e =
+    {"E: instr = %s, valC = 0x%llx, valA = 0x%llx, valB = 0x%llx\n   srcA = %s, srcB = %s, dstE = %s, dstM = %s, Stat = %s\n",
+     "iwwwrrrrs"};
+static const log_event_rec ev_m =
+    {"M: instr = %s, Cnd = %d, valE = 0x%llx, valA = 0x%llx\n   dstE = %s, dstM = %s, Stat = %s\n",
+     "idwwrrs"};
+static const log_event_rec ev_w =
+    {"W: instr = %s, valE = 0x%llx, valM = 0x%llx, dstE = %s, dstM = %s, Stat = %s\n",
+     "iwwrrs"};
+static const log_event_rec ev_fetch =
+    {"\tFetch: f_pc = 0x%llx, f_instr = %s\n", "wi"};
+static const log_event_rec ev_branch =
+    {"\tExecute: instr = %s, cc = %s, branch %staken\n", "iCS"};
+static const log_event_rec ev_alu =
+    {"\tExecute: ALU: %c 0x%llx 0x%llx --> 0x%llx\n", "cwww"};
+static const log_event_rec ev_new_cc = {"\tExecute: New cc=%s\n", "C"};
+static const log_event_rec ev_no_write =
+    {"\tCouldn't write to address 0x%llx\n", "w"};
+static const log_event_rec ev_write =
+    {"\tWrote 0x%llx to address 0x%llx\n", "ww"};
+static const log_event_rec ev_read =
+    {"\tMemory: Read 0x%llx from 0x%llx\n", "ww"};
+static const log_event_rec ev_wb =
+    {"\tWriteback: Wrote 0x%llx to register %s\n", "wr"};
+static const log_event_rec ev_conflict =
+    {"%s: Conflicting control signals for pipe register\n", "S"};
 
 
 /*****************************************************************************
@@ -363,21 +756,10 @@ void sim_stall_stage(stage_id_t stage) {
 
 static int initialized = 0;
 
-void sim_init()
+/* Point the stages at the current and next halves of the pipe
+   registers, which update_pipes() swaps */
+static void connect_pipes()
 {
-    /* Create memory and register files */
-    initialized = 1;
-    mem = init_mem(MEM_SIZE);
-    reg = init_reg();
-    
-    /* create 5 pipe registers */
-    pc_state  = new_pipe(sizeof(pc_ele), (void *) &bubble_pc);
-    if_id_state  = new_pipe(sizeof(if_id_ele), (void *) &bubble_if_id);
-    id_ex_state  = new_pipe(sizeof(id_ex_ele), (void *) &bubble_id_ex);
-    ex_mem_state = new_pipe(sizeof(ex_mem_ele), (void *) &bubble_ex_mem);
-    mem_wb_state = new_pipe(sizeof(mem_wb_ele), (void *) &bubble_mem_wb);
-  
-    /* connect them to the pipeline stages */
     pc_next   = pc_state->next;
     pc_curr   = pc_state->current;
   
@@ -392,6 +774,24 @@ void sim_init()
 
     mem_wb_next = mem_wb_state->next;
     mem_wb_curr = mem_wb_state->current;
+}
+
+void sim_init()
+{
+    /* Create memory and register files */
+    initialized = 1;
+    mem = init_mem(MEM_SIZE);
+    reg = init_reg();
+    
+    /* create 5 pipe registers */
+    pc_state  = new_pipe(sizeof(pc_ele), (void *) &bubble_pc);
+    if_id_state  = new_pipe(sizeof(if_id_ele), (void *) &bubble_if_id);
+    id_ex_state  = new_pipe(sizeof(id_ex_ele), (void *) &bubble_id_ex);
+    ex_mem_state = new_pipe(sizeof(ex_mem_ele), (void *) &bubble_ex_mem);
+    mem_wb_state = new_pipe(sizeof(mem_wb_ele), (void *) &bubble_mem_wb);
+  
+    /* connect them to the pipeline stages */
+    connect_pipes();
 
     sim_reset();
     clear_mem(mem);
@@ -402,11 +802,13 @@ void sim_reset()
     if (!initialized)
 	sim_init();
     clear_pipes();
-    clear_mem(reg);
+    clear_reg(reg);
     minAddr = 0;
     memCnt = 0;
     starting_up = 1;
     cycles = instructions = 0;
+    prof_cycles = 0;
+    lockstep_failed = FALSE;
     cc = DEFAULT_CC;
     status = STAT_AOK;
 
@@ -419,39 +821,44 @@ void sim_reset()
     mem_addr = 0;
     mem_data = 0;
     mem_write = FALSE;
+    if (ras)
+	ras->sp = 0;
 }
 
 /* Text representation of status */
 void tty_report(word_t cyc) {
-  sim_log("\nCycle %lld. CC=%s, Stat=%s\n", cyc, cc_name(cc), stat_name(status));
-
-  sim_log("F: predPC = 0x%llx\n", pc_curr->pc);
-
-  sim_log("D: instr = %s, rA = %s, rB = %s, valC = 0x%llx, valP = 0x%llx, Stat = %s\n",
-	  iname(HPACK(if_id_curr->icode, if_id_curr->ifun)),
-	  reg_name(if_id_curr->ra), reg_name(if_id_curr->rb),
-	  if_id_curr->valc, if_id_curr->valp,
-	  stat_name(if_id_curr->status));
-
-  sim_log("E: instr = %s, valC = 0x%llx, valA = 0x%llx, valB = 0x%llx\n   srcA = %s, srcB = %s, dstE = %s, dstM = %s, Stat = %s\n",
-	  iname(HPACK(id_ex_curr->icode, id_ex_curr->ifun)),
-	  id_ex_curr->valc, id_ex_curr->vala, id_ex_curr->valb,
-	  reg_name(id_ex_curr->srca), reg_name(id_ex_curr->srcb),
-	  reg_name(id_ex_curr->deste), reg_name(id_ex_curr->destm),
-	  stat_name(id_ex_curr->status));
-
-  sim_log("M: instr = %s, Cnd = %d, valE = 0x%llx, valA = 0x%llx\n   dstE = %s, dstM = %s, Stat = %s\n",
-	  iname(HPACK(ex_mem_curr->icode, ex_mem_curr->ifun)),
-	  ex_mem_curr->takebranch,
-	  ex_mem_curr->vale, ex_mem_curr->vala,
-	  reg_name(ex_mem_curr->deste), reg_name(ex_mem_curr->destm),
-	  stat_name(ex_mem_curr->status));
-
-  sim_log("W: instr = %s, valE = 0x%llx, valM = 0x%llx, dstE = %s, dstM = %s, Stat = %s\n",
-	  iname(HPACK(mem_wb_curr->icode, mem_wb_curr->ifun)),
-	  mem_wb_curr->vale, mem_wb_curr->valm,
-	  reg_name(mem_wb_curr->deste), reg_name(mem_wb_curr->destm),
-	  stat_name(mem_wb_curr->status));
+  if (!sim_events)
+    return;
+
+  LOG_EVENT(sim_events, 2, &ev_cycle, cyc, cc, status);
+
+  LOG_EVENT(sim_events, 2, &ev_f, pc_curr->pc);
+
+  LOG_EVENT(sim_events, 2, &ev_d,
+	    HPACK(if_id_curr->icode, if_id_curr->ifun),
+	    if_id_curr->ra, if_id_curr->rb,
+	    if_id_curr->valc, if_id_curr->valp,
+	    if_id_curr->status);
+
+  LOG_EVENT(sim_events, 2, &ev_e,
+	    HPACK(id_ex_curr->icode, id_ex_curr->ifun),
+	    id_ex_curr->valc, id_ex_curr->vala, id_ex_curr->valb,
+	    id_ex_curr->srca, id_ex_curr->srcb,
+	    id_ex_curr->deste, id_ex_curr->destm,
+	    id_ex_curr->status);
+
+  LOG_EVENT(sim_events, 2, &ev_m,
+	    HPACK(ex_mem_curr->icode, ex_mem_curr->ifun),
+	    ex_mem_curr->takebranch,
+	    ex_mem_curr->vale, ex_mem_curr->vala,
+	    ex_mem_curr->deste, ex_mem_curr->destm,
+	    ex_mem_curr->status);
+
+  LOG_EVENT(sim_events, 2, &ev_w,
+	    HPACK(mem_wb_curr->icode, mem_wb_curr->ifun),
+	    mem_wb_curr->vale, mem_wb_curr->valm,
+	    mem_wb_curr->deste, mem_wb_curr->destm,
+	    mem_wb_curr->status);
 }
 
 /******************************************************************
@@ -464,6 +871,42 @@ void tty_report(word_t cyc) {
  * correct state.
  ******************************************************************/
 
+/* Step the ISA simulator over the instruction leaving WB, and compare
+   its PC, status, and register and memory writes.  Report and return
+   FALSE if they differ. */
+static bool_t lockstep_check()
+{
+    writes_rec iw, pw;
+    word_t pc = isa_state->pc;
+    stat_t e = step_state(isa_state, NULL);
+
+    take_writes(isa_state->log, &iw);
+    clear_writes(&pw);
+    add_reg_write(&pw, wb_destE, wb_valE);
+    add_reg_write(&pw, wb_destM, wb_valM);
+    if (mem_wb_curr->mem_write)
+	add_mem_write(&pw, mem_wb_curr->mem_addr, mem_wb_curr->mem_data);
+    /* What a faulting instruction writes does not matter */
+    if (mem_wb_curr->stage_pc == pc && mem_wb_curr->status == e &&
+	(e != STAT_AOK || !diff_writes(&iw, &pw, NULL)))
+	return TRUE;
+
+    lockstep_failed = TRUE;
+    sim_flush_log();
+    printf("Lockstep check fails at instruction %lld, cycle %lld\n",
+	   instructions, cycles);
+    printf("ISA:      PC = 0x%llx, %s, Status '%s'\n", pc,
+	   iname(HPACK(mem_wb_curr->icode, mem_wb_curr->ifun)), stat_name(e));
+    printf("Pipeline: PC = 0x%llx, %s, Status '%s'\n", mem_wb_curr->stage_pc,
+	   iname(HPACK(mem_wb_curr->icode, mem_wb_curr->ifun)),
+	   stat_name(mem_wb_curr->status));
+    if (e == STAT_AOK && diff_writes(&iw, &pw, NULL)) {
+	printf("Writes differ (ISA, pipeline):\n");
+	diff_writes(&iw, &pw, stdout);
+    }
+    return FALSE;
+}
+
 /* Run pipeline for one cycle */
 /* Return status of processor */
 /* Max_instr indicates maximum number of instructions that
@@ -472,6 +915,7 @@ static byte_t sim_step_pipe(word_t max_instr, word_t ccount)
 {
     /* Update pipe registers */
     update_pipes();
+    connect_pipes();
     /* print status report in TTY mode */
     tty_report(ccount);
     /* error checking */
@@ -506,6 +950,11 @@ static byte_t sim_step_pipe(word_t max_instr, word_t ccount)
     do_id_stage();
     do_if_stage();
     do_stall_check();
+    if (ras)
+	update_ras();
+    count_bypass();
+    if (trace && pc_state->op == P_LOAD && if_id_next->valp > f_pc)
+	trace_access(trace, 'I', f_pc, (int) (if_id_next->valp - f_pc));
     void next_vala();
     void next_valb();
     bool_t set_CC_Val();
@@ -526,6 +975,13 @@ static byte_t sim_step_pipe(word_t max_instr, word_t ccount)
 	starting_up = 0;
 	instructions++;
 	cycles++;
+	if (prof) {
+	    prof_instr(prof, mem_wb_curr->stage_pc, mem_wb_curr->icode,
+		       mem_wb_curr->ifun, cycles - prof_cycles);
+	    prof_cycles = cycles;
+	}
+	if (do_lockstep && !lockstep_check())
+	    status = STAT_PIP;
     } else {
 	if (!starting_up)
 	    cycles++;
@@ -547,87 +1003,72 @@ void do_if_stage()
 
     word_t temp_C = 0; 
     word_t temp_P = 0;
-    byte_t instr = HPACK(I_NOP, F_NONE);
     byte_t reg_ID = HPACK(REG_NONE, REG_NONE);
+    decode_ptr d;
     if_id_next->status = STAT_AOK;
-    if(mem_wb_curr->icode == I_RET){
+    if(mem_wb_curr->icode == I_RET && !mem_wb_curr->predok){
          f_pc = mem_wb_curr->valm;
-    }else if(ex_mem_curr->icode == I_JMP && !ex_mem_curr->takebranch){
+    }else if(ex_mem_curr->icode == I_JMP &&
+             ex_mem_curr->takebranch != ex_mem_curr->predtaken){
         f_pc = ex_mem_curr->vala;
     }else{
         f_pc = pc_curr-> pc;
     }
-    imem_error = !get_byte_val(mem, f_pc, &instr);
-    imem_icode = HI4(instr); 
-    imem_ifun = LO4(instr);
+    d = decode_instr(mem, f_pc);
+    imem_error = !d->ok0;
+    imem_icode = d->icode; 
+    imem_ifun = d->ifun;
     if_id_next->ifun = imem_error ? F_NONE : imem_ifun;
     if_id_next->icode = imem_error ? I_NOP : imem_icode;
     instr_valid = TRUE;
     switch(if_id_next -> icode) {
         case I_HALT: 
-            temp_P = f_pc + 1;
+            temp_P = d->valp;
             if_id_next -> status = STAT_HLT;
             break;
 
         case I_NOP: 
-            temp_P = f_pc + 1;
+        case I_RET:
+            temp_P = d->valp;
             break;
 
         case I_RRMOVQ: 
-            dmem_error |= !get_byte_val(mem, f_pc + 1, &reg_ID);
-            temp_P = f_pc + 2;
+        case I_ALU: 
+        case I_PUSHQ: 
+        case I_POPQ: 
+            dmem_error |= !d->ok1;
+            reg_ID = HPACK(d->ra, d->rb);
+            temp_P = d->valp;
             break;
 
         case I_IRMOVQ: 
-            dmem_error |= !get_byte_val(mem, f_pc + 1, &reg_ID);
-            dmem_error |= !get_word_val(mem, f_pc + 2, &temp_C);
-            temp_P = f_pc + 10;
-            break;
-
         case I_RMMOVQ:
-            dmem_error |= !get_byte_val(mem, f_pc + 1, &reg_ID);
-            dmem_error |= !get_word_val(mem, f_pc + 2, &temp_C);
-            temp_P = f_pc + 10;
+            dmem_error |= !d->ok1;
+            dmem_error |= !d->okc;
+            reg_ID = HPACK(d->ra, d->rb);
+            temp_C = d->valc;
+            temp_P = d->valp;
             break;
 
         case I_MRMOVQ: 
-        	dmem_error |= !get_byte_val(mem, f_pc + 1, &reg_ID);
-            imem_error |= !get_word_val(mem, f_pc + 2, &temp_C);
-            temp_P = f_pc + 10;
-            break;
-   
-        case I_ALU: 
-            dmem_error |= !get_byte_val(mem, f_pc + 1, &reg_ID);
-            temp_P = f_pc + 2;
+        	dmem_error |= !d->ok1;
+            imem_error |= !d->okc;
+            reg_ID = HPACK(d->ra, d->rb);
+            temp_C = d->valc;
+            temp_P = d->valp;
             break;
    
         case I_JMP:
-            dmem_error |= !get_word_val(mem, f_pc + 1, &temp_C);
-            temp_P = f_pc + 9;
-            break;
-        
         case I_CALL:
-            dmem_error |= !get_word_val(mem, f_pc + 1, &temp_C);
-            temp_P = f_pc + 9;
-            break;
-            
-        case I_RET:
-            temp_P = f_pc + 1;
-			break;
-
-        case I_PUSHQ: 
-            dmem_error |= !get_byte_val(mem, f_pc + 1, &reg_ID);
-            temp_P  = f_pc + 2;
-            break;
-
-        case I_POPQ: 
-            dmem_error |= !get_byte_val(mem, f_pc + 1, &reg_ID);
-            temp_P = f_pc + 2;
+            dmem_error |= !d->okc;
+            temp_C = d->valc;
+            temp_P = d->valp;
             break;
 
         default:
             imem_error = TRUE;
             instr_valid = FALSE;
+			sim_flush_log();
 			printf("Invalid instruction\n");
 			break;
     }
@@ -641,51 +1082,114 @@ void do_if_stage()
     if_id_next -> rb = LO4(reg_ID);
     if_id_next -> valp = temp_P;
     if_id_next -> valc = temp_C;
-    if(if_id_next -> icode == I_JMP || if_id_next -> icode == I_CALL){
+    if_id_next -> stage_pc = f_pc;
+    /* Calls and unconditional jumps are taken, the predictor guesses
+       the conditional jumps, and the return address stack where rets
+       go, putting it in valC */
+    if (if_id_next -> icode == I_RET)
+        if_id_next -> predtaken = ras && ras_predict(ras, &if_id_next -> valc);
+    else
+        if_id_next -> predtaken = if_id_next -> icode == I_CALL ||
+            (if_id_next -> icode == I_JMP &&
+             (if_id_next -> ifun == C_YES ||
+              bpred -> predict(bpred, f_pc, if_id_next -> valc)));
+    if(if_id_next -> predtaken){
         pc_next -> pc = if_id_next -> valc;
     }else{
         pc_next -> pc = if_id_next -> valp;
     }
     /* logging function, do not change this */
     if (!imem_error) {
-        sim_log("\tFetch: f_pc = 0x%llx, f_instr = %s\n",
-            f_pc, iname(HPACK(if_id_next->icode, if_id_next->ifun)));
+        LOG_EVENT(sim_events, 2, &ev_fetch,
+            f_pc, HPACK(if_id_next->icode, if_id_next->ifun));
+    }
+}
+
+/* Stores take their data in valA, which can come from a load one
+   stage ahead */
+static bool_t is_store(byte_t icode)
+{
+    return icode == I_RMMOVQ || icode == I_PUSHQ;
+}
+
+/* Where decode finds register r: the bypass path from the nearest
+   instruction ahead that writes it, or else the register file */
+static mux_source_t operand_source(byte_t r)
+{
+    if (r == REG_NONE)
+        return MUX_NONE;
+    if (ex_mem_next->destm == r)
+        return MUX_LOAD;
+    if (ex_mem_next->deste == r)
+        return MUX_EX_E;
+    if (ex_mem_curr->destm == r)
+        return MUX_MEM_M;
+    if (ex_mem_curr->deste == r)
+        return MUX_MEM_E;
+    if (mem_wb_curr->destm == r)
+        return MUX_WB_M;
+    if (mem_wb_curr->deste == r)
+        return MUX_WB_E;
+    return MUX_NONE;
+}
+
+static word_t operand_val(mux_source_t src, byte_t r)
+{
+    switch (src) {
+    case MUX_EX_E:
+        return ex_mem_next->vale;
+    case MUX_MEM_M:
+        return mem_wb_next->valm;
+    case MUX_MEM_E:
+        return ex_mem_curr->vale;
+    case MUX_WB_M:
+        return mem_wb_curr->valm;
+    case MUX_WB_E:
+        return mem_wb_curr->vale;
+    case MUX_LOAD:
+        /* Not loaded yet: E picks it up, or decode stalls */
+        return 0;
+    default:
+        return get_reg_val(reg, r);
     }
 }
 
+/* Can decode take an operand from src?  The load path is only for
+   store data, and the others have to be switched on */
+static bool_t operand_ready(mux_source_t src, bool_t store_data)
+{
+    if (src == MUX_NONE)
+        return TRUE;
+    if (src == MUX_LOAD && !store_data)
+        return FALSE;
+    return bypass_on[src];
+}
+
+/* Decode has to wait for an operand */
+static bool_t operand_stall()
+{
+    return !operand_ready(amux, is_store(if_id_curr->icode)) ||
+        !operand_ready(bmux, FALSE);
+}
+
 void next_vala(){
-    if (if_id_curr -> icode == I_CALL || if_id_curr -> icode == I_JMP) {
+    if (if_id_curr -> icode == I_CALL) {
+        amux = MUX_NONE;
         id_ex_next->vala = if_id_curr->valp;
-    }else if (id_ex_next->srca == ex_mem_curr->destm) {
-        id_ex_next->vala = mem_wb_next->valm;
-    }else if (id_ex_next-> srca == ex_mem_next->deste) {
-        id_ex_next->vala = ex_mem_next->vale;
-    } else if (id_ex_next->srca == mem_wb_curr->destm) {
-        id_ex_next->vala = mem_wb_curr->valm;
-    } else if (id_ex_next->srca == ex_mem_curr->deste) {
-        id_ex_next->vala = ex_mem_curr->vale;
-    } else if (id_ex_next->srca == mem_wb_curr->deste) {
-        id_ex_next->vala = mem_wb_curr->vale;
+    }else if (if_id_curr -> icode == I_JMP) {
+        amux = MUX_NONE;
+        /* Where to go if the prediction turns out wrong */
+        id_ex_next->vala = if_id_curr->predtaken ?
+            if_id_curr->valp : if_id_curr->valc;
     } else {
-        id_ex_next->vala = get_reg_val(reg, id_ex_next->srca);
+        amux = operand_source(id_ex_next->srca);
+        id_ex_next->vala = operand_val(amux, id_ex_next->srca);
     }
 }
 
 void next_valb(){
-
-    if (id_ex_next->srcb == ex_mem_curr->destm) {
-        id_ex_next->valb = mem_wb_next->valm;
-    } else if (id_ex_next-> srcb == ex_mem_next->deste) {
-        id_ex_next->valb = ex_mem_next->vale;
-    } else if (id_ex_next->srcb == mem_wb_curr->destm) {
-        id_ex_next->valb = mem_wb_curr->valm;
-    } else if (id_ex_next->srcb == ex_mem_curr->deste) {
-        id_ex_next->valb = ex_mem_curr->vale;
-    } else if (id_ex_next->srcb == mem_wb_curr->deste) {
-        id_ex_next->valb = mem_wb_curr->vale;
-    } else {
-        id_ex_next->valb = get_reg_val(reg, id_ex_next->srcb);
-    }
+    bmux = operand_source(id_ex_next->srcb);
+    id_ex_next->valb = operand_val(bmux, id_ex_next->srcb);
 }
 
 /*************************** Decode stage ***************************
@@ -699,6 +1203,7 @@ void do_id_stage()
     // by getting valA and/or valB
     // typically, it reads the registers designated by instruction fields rA and rB
     // but for some instructions it reads register %rsp
+    id_ex_next -> valc = if_id_curr -> valc;
     id_ex_next -> vala = 0;
     id_ex_next -> valb = 0;
     id_ex_next -> deste = REG_NONE;
@@ -716,19 +1221,16 @@ void do_id_stage()
             break;
 
         case I_IRMOVQ:
-            id_ex_next -> valc = if_id_curr -> valc;
             id_ex_next -> deste = if_id_curr -> rb;
             
             break;
             
         case I_RMMOVQ:
-            id_ex_next -> valc = if_id_curr -> valc;
             id_ex_next -> srca = if_id_curr -> ra;
             id_ex_next -> srcb = if_id_curr -> rb;
             break;
             
         case I_MRMOVQ:
-            id_ex_next -> valc = if_id_curr -> valc;
             id_ex_next -> srcb = if_id_curr -> rb;
             id_ex_next -> destm = if_id_curr -> ra;
             break;
@@ -740,12 +1242,11 @@ void do_id_stage()
             break;
 
         case I_JMP: 
-            id_ex_next -> valc = if_id_curr -> valc;
-            id_ex_next->vala = if_id_curr->valp;
+            id_ex_next->vala = if_id_curr->predtaken ?
+                if_id_curr->valp : if_id_curr->valc;
             break;
 
         case I_CALL:
-            id_ex_next -> valc = if_id_curr -> valc;
             id_ex_next->vala = if_id_curr->valp;
             id_ex_next -> srcb = REG_RSP;
             id_ex_next -> deste = REG_RSP;
@@ -771,23 +1272,36 @@ void do_id_stage()
             break;
 
         default:
+            sim_flush_log();
             printf("icode is not valid (%d)", if_id_curr -> icode);
             break;
     }    
     id_ex_next->ifun = if_id_curr->ifun;
     id_ex_next->status = if_id_curr->status;
     id_ex_next->icode = if_id_curr->icode;
+    id_ex_next->stage_pc = if_id_curr->stage_pc;
+    id_ex_next->predtaken = if_id_curr->predtaken;
+    id_ex_next->ras_sp = if_id_curr->ras_sp;
+    id_ex_next->ras_top = if_id_curr->ras_top;
     next_vala();
     next_valb();
     
 }
 
+/* The ret in M was predicted, and its return address turned out
+   different: E, D and F hold the wrong path */
+static bool_t ret_mispredicted(){
+    return ex_mem_curr->icode == I_RET && ex_mem_curr->predtaken &&
+        !mem_wb_next->predok;
+}
+
 bool_t set_CC_Val(){
     bool_t m_stat = !(mem_wb_next -> status == STAT_HLT || mem_wb_next -> status == STAT_ADR
         || mem_wb_next -> status == STAT_INS);
     bool_t w_stat = !(mem_wb_curr -> status == STAT_HLT || mem_wb_curr -> status == STAT_ADR
         || mem_wb_curr -> status == STAT_INS);
-    return (id_ex_curr -> icode == I_ALU) && m_stat && w_stat; 
+    return (id_ex_curr -> icode == I_ALU) && m_stat && w_stat &&
+        !ret_mispredicted();
 }
 
 /************************** Execute stage **************************
@@ -827,7 +1341,7 @@ void do_ex_stage()
             break;
             
         case I_MRMOVQ:
-            ex_mem_next -> vale = alub + alua;
+            ex_mem_next -> vale = alub + id_ex_curr -> valc;
             break;
 
         case I_ALU:
@@ -855,33 +1369,48 @@ void do_ex_stage()
             break;
 
         default:
-            printf("icode is not valid (%d)", ex_mem_next -> icode);
+            sim_flush_log();
+            printf("icode is not valid (%d)", id_ex_curr -> icode);
             break;
     }
     ex_mem_next -> vala = alua;
     setcc = set_CC_Val();
     e_bcond = cond_holds(cc, id_ex_curr->ifun);
     ex_mem_next -> takebranch = e_bcond;
+    ex_mem_next -> predtaken = id_ex_curr -> predtaken;
+    ex_mem_next -> ras_sp = id_ex_curr -> ras_sp;
+    ex_mem_next -> ras_top = id_ex_curr -> ras_top;
+    ex_mem_next -> predpc = id_ex_curr -> valc;
+    if (id_ex_curr -> icode == I_JMP && id_ex_curr -> ifun != C_YES &&
+        !ret_mispredicted())
+        bpred_resolve(bpred, id_ex_curr -> stage_pc, id_ex_curr -> valc,
+                      e_bcond, id_ex_curr -> predtaken);
     ex_mem_next -> vala = id_ex_curr->vala;
+    /* Store data from the load just ahead, now in M */
+    if (bypass_on[MUX_LOAD] && is_store(id_ex_curr -> icode) &&
+        (ex_mem_curr -> icode == I_MRMOVQ || ex_mem_curr -> icode == I_POPQ) &&
+        ex_mem_curr -> destm == id_ex_curr -> srca)
+        ex_mem_next -> vala = mem_wb_next -> valm;
     ex_mem_next -> ifun = id_ex_curr->ifun;
     ex_mem_next -> icode = id_ex_curr->icode;
     bool_t my_cond = (id_ex_curr -> icode == I_RRMOVQ && !(ex_mem_next -> takebranch));
     ex_mem_next -> deste = my_cond ? REG_NONE : id_ex_curr -> deste;
    if (id_ex_curr->icode == I_JMP){
-        sim_log("\tExecute: instr = %s, cc = %s, branch %staken\n",
-                iname(HPACK(id_ex_curr->icode, id_ex_curr->ifun)),
-                cc_name(cc),
-                ex_mem_next->takebranch ? "" : "not ");
+        LOG_EVENT(sim_events, 2, &ev_branch,
+                  HPACK(id_ex_curr->icode, id_ex_curr->ifun),
+                  cc,
+                  ex_mem_next->takebranch ? "" : "not ");
     }
-    sim_log("\tExecute: ALU: %c 0x%llx 0x%llx --> 0x%llx\n",
-            op_name(alufun), alua, alub, ex_mem_next->vale);
+    LOG_EVENT(sim_events, 2, &ev_alu,
+              op_name(alufun), alua, alub, ex_mem_next->vale);
     if (setcc){
         cc = cc_in;
-        sim_log("\tExecute: New cc=%s\n", cc_name(cc_in));
+        LOG_EVENT(sim_events, 2, &ev_new_cc, cc_in);
     }
     ex_mem_next -> destm = id_ex_curr -> destm;
     ex_mem_next -> srca = id_ex_curr -> srca;
     ex_mem_next -> status =  id_ex_curr -> status;
+    ex_mem_next -> stage_pc = id_ex_curr -> stage_pc;
 }
 
 
@@ -903,6 +1432,7 @@ void do_mem_stage()
     bool_t read = FALSE;
     word_t valm = 0;
     mem_wb_next -> valm = valm;
+    mem_wb_next -> predok = FALSE;
     switch (ex_mem_curr -> icode) {
 		case I_HALT:
 			status = STAT_HLT;
@@ -924,6 +1454,8 @@ void do_mem_stage()
             read = TRUE;
             mem_addr = ex_mem_curr -> vale;
 			dmem_error |= !get_word_val(mem, mem_addr, &(mem_wb_next -> valm));
+			if (trace && !dmem_error)
+			    trace_access(trace, 'L', mem_addr, 8);
 			break;
 
 		case I_ALU: break;
@@ -934,10 +1466,21 @@ void do_mem_stage()
             mem_write = TRUE;
             mem_addr = ex_mem_curr -> vale;
             mem_data = ex_mem_curr -> vala;
+            if (ras)
+                ras_verify_call(ras, ex_mem_curr -> ras_sp);
             break;
             
         case I_RET:
             dmem_error |= !get_word_val(mem, ex_mem_curr -> vala, &(mem_wb_next -> valm));
+            if (trace && !dmem_error)
+                trace_access(trace, 'L', ex_mem_curr -> vala, 8);
+            /* Verify the return address fetch went on to */
+            if (ex_mem_curr -> predtaken && !dmem_error)
+                mem_wb_next -> predok =
+                    mem_wb_next -> valm == ex_mem_curr -> predpc;
+            if (ras && !dmem_error)
+                ras_verify_ret(ras, ex_mem_curr -> predtaken,
+                               mem_wb_next -> predok);
             break;
 
         case I_PUSHQ:
@@ -950,9 +1493,12 @@ void do_mem_stage()
             read = TRUE;
             mem_addr = ex_mem_curr -> vala;
             dmem_error |= !get_word_val(mem, ex_mem_curr -> vala, &(mem_wb_next -> valm));
+            if (trace && !dmem_error)
+                trace_access(trace, 'L', ex_mem_curr -> vala, 8);
             break;
 
         default:
+            sim_flush_log();
             printf("icode is not valid (%d)", ex_mem_curr -> icode);
             break;
     }
@@ -962,22 +1508,29 @@ void do_mem_stage()
     mem_wb_next -> vale = ex_mem_curr -> vale;
     mem_wb_next -> destm = ex_mem_curr -> destm;
     mem_wb_next -> deste = ex_mem_curr -> deste;
+    mem_wb_next -> stage_pc = ex_mem_curr -> stage_pc;
+    mem_wb_next -> mem_write = FALSE;
     if (mem_write)
     {
         if (!set_word_val(mem, mem_addr, mem_data))
         {
-            sim_log("\tCouldn't write to address 0x%llx\n", mem_addr);
+            LOG_EVENT(sim_events, 2, &ev_no_write, mem_addr);
         }
         else
         {
-            sim_log("\tWrote 0x%llx to address 0x%llx\n", mem_data, mem_addr);
+            mem_wb_next -> mem_write = TRUE;
+            mem_wb_next -> mem_addr = mem_addr;
+            mem_wb_next -> mem_data = mem_data;
+            if (trace)
+                trace_access(trace, 'S', mem_addr, 8);
+            LOG_EVENT(sim_events, 2, &ev_write, mem_data, mem_addr);
         }
     }
     /* logging function, do not change this */
     if (read && !dmem_error)
     {
-        sim_log("\tMemory: Read 0x%llx from 0x%llx\n",
-                mem_wb_next->valm, mem_addr);
+        LOG_EVENT(sim_events, 2, &ev_read,
+                  mem_wb_next->valm, mem_addr);
     }
 }
 
@@ -998,14 +1551,12 @@ void do_wb_stage()
     status = mem_wb_curr -> status == STAT_BUB ? STAT_AOK : mem_wb_curr -> status;
     if (wb_destE != REG_NONE)
     {
-        sim_log("\tWriteback: Wrote 0x%llx to register %s\n",
-                wb_valE, reg_name(wb_destE));
+        LOG_EVENT(sim_events, 2, &ev_wb, wb_valE, wb_destE);
         set_reg_val(reg, wb_destE, wb_valE);
     }
     if (wb_destM != REG_NONE)
     {
-        sim_log("\tWriteback: Wrote 0x%llx to register %s\n",
-                wb_valM, reg_name(wb_destM));
+        LOG_EVENT(sim_events, 2, &ev_wb, wb_valM, wb_destM);
         set_reg_val(reg, wb_destM, wb_valM);
     }
 }
@@ -1015,8 +1566,7 @@ p_stat_t pipe_cntl(char *name, word_t stall, word_t bubble)
 {
     if (stall) {
         if (bubble) {
-            sim_log("%s: Conflicting control signals for pipe register\n",
-                name);
+            LOG_EVENT(sim_events, 2, &ev_conflict, name);
             return P_ERROR;
         } else 
             return P_STALL;
@@ -1031,29 +1581,27 @@ bool_t pipe_cntl_F_Bubble(){
 
 bool_t pipe_cntl_F_Stall(){
     bool_t E_codeIN = id_ex_curr->icode == I_MRMOVQ || id_ex_curr->icode == I_POPQ;
-    bool_t dstMIN = id_ex_curr->destm == id_ex_next->srca || 
-        id_ex_curr->destm == id_ex_next->srcb;
-    bool_t I_RETIN = if_id_curr -> icode == I_RET || id_ex_curr -> icode == I_RET
-        || ex_mem_curr -> icode == I_RET; 
-    return E_codeIN && (dstMIN || I_RETIN);
+    bool_t I_RETIN = (if_id_curr -> icode == I_RET && !if_id_curr -> predtaken)
+        || (id_ex_curr -> icode == I_RET && !id_ex_curr -> predtaken)
+        || (ex_mem_curr -> icode == I_RET && !ex_mem_curr -> predtaken);
+    return operand_stall() || (E_codeIN && I_RETIN);
 }
 
 bool_t pipe_cntl_D_Stall(){
-    bool_t temp1 = (id_ex_curr->icode == I_MRMOVQ || id_ex_curr->icode == 
-        I_POPQ);
-    bool_t temp2 = (id_ex_curr->destm == id_ex_next->srca || 
-    id_ex_curr->destm == id_ex_next->srcb);
-    return  temp1 && temp2;
+    bool_t temp1 = id_ex_curr->icode == I_JMP &&
+        ex_mem_next->takebranch != id_ex_curr->predtaken;
+    bool_t temp2 = operand_stall();
+    return  !temp1 && temp2 && !ret_mispredicted();
 }
 
 bool_t pipe_cntl_D_Bubble(){
-    bool_t temp1 = id_ex_curr->icode == I_JMP && !ex_mem_next->takebranch;
-    bool_t temp2a = id_ex_curr->icode == I_MRMOVQ || id_ex_curr->icode == I_POPQ;
-    bool_t temp2b = (id_ex_curr->destm == id_ex_next->srca || 
-            id_ex_curr->destm == id_ex_next->srcb);
-    bool_t temp2c = I_RET == if_id_curr->icode || I_RET == id_ex_curr->icode || I_RET
-           == ex_mem_curr->icode;
-    return temp1 || (!(temp2a && temp2b) && temp2c);
+    bool_t temp1 = id_ex_curr->icode == I_JMP &&
+        ex_mem_next->takebranch != id_ex_curr->predtaken;
+    bool_t temp2 = operand_stall();
+    bool_t temp2c = (I_RET == if_id_curr->icode && !if_id_curr->predtaken) ||
+        (I_RET == id_ex_curr->icode && !id_ex_curr->predtaken) ||
+        (I_RET == ex_mem_curr->icode && !ex_mem_curr->predtaken);
+    return temp1 || (!temp2 && temp2c) || ret_mispredicted();
 }
 
 bool_t pipe_cntl_E_Stall(){
@@ -1061,10 +1609,9 @@ bool_t pipe_cntl_E_Stall(){
 }
 
 bool_t pipe_cntl_E_Bubble(){
-    bool_t branch = (id_ex_curr->icode == I_JMP) && !(ex_mem_next->takebranch);
-    bool_t E_codeIN = id_ex_curr->icode == I_MRMOVQ || id_ex_curr->icode == I_POPQ;
-    bool_t dstMIN = id_ex_curr->destm == id_ex_next->srca || id_ex_curr->destm == id_ex_next->srcb;
-    return (branch || (E_codeIN && dstMIN));
+    bool_t branch = (id_ex_curr->icode == I_JMP) &&
+        ex_mem_next->takebranch != id_ex_curr->predtaken;
+    return (branch || operand_stall() || ret_mispredicted());
 }
 
 bool_t pipe_cntl_M_Stall(){
@@ -1076,7 +1623,7 @@ bool_t pipe_cntl_M_Bubble(){
         || ex_mem_curr->status == STAT_HLT);
     bool_t w_stat = (mem_wb_curr->status == STAT_ADR || mem_wb_curr->status == STAT_INS 
         || mem_wb_curr->status == STAT_HLT);
-    return m_stat || w_stat; 
+    return m_stat || w_stat || ret_mispredicted();
 }
 
 bool_t pipe_cntl_W_Stall(){
@@ -1107,6 +1654,58 @@ void do_stall_check()
     mem_wb_state->op = pipe_cntl("WB", pipe_cntl_W_Stall(), pipe_cntl_W_Bubble()); 
 }
 
+/*
+ * count_bypass - Count the operands each bypass path passed to E, and
+ * the cycles decode stalled that switching the path on would have
+ * saved.  A load in E feeding anything but store data stalls whatever
+ * is switched on, so those cycles are counted apart.
+ */
+static void count_bypass()
+{
+    bool_t store = is_store(if_id_curr->icode);
+    bool_t a_ok, b_ok;
+    if (id_ex_state->op == P_LOAD) {
+	bypass_uses[amux]++;
+	bypass_uses[bmux]++;
+	return;
+    }
+    if (if_id_state->op != P_STALL || !operand_stall())
+	return;
+    if ((amux == MUX_LOAD && !store) || bmux == MUX_LOAD) {
+	load_use_stalls++;
+	return;
+    }
+    a_ok = operand_ready(amux, store);
+    b_ok = operand_ready(bmux, FALSE);
+    if (!a_ok)
+	bypass_stalls[amux]++;
+    if (!b_ok)
+	bypass_stalls[bmux]++;
+}
+
+/*
+ * update_ras - Push or pop the return address stack for the call or
+ * ret fetched this cycle, once it is loaded into D.  A squash first
+ * puts the stack back as it was after the mispredicted instruction
+ * was fetched.
+ */
+static void update_ras()
+{
+    if (ret_mispredicted())
+	ras_restore(ras, ex_mem_curr->ras_sp, ex_mem_curr->ras_top);
+    else if (id_ex_curr->icode == I_JMP &&
+	     ex_mem_next->takebranch != id_ex_curr->predtaken)
+	ras_restore(ras, id_ex_curr->ras_sp, id_ex_curr->ras_top);
+    if (if_id_state->op != P_LOAD)
+	return;
+    if (if_id_next->icode == I_CALL)
+	ras_push(ras, if_id_next->valp);
+    else if (if_id_next->icode == I_RET)
+	ras_pop(ras);
+    if_id_next->ras_sp = ras->sp;
+    if_id_next->ras_top = ras_top(ras);
+}
+
 /*
   Run pipeline until one of following occurs:
   - An error status is encountered in WB.
@@ -1133,13 +1732,23 @@ word_t sim_run_pipe(word_t max_instr, word_t max_cycle, byte_t *statusp, cc_t *c
 	*statusp = run_status;
     if (ccp)
 	*ccp = cc;
+    sim_flush_log();
     return icount;
 }
 
 /* If dumpfile set nonNULL, lots of status info printed out */
 void sim_set_dumpfile(FILE *df)
 {
+    if (sim_events)
+	close_log(sim_events);
     dumpfile = df;
+    sim_events = df ? open_log(df, verbosity) : NULL;
+}
+
+void sim_flush_log()
+{
+    if (sim_events)
+	flush_log(sim_events);
 }
 
 /*
@@ -1149,6 +1758,7 @@ void sim_set_dumpfile(FILE *df)
 void sim_log( const char *format, ... ) {
     if (dumpfile) {
 	va_list arg;
+	sim_flush_log();
 	va_start( arg, format );
 	vfprintf( dumpfile, format, arg );
 	va_end( arg );
@@ -1173,6 +1783,15 @@ void sim_log( const char *format, ... ) {
 static pipe_ptr pipes[MAX_STAGE];
 static int pipe_count = 0;
 
+/* All the pipe registers live in one arena, each half starting on its
+   own cache line */
+#define PIPE_LINE 64
+#define PIPE_ARENA 4096
+
+static pipe_ele pipe_recs[MAX_STAGE];
+static unsigned char pipe_arena[PIPE_ARENA] __attribute__((aligned(PIPE_LINE)));
+static int arena_used = 0;
+
 /******************************************************************************
  *	function definitions
  ******************************************************************************/
@@ -1181,9 +1800,15 @@ static int pipe_count = 0;
 /* bubble_val indicates state corresponding to pipeline bubble */
 pipe_ptr new_pipe(int count, void *bubble_val)
 {
-  pipe_ptr result = (pipe_ptr) malloc(sizeof(pipe_ele));
-  result->current = malloc(count);
-  result->next = malloc(count);
+  pipe_ptr result = &pipe_recs[pipe_count];
+  int size = (count + PIPE_LINE - 1) & ~(PIPE_LINE - 1);
+  if (pipe_count == MAX_STAGE || arena_used + 2 * size > PIPE_ARENA) {
+    fprintf(stderr, "Too many pipe registers\n");
+    exit(1);
+  }
+  result->current = pipe_arena + arena_used;
+  result->next = pipe_arena + arena_used + size;
+  arena_used += 2 * size;
   memcpy(result->current, bubble_val, count);
   memcpy(result->next, bubble_val, count);
   result->count = count;
@@ -1207,8 +1832,13 @@ void update_pipes()
       	break;
       
       case P_LOAD:
-      	/* copy calculated state from previous stage */
-      	memcpy(p->current, p->next, p->count);
+      	/* calculated state from previous stage becomes current, and
+      	   the old current half is reused for the next state */
+      	{
+      	  void *t = p->current;
+      	  p->current = p->next;
+      	  p->next = t;
+      	}
       	break;
       case P_ERROR:
 	  /* Like a bubble, but insert error condition */
@@ -1240,13 +1870,14 @@ void clear_pipes()
 
 pc_ele bubble_pc = {0,STAT_AOK};
 if_id_ele bubble_if_id = { I_NOP, 0, REG_NONE,REG_NONE,
-			   0, 0, STAT_BUB, 0};
+			   0, 0, FALSE, 0, 0, STAT_BUB, 0};
 id_ex_ele bubble_id_ex = { I_NOP, 0, 0, 0, 0,
 			   REG_NONE, REG_NONE, REG_NONE, REG_NONE,
-			   STAT_BUB, 0};
+			   FALSE, 0, 0, STAT_BUB, 0};
 
 ex_mem_ele bubble_ex_mem = { I_NOP, 0, FALSE, 0, 0,
-			     REG_NONE, REG_NONE, STAT_BUB, 0};
+			     REG_NONE, REG_NONE, REG_NONE, FALSE, 0, 0, 0,
+			     STAT_BUB, 0};
 
 mem_wb_ele bubble_mem_wb = { I_NOP, 0, 0, 0, REG_NONE, REG_NONE,
-			     STAT_BUB, 0};
+			     FALSE, STAT_BUB, 0};
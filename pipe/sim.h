@@ -1,9 +1,11 @@
 
 /********** Typedefs ************/
 
-/* EX stage mux settings */
-typedef enum { MUX_NONE, MUX_EX_A, MUX_EX_B, MUX_MEM_E,
-	       MUX_WB_M, MUX_WB_E } mux_source_t;
+/* EX stage mux settings: where decode got valA or valB, from the
+   register file (MUX_NONE) or a bypass path.  MUX_LOAD is a load still
+   in E, which only a store's data can wait for */
+typedef enum { MUX_NONE, MUX_EX_E, MUX_MEM_M, MUX_MEM_E,
+	       MUX_WB_M, MUX_WB_E, MUX_LOAD, MUX_COUNT } mux_source_t;
 
 /* Simulator operating modes */
 typedef enum { S_WEDGED, S_STALL, S_FORWARD } sim_mode_t;
@@ -26,6 +28,10 @@ typedef enum { IF_STAGE, ID_STAGE, EX_STAGE, MEM_STAGE, WB_STAGE } stage_id_t;
 extern word_t cycles;
 /* How many instructions have passed through the EX stage? */
 extern word_t instructions;
+/* Profile of the instructions leaving WB, or NULL */
+extern prof_ptr prof;
+/* Memory trace of the fetch and memory stages, or NULL */
+extern trace_ptr trace;
 
 /* Both instruction and data memory */
 extern mem_t mem;
@@ -35,7 +41,7 @@ extern word_t minAddr;
 extern word_t memCnt;
 
 /* Register file */
-extern mem_t reg;
+extern reg_t reg;
 /* Condition code register */
 extern cc_t cc;
 extern stat_t stat;
@@ -88,6 +94,8 @@ extern bool_t dmem_error;
 extern sim_mode_t sim_mode;
 /* Log file */
 extern FILE *dumpfile;
+/* Events for the log file, or NULL */
+extern log_ptr sim_events;
 
 /*************** Simulation Control Functions ***********/
 
@@ -127,3 +135,6 @@ void sim_set_dumpfile(FILE *file);
  */
 void sim_log( const char *format, ... );
 
+/* Print the logged events, before printing anything else */
+void sim_flush_log();
+
@@ -19,6 +19,9 @@ typedef struct {
     byte_t rb; /* Register rb ID */
     word_t valc;  /* Instruction word encoding immediate data */
     word_t valp; /* Incremented program counter */
+    bool_t predtaken;  /* Jump predicted taken, or ret's target known */
+    word_t ras_sp;     /* Return address stack after this fetch, */
+    word_t ras_top;    /* to repair it when younger ones are squashed */
     stat_t status;
     /* The following is included for debugging */
     word_t stage_pc;
@@ -35,6 +38,9 @@ typedef struct {
     byte_t srcb;  /* Source Reg ID for valB */
     byte_t deste; /* Destination register for valE */
     byte_t destm; /* Destination register for valM */
+    bool_t predtaken;  /* Jump predicted taken, or ret's target known */
+    word_t ras_sp;     /* Return address stack after this fetch, */
+    word_t ras_top;    /* to repair it when younger ones are squashed */
     stat_t status;
     /* The following is included for debugging */
     word_t stage_pc;
@@ -50,6 +56,10 @@ typedef struct {
     byte_t deste; /* Destination register for valE */
     byte_t destm; /* Destination register for valM */
     byte_t srca;  /* Source register for valA */
+    bool_t predtaken;  /* Jump predicted taken, or ret's target known */
+    word_t ras_sp;     /* Return address stack after this fetch, */
+    word_t ras_top;    /* to repair it when younger ones are squashed */
+    word_t predpc;     /* ret: return address predicted at fetch */
     stat_t status;
     /* The following is included for debugging */
     word_t stage_pc;
@@ -63,9 +73,13 @@ typedef struct {
     word_t valm;         /* valM */
     byte_t deste; /* Destination register for valE */
     byte_t destm; /* Destination register for valM */
+    bool_t predok;       /* ret: valM is the address fetch predicted */
     stat_t status;
     /* The following is included for debugging */
     word_t stage_pc;
+    bool_t mem_write;    /* Memory write made in the M stage */
+    word_t mem_addr;
+    word_t mem_data;
 } mem_wb_ele, *mem_wb_ptr;
 
 /************ Global Declarations ********************/
@@ -18,7 +18,7 @@ extern word_t minAddr;
 extern word_t memCnt;
 
 /* Register file */
-extern mem_t reg;
+extern reg_t reg;
 /* Condition code register */
 extern cc_t cc;
 /* Program counter */
@@ -46,6 +46,8 @@ extern byte_t status;
 
 /* Log file */
 extern FILE *dumpfile;
+/* Events for the log file, or NULL */
+extern log_ptr sim_events;
 
 
 /* Sets the simulator name (called from main routine in HCL file) */
@@ -77,4 +79,7 @@ void sim_set_dumpfile(FILE *file);
  */
 void sim_log( const char *format, ... );
 
+/* Print the logged events, before printing anything else */
+void sim_flush_log();
+
 								       
@@ -34,9 +34,16 @@ FILE *object_file;       /* Input file handle */
 bool_t verbosity = 2;    /* Verbosity level [TTY only] (-v) */ 
 word_t instr_limit = 10000; /* Instruction limit [TTY only] (-l) */
 bool_t do_check = FALSE; /* Test with YIS? [TTY only] (-t) */
+bool_t do_lockstep = FALSE; /* Test each instruction as it executes? (-T) */
+
+/* ISA simulator checking the processor, and whether lockstep checking
+   has found a difference */
+static state_ptr isa_state = NULL;
+static bool_t lockstep_failed = FALSE;
 
 /* keep a copy of mem and reg for diff display */
-mem_t mem0, reg0;
+mem_t mem0;
+reg_t reg0;
 
 /************* 
  * End Globals 
@@ -73,7 +80,7 @@ int sim_main(int argc, char **argv)
     int c;
     
     /* Parse the command line arguments */
-    while ((c = getopt(argc, argv, "htl:v:")) != -1) {
+    while ((c = getopt(argc, argv, "htTl:v:")) != -1) {
 	switch(c) {
 	case 'h':
 	    usage(argv[0]);
@@ -91,6 +98,9 @@ int sim_main(int argc, char **argv)
 	case 't':
 	    do_check = TRUE;
 	    break;
+	case 'T':
+	    do_check = do_lockstep = TRUE;
+	    break;
 	default:
 	    printf("Invalid option '%c'\n", c);
 	    usage(argv[0]);
@@ -140,7 +150,6 @@ static void run_tty_sim()
     status = STAT_AOK;
     cc_t result_cc = 0;
     word_t byte_cnt = 0;
-    state_ptr isa_state = NULL;
 
 
     /* In TTY mode, the default object file comes from stdin */
@@ -166,15 +175,17 @@ static void run_tty_sim()
     fclose(object_file);
     if (do_check) {
 	isa_state = new_state(0);
-	free_mem(isa_state->r);
+	free_reg(isa_state->r);
 	free_mem(isa_state->m);
 	isa_state->m = copy_mem(mem);
-	isa_state->r = copy_mem(reg);
-	isa_state->cc = cc;
+	isa_state->r = copy_reg(reg);
+	set_cc(isa_state, cc);
+	if (do_lockstep)
+	    isa_state->log = open_delta(NULL, isa_state);
     }
 
     mem0 = copy_mem(mem);
-    reg0 = copy_mem(reg);
+    reg0 = copy_reg(reg);
     
 
     icount = sim_run(instr_limit, &status, &result_cc);
@@ -188,29 +199,35 @@ static void run_tty_sim()
 	diff_mem(mem0, mem, stdout);
     }
     if (do_check) {
-	byte_t e = STAT_AOK;
-	int step;
 	bool_t match = TRUE;
+	run_stats rs;
 
-	for (step = 0; step < instr_limit && e == STAT_AOK; step++) {
-	    e = step_state(isa_state, stdout);
+	if (do_lockstep) {
+	    /* Already stepped along with the processor */
+	    print_stop(stdout, &isa_state->stop);
+	    /* A difference was reported where it happened */
+	    match = !lockstep_failed;
+	} else {
+	    rs.deadline = 0;
+	    run_state(isa_state, instr_limit, &rs);
+	    print_stop(stdout, &rs.stop);
 	}
 
-	if (diff_reg(isa_state->r, reg, NULL)) {
+	if (!lockstep_failed && diff_reg(isa_state->r, reg, NULL)) {
 	    match = FALSE;
 	    if (verbosity > 0) {
 		printf("ISA Register != Pipeline Register File\n");
 		diff_reg(isa_state->r, reg, stdout);
 	    }
 	}
-	if (diff_mem(isa_state->m, mem, NULL)) {
+	if (!lockstep_failed && diff_mem(isa_state->m, mem, NULL)) {
 	    match = FALSE;
 	    if (verbosity > 0) {
 		printf("ISA Memory != Pipeline Memory\n");
 		diff_mem(isa_state->m, mem, stdout);
 	    }
 	}
-	if (isa_state->cc != result_cc) {
+	if (!lockstep_failed && get_cc(isa_state) != result_cc) {
 	    match = FALSE;
 	    if (verbosity > 0) {
 		printf("ISA Cond. Codes (%s) != Pipeline Cond. Codes (%s)\n",
@@ -237,6 +254,7 @@ static void usage(char *name)
     printf("   -l m   Set instruction limit to m [TTY mode only] (default %lld)\n", instr_limit);
     printf("   -v n   Set verbosity level to 0 <= n <= 3 [TTY mode only] (default %d)\n", verbosity);
     printf("   -t     Test result against ISA simulator (yis) [TTY mode only]\n");
+    printf("   -T     Test each instruction against ISA simulator as it executes\n");
     exit(0);
 }
 
@@ -259,7 +277,7 @@ word_t minAddr = 0;
 word_t memCnt = 0;
 
 /* Other processor state */
-mem_t reg;               /* Register file */
+reg_t reg;               /* Register file */
 cc_t cc = DEFAULT_CC;    /* Condition code register */
 cc_t cc_in = DEFAULT_CC; /* Input to condition code register */
 
@@ -300,6 +318,17 @@ byte_t status = STAT_AOK;
 
 /* Log file */
 FILE *dumpfile = NULL;
+/* What goes to it, kept as events until there is something else to
+   print */
+log_ptr sim_events = NULL;
+
+static const log_event_rec ev_write =
+    {"Wrote 0x%llx to address 0x%llx\n", "ww"};
+static const log_event_rec ev_fetch =
+    {"IF: Fetched %s at 0x%llx.  ra=%s, rb=%s, valC = 0x%llx\n", "iwrrw"};
+static const log_event_rec ev_step = {"-------- Step %d --------\n", "d"};
+static const log_event_rec ev_step_end = {"Status '%s', CC %s\n", "sC"};
+static const log_event_rec ev_reg_changes = {"Changes to registers:\n", ""};
 
 
 /********************
@@ -323,7 +352,7 @@ void sim_reset()
 {
     if (!initialized)
 	sim_init();
-    clear_mem(reg);
+    clear_reg(reg);
     minAddr = 0;
     memCnt = 0;
 
@@ -372,7 +401,7 @@ static void update_state()
     if (mem_write) {
       /* Should have already tested this address */
         set_word_val(mem, mem_addr, mem_data);
-	    sim_log("Wrote 0x%llx to address 0x%llx\n", mem_data, mem_addr);
+	    LOG_EVENT(sim_events, 2, &ev_write, mem_data, mem_addr);
     }
 }
 
@@ -399,8 +428,9 @@ static byte_t sim_step()
      ************************************************************/
 
     /* dummy placeholders, replace them with your implementation */
-		byte_t tempB;
-		dmem_error |= !get_byte_val(mem, pc, &instr);
+		decode_ptr d = decode_instr(mem, pc);
+		dmem_error |= !d->ok0;
+		instr = d->instr;
 		icode = HI4(instr);
     ifun = LO4(instr);
 		ra = REG_NONE;
@@ -409,10 +439,10 @@ static byte_t sim_step()
 
 		switch (instr) {
 			case HPACK(I_NOP, F_NONE):
-				valp = pc + 1;
+				valp = d->valp;
 				break;
 			case HPACK(I_HALT, F_NONE):
-				valp = pc + 1;
+				valp = d->valp;
 				break;
 
 			case HPACK(I_RRMOVQ, F_NONE): 
@@ -422,43 +452,46 @@ static byte_t sim_step()
 			case HPACK(I_RRMOVQ, C_NE): 
 			case HPACK(I_RRMOVQ, C_GE): 
 			case HPACK(I_RRMOVQ, C_G): 
-				dmem_error |= !get_byte_val(mem, pc + 1, &tempB);
-				ra = HI4(tempB);
-				rb = LO4(tempB);
-				valp = pc + 2;
+				dmem_error |= !d->ok1;
+				ra = d->ra;
+				rb = d->rb;
+				valp = d->valp;
 				break;
 
 			case HPACK(I_IRMOVQ, F_NONE):
-				dmem_error |= !get_byte_val(mem, pc + 1, &tempB);
-				rb = LO4(tempB);
-				dmem_error |= !get_word_val(mem, pc + 2, &valc);
-				valp = pc + 10;
+				dmem_error |= !d->ok1;
+				rb = d->rb;
+				dmem_error |= !d->okc;
+				valc = d->valc;
+				valp = d->valp;
 				break;
 
 			case HPACK(I_RMMOVQ, F_NONE): 
-				dmem_error |= !get_byte_val(mem, pc + 1, &tempB);
-				ra = HI4(tempB);
-				rb = LO4(tempB);
-				dmem_error |= !get_word_val(mem, pc + 2, &valc);
-				valp = pc + 10;
+				dmem_error |= !d->ok1;
+				ra = d->ra;
+				rb = d->rb;
+				dmem_error |= !d->okc;
+				valc = d->valc;
+				valp = d->valp;
 				break;
 
 			case HPACK(I_MRMOVQ, F_NONE): 
-				dmem_error |= !get_byte_val(mem, pc + 1, &tempB);
-				ra = HI4(tempB);
-				rb = LO4(tempB);
-				dmem_error |= !get_word_val(mem, pc + 2, &valc);
-				valp = pc + 10;
+				dmem_error |= !d->ok1;
+				ra = d->ra;
+				rb = d->rb;
+				dmem_error |= !d->okc;
+				valc = d->valc;
+				valp = d->valp;
 				break;
 
 			case HPACK(I_ALU, A_ADD): 
 			case HPACK(I_ALU, A_SUB): 
 			case HPACK(I_ALU, A_AND): 
 			case HPACK(I_ALU, A_XOR): 
-				dmem_error |= !get_byte_val(mem, pc + 1, &tempB);
-				ra = HI4(tempB);
-				rb = LO4(tempB);
-				valp = pc + 2;
+				dmem_error |= !d->ok1;
+				ra = d->ra;
+				rb = d->rb;
+				valp = d->valp;
 				break;
 
 			case HPACK(I_JMP, C_YES): 
@@ -468,42 +501,45 @@ static byte_t sim_step()
 			case HPACK(I_JMP, C_NE): 
 			case HPACK(I_JMP, C_GE): 
 			case HPACK(I_JMP, C_G): 
-				dmem_error |= !get_word_val(mem, pc + 1, &valc);
-				valp = pc + 9;
+				dmem_error |= !d->okc;
+				valc = d->valc;
+				valp = d->valp;
 				break;
 
 			case HPACK(I_CALL, F_NONE):
-				dmem_error |= !get_word_val(mem, pc + 1, &valc);
-				valp = pc + 9;
+				dmem_error |= !d->okc;
+				valc = d->valc;
+				valp = d->valp;
 				break;
 
 			case HPACK(I_RET, F_NONE):
-				valp = pc + 1;
+				valp = d->valp;
 				break;
 
 			case HPACK(I_PUSHQ, F_NONE): 
-				dmem_error |= !get_byte_val(mem, pc + 1, &tempB);
-				ra = HI4(tempB);
-				rb = LO4(tempB);
-				valp = pc + 2;
+				dmem_error |= !d->ok1;
+				ra = d->ra;
+				rb = d->rb;
+				valp = d->valp;
 				break;
 
 			case HPACK(I_POPQ, F_NONE):
-				dmem_error |= !get_byte_val(mem, pc + 1, &tempB);
-				ra = HI4(tempB);
-				rb = LO4(tempB);
-				valp = pc + 2;
+				dmem_error |= !d->ok1;
+				ra = d->ra;
+				rb = d->rb;
+				valp = d->valp;
 				break;
 				
 			default:
 				imem_error = TRUE;
+				sim_flush_log();
 				printf("Invalid instruction\n");
 				break;
 		}
 
     /* logging function, do not change this */
-    sim_log("IF: Fetched %s at 0x%llx.  ra=%s, rb=%s, valC = 0x%llx\n",
-	    iname(HPACK(icode,ifun)), pc, reg_name(ra), reg_name(rb), valc);
+    LOG_EVENT(sim_events, 2, &ev_fetch,
+	      HPACK(icode,ifun), pc, ra, rb, valc);
     
     /*********************** Decode stage ************************
      * TODO: update [srcA, srcB, destE, destM, vala, valb]
@@ -575,6 +611,7 @@ static byte_t sim_step()
 				break;
 
 			default:
+				sim_flush_log();
 				printf("icode is not valid (%d)", icode);
 				break;
 		}
@@ -600,6 +637,9 @@ static byte_t sim_step()
 		
 			case I_RRMOVQ: // aka CMOVQ
 				vale = vala;
+				/* A cmove whose condition fails writes nothing */
+				if (!cond_holds(cc, ifun))
+					destE = REG_NONE;
 				break;
 
 			case I_IRMOVQ:
@@ -640,6 +680,7 @@ static byte_t sim_step()
 				break;
 
 			default:
+				sim_flush_log();
 				printf("icode is not valid (%d)", icode);
 				break;
 		}
@@ -703,6 +744,7 @@ static byte_t sim_step()
 				break;
 
 			default:
+				sim_flush_log();
 				printf("icode is not valid (%d)", icode);
 				break;
 		}
@@ -767,6 +809,7 @@ static byte_t sim_step()
 				break;
 
 			default:
+				sim_flush_log();
 				printf("icode is not valid (%d)", icode);
 				break;
 
@@ -779,6 +822,43 @@ static byte_t sim_step()
 			: status;
 }
 
+/* Step the ISA simulator over the instruction just executed, and
+   compare its PC, status, next PC, condition codes, and register and
+   memory writes.  Report and return FALSE if they differ. */
+static bool_t lockstep_check(word_t count, byte_t e)
+{
+    writes_rec iw, sw;
+    word_t ipc = isa_state->pc;
+    stat_t ie = step_state(isa_state, NULL);
+
+    take_writes(isa_state->log, &iw);
+    clear_writes(&sw);
+    add_reg_write(&sw, destE, vale);
+    add_reg_write(&sw, destM, valm);
+    if (mem_write)
+	add_mem_write(&sw, mem_addr, mem_data);
+    /* What a faulting instruction does does not matter */
+    if (pc == ipc && e == ie &&
+	(ie != STAT_AOK ||
+	 (pc_in == isa_state->pc && cc_in == get_cc(isa_state) &&
+	  !diff_writes(&iw, &sw, NULL))))
+	return TRUE;
+
+    lockstep_failed = TRUE;
+    sim_flush_log();
+    printf("Lockstep check fails at instruction %lld\n", count);
+    printf("ISA: PC = 0x%llx, %s, Status '%s', next PC = 0x%llx, CC %s\n",
+	   ipc, iname(instr), stat_name(ie), isa_state->pc,
+	   cc_name(get_cc(isa_state)));
+    printf("SEQ: PC = 0x%llx, %s, Status '%s', next PC = 0x%llx, CC %s\n",
+	   pc, iname(instr), stat_name(e), pc_in, cc_name(cc_in));
+    if (ie == STAT_AOK && diff_writes(&iw, &sw, NULL)) {
+	printf("Writes differ (ISA, SEQ):\n");
+	diff_writes(&iw, &sw, stdout);
+    }
+    return FALSE;
+}
+
 /*
   Run processor until one of following occurs:
   - An error status is encountered in WB.
@@ -794,15 +874,18 @@ word_t sim_run(word_t max_instr, byte_t *statusp, cc_t *ccp)
     byte_t run_status = STAT_AOK;
     while (icount < max_instr) {
         if (verbosity == 3) {
-            sim_log("-------- Step %d --------\n", icount + 1);
+            LOG_EVENT(sim_events, 3, &ev_step, (int) (icount + 1));
         }
         run_status = sim_step();
         icount++;
+        if (do_lockstep && !lockstep_check(icount, run_status))
+            run_status = STAT_PIP;
 
         /* print step-wise diff if verbosity = 3 */
         if (verbosity == 3) {
-            sim_log("Status '%s', CC %s\n", stat_name(status), cc_name(cc_in));
-            sim_log("Changes to registers:\n");
+            LOG_EVENT(sim_events, 3, &ev_step_end, status, cc_in);
+            LOG_EVENT(sim_events, 3, &ev_reg_changes);
+            sim_flush_log();
             diff_reg(reg0, reg, stdout);
 
             printf("\nChanges to memory:\n");
@@ -817,13 +900,23 @@ word_t sim_run(word_t max_instr, byte_t *statusp, cc_t *ccp)
 	*statusp = run_status;
     if (ccp)
 	*ccp = cc;
+    sim_flush_log();
     return icount;
 }
 
 /* If dumpfile set nonNULL, lots of status info printed out */
 void sim_set_dumpfile(FILE *df)
 {
+    if (sim_events)
+	close_log(sim_events);
     dumpfile = df;
+    sim_events = df ? open_log(df, verbosity) : NULL;
+}
+
+void sim_flush_log()
+{
+    if (sim_events)
+	flush_log(sim_events);
 }
 
 /*
@@ -833,6 +926,7 @@ void sim_set_dumpfile(FILE *df)
 void sim_log( const char *format, ... ) {
     if (dumpfile) {
 	va_list arg;
+	sim_flush_log();
 	va_start( arg, format );
 	vfprintf( dumpfile, format, arg );
 	va_end( arg );